@@ -0,0 +1,197 @@
+#ifndef BENCH_HARNESS_HPP
+#define BENCH_HARNESS_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <ctime>
+#include <thread>
+
+#include <unistd.h>
+
+
+namespace bench{
+
+
+template<typename T>
+inline void do_not_optimize(const T& value){
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+
+struct result{
+    std::string name;
+    std::uint64_t iterations;
+    std::size_t samples;
+    double median_ns;
+    double mean_ns;
+    double min_ns;
+    double max_ns;
+    double stddev_ns;
+    double bytes_per_op;
+};
+
+
+// Writes the "context" member of a JSON report, without a trailing comma
+inline void write_context(std::FILE* out, std::string_view suite){
+
+    char date[64] {};
+    std::time_t now {std::time(nullptr)};
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", std::localtime(&now));
+
+    char host[256] {};
+    gethostname(host, sizeof(host) - 1);
+
+    std::fprintf(out, "  \"context\": {\n");
+    std::fprintf(out, "    \"suite\": \"%.*s\",\n", static_cast<int>(suite.size()), suite.data());
+    std::fprintf(out, "    \"date\": \"%s\",\n", date);
+    std::fprintf(out, "    \"host_name\": \"%s\",\n", host);
+    std::fprintf(out, "    \"num_cpus\": %u,\n", std::thread::hardware_concurrency());
+#if defined(NDEBUG)
+    std::fprintf(out, "    \"library_build_type\": \"release\",\n");
+#else
+    std::fprintf(out, "    \"library_build_type\": \"debug\",\n");
+#endif
+#if defined(__SANITIZE_ADDRESS__)
+    std::fprintf(out, "    \"sanitizers\": true\n");
+#else
+    std::fprintf(out, "    \"sanitizers\": false\n");
+#endif
+    std::fprintf(out, "  }");
+}
+
+
+// Runs each benchmark for a number of samples. A sample is a batch of
+// iterations calibrated to take min_time / samples, the reported figures
+// are per iteration. Output is a table on stdout and, optionally, JSON in
+// a layout close to Google Benchmark's so existing tooling can read it.
+
+class Runner
+{
+
+    std::string filter;
+    double min_time_s {0.5};
+    std::size_t samples {10};
+    std::vector<result> results;
+
+    using clock = std::chrono::steady_clock;
+
+public:
+    Runner() = default;
+
+    void set_filter(std::string_view _filter){
+        filter = _filter;
+    }
+
+    void set_min_time(double seconds) noexcept {
+        min_time_s = seconds;
+    }
+
+    void set_samples(std::size_t _samples) noexcept {
+        samples = std::max<std::size_t>(_samples, 1);
+    }
+
+    const std::vector<result>& get_results() const noexcept {
+        return results;
+    }
+
+    // fn(iterations) has to run the measured operation `iterations` times
+    template<typename F>
+    void run(std::string_view name, F&& fn, double bytes_per_op = 0){
+
+        if(!filter.empty() && name.find(filter) == std::string_view::npos){
+            return;
+        }
+
+        const double sample_time_s {min_time_s / static_cast<double>(samples)};
+
+        std::uint64_t iterations {1};
+        while(true){
+            auto start {clock::now()};
+            fn(iterations);
+            double elapsed {std::chrono::duration<double>(clock::now() - start).count()};
+            if(elapsed >= sample_time_s || iterations >= (1ull << 30)){
+                break;
+            }
+            double scale {(elapsed > 0) ? std::min(10.0, 1.4 * sample_time_s / elapsed) : 10.0};
+            iterations = std::max<std::uint64_t>(iterations + 1, static_cast<std::uint64_t>(static_cast<double>(iterations) * scale));
+        }
+
+        std::vector<double> per_op(samples);
+        for(double& sample : per_op){
+            auto start {clock::now()};
+            fn(iterations);
+            double elapsed {std::chrono::duration<double, std::nano>(clock::now() - start).count()};
+            sample = elapsed / static_cast<double>(iterations);
+        }
+
+        std::vector<double> sorted {per_op};
+        std::sort(sorted.begin(), sorted.end());
+
+        double mean {std::accumulate(per_op.begin(), per_op.end(), 0.0) / static_cast<double>(samples)};
+        double variance {0};
+        for(double sample : per_op){
+            variance += (sample - mean) * (sample - mean);
+        }
+        variance /= static_cast<double>(samples);
+
+        result res {std::string(name), iterations, samples, sorted[samples / 2], mean,
+                    sorted.front(), sorted.back(), std::sqrt(variance), bytes_per_op};
+
+        std::printf("%-44s %12.1f ns/op %12.1f min %10.1f stddev %12llu iter",
+                    res.name.c_str(), res.median_ns, res.min_ns, res.stddev_ns,
+                    static_cast<unsigned long long>(res.iterations));
+        if(bytes_per_op > 0){
+            std::printf(" %10.1f MB/s", bytes_per_op / res.median_ns * 1e3);
+        }
+        std::printf("\n");
+        std::fflush(stdout);
+
+        results.push_back(std::move(res));
+    }
+
+    bool write_json(const char* path, std::string_view suite) const{
+
+        std::FILE* out {std::fopen(path, "w")};
+        if(!out){
+            std::perror(path);
+            return false;
+        }
+
+        std::fprintf(out, "{\n");
+        write_context(out, suite);
+        std::fprintf(out, ",\n  \"benchmarks\": [\n");
+
+        for(std::size_t i{0}; i < results.size(); ++i){
+            const result& res {results[i]};
+            std::fprintf(out, "    {\n");
+            std::fprintf(out, "      \"name\": \"%s\",\n", res.name.c_str());
+            std::fprintf(out, "      \"iterations\": %llu,\n", static_cast<unsigned long long>(res.iterations));
+            std::fprintf(out, "      \"repetitions\": %zu,\n", res.samples);
+            std::fprintf(out, "      \"real_time\": %.3f,\n", res.median_ns);
+            std::fprintf(out, "      \"mean_time\": %.3f,\n", res.mean_ns);
+            std::fprintf(out, "      \"min_time\": %.3f,\n", res.min_ns);
+            std::fprintf(out, "      \"max_time\": %.3f,\n", res.max_ns);
+            std::fprintf(out, "      \"stddev_time\": %.3f,\n", res.stddev_ns);
+            if(res.bytes_per_op > 0){
+                std::fprintf(out, "      \"bytes_per_second\": %.1f,\n", res.bytes_per_op / res.median_ns * 1e9);
+            }
+            std::fprintf(out, "      \"time_unit\": \"ns\"\n");
+            std::fprintf(out, "    }%s\n", (i + 1 < results.size()) ? "," : "");
+        }
+        std::fprintf(out, "  ]\n}\n");
+        std::fclose(out);
+        return true;
+    }
+};
+
+}
+
+
+#endif // BENCH_HARNESS_HPP
@@ -0,0 +1,633 @@
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "bench_harness.hpp"
+#include "lexer.hpp"
+#include "parse_input.hpp"
+#include "word_control.hpp"
+#include "shell_variables.hpp"
+#include "builtin.hpp"
+#include "execution/command_execution.hpp"
+#include "execution/process_launcher.hpp"
+#include "execution/pipe_config.hpp"
+#include "execution/path_glob.hpp"
+#include "execution/completion.hpp"
+#include "execution/job_table.hpp"
+#include "execution/exec_index.hpp"
+
+
+// Microbenchmarks for the hot paths of a command line: lexing and parsing,
+// word expansion, builtin dispatch and the fork/spawn-to-wait round trip.
+//
+//  nsh_bench [--filter SUBSTR] [--json FILE] [--min-time SECONDS] [--samples N]
+//
+// Build with -DNSH_SANITIZE=OFF -DCMAKE_BUILD_TYPE=Release for numbers worth
+// comparing.
+
+
+static std::string make_pipeline(std::size_t stages){
+    std::string line;
+    for(std::size_t i{0}; i < stages; ++i){
+        if(i > 0){
+            line += " | ";
+        }
+        line += "cmd" + std::to_string(i) + " -o arg" + std::to_string(i);
+    }
+    return line;
+}
+
+static std::string make_assignments(std::size_t count){
+    std::string line;
+    for(std::size_t i{0}; i < count; ++i){
+        line += "VAR" + std::to_string(i) + "=value" + std::to_string(i) + " ";
+    }
+    line += "env";
+    return line;
+}
+
+static std::string make_quoted(std::size_t count){
+    std::string line {"printf"};
+    for(std::size_t i{0}; i < count; ++i){
+        line += (i % 2) ? " 'single quoted; | & value'" : " \"double quoted $HOME value\"";
+    }
+    return line;
+}
+
+// Roughly `bytes` of ordinary commands joined by ; and |
+static std::string make_long_line(std::size_t bytes){
+    std::string line;
+    std::size_t i{0};
+    while(line.size() < bytes){
+        line += "grep -n pattern" + std::to_string(i) + " file.txt";
+        line += (i % 4 == 3) ? " ; " : " | ";
+        ++i;
+    }
+    line += "true";
+    return line;
+}
+
+
+static void bench_lexer(bench::Runner& runner, std::string_view name, const std::string& line){
+
+    std::vector<lex::token> tokens;
+    runner.run(name, [&](std::uint64_t iterations){
+        for(std::uint64_t i{0}; i < iterations; ++i){
+            lex::tokenize_line(line, tokens);
+            bench::do_not_optimize(tokens.data());
+        }
+    }, static_cast<double>(line.size()));
+}
+
+static void bench_parser(bench::Runner& runner, std::string_view name, const std::string& line){
+
+    std::vector<lex::token> tokens;
+    parse::line_ast ast;
+    parse::parse_error err;
+    if(!parse::parse_line(line, tokens, ast, err)){
+        parse::print_error(err);
+        std::exit(EXIT_FAILURE);
+    }
+
+    runner.run(name, [&](std::uint64_t iterations){
+        for(std::uint64_t i{0}; i < iterations; ++i){
+            parse::parse_line(line, tokens, ast, err);
+            bench::do_not_optimize(ast.commands.data());
+        }
+    }, static_cast<double>(line.size()));
+}
+
+static void bench_expansion(bench::Runner& runner, std::string_view name, std::string_view word){
+
+    std::string buffer;
+    runner.run(name, [&](std::uint64_t iterations){
+        for(std::uint64_t i{0}; i < iterations; ++i){
+            wexpand::expand_word(word, buffer);
+            bench::do_not_optimize(buffer.data());
+        }
+    });
+}
+
+static void bench_builtin_dispatch(bench::Runner& runner){
+
+    const Builtin_Table& table {Builtin_Table::get_instance()};
+    Job_Table bgjob_table;
+
+    runner.run("builtin/is_builtin_hit", [&](std::uint64_t iterations){
+        for(std::uint64_t i{0}; i < iterations; ++i){
+            bench::do_not_optimize(table.is_builtin("launcher"));
+        }
+    });
+
+    runner.run("builtin/is_builtin_miss", [&](std::uint64_t iterations){
+        for(std::uint64_t i{0}; i < iterations; ++i){
+            bench::do_not_optimize(table.is_builtin("grep"));
+        }
+    });
+
+    // `launcher <mode>` only switches the launcher mode, it prints nothing
+    Process_Launcher& launcher {Process_Launcher::get_instance()};
+    char mode_arg[] {"spawn"};
+    char* args[] {mode_arg, nullptr};
+    launcher_mode saved_mode {launcher.get_mode()};
+
+    runner.run("builtin/execute_launcher", [&](std::uint64_t iterations){
+        for(std::uint64_t i{0}; i < iterations; ++i){
+            table.execute("launcher", std::span<char* const>(args, 1), bgjob_table);
+        }
+    });
+    launcher.set_mode(saved_mode);
+}
+
+static void bench_spawn(bench::Runner& runner){
+
+    Command_Execution executor {false};
+    Process_Launcher& launcher {Process_Launcher::get_instance()};
+    launcher_mode saved_mode {launcher.get_mode()};
+
+    struct case_info{
+        const char* name;
+        launcher_mode mode;
+        const char* line;
+    };
+
+    // true is a builtin, /bin/true is what starts a process
+    const case_info cases[] {
+        {"spawn/fork_true", launcher_mode::fork, "/bin/true"},
+        {"spawn/posix_spawn_true", launcher_mode::spawn, "/bin/true"},
+        {"spawn/fork_pipeline_3", launcher_mode::fork, "/bin/true | /bin/true | /bin/true"},
+        {"spawn/posix_spawn_pipeline_3", launcher_mode::spawn, "/bin/true | /bin/true | /bin/true"},
+        {"spawn/fork_background", launcher_mode::fork, "/bin/true &"},
+        {"spawn/posix_spawn_background", launcher_mode::spawn, "/bin/true &"},
+    };
+
+    for(const case_info& info : cases){
+        launcher.set_mode(info.mode);
+        runner.run(info.name, [&](std::uint64_t iterations){
+            for(std::uint64_t i{0}; i < iterations; ++i){
+                bench::do_not_optimize(executor.execute_line(info.line));
+            }
+        });
+    }
+
+    // Let the background cases drain before the executor goes away
+    executor.execute_line("true");
+    launcher.set_mode(saved_mode);
+}
+
+
+// 64 MiB through a three stage pipeline for each pipe size, and into a file
+// with and without the splice relay
+static void bench_pipes(bench::Runner& runner){
+
+    Command_Execution executor {false};
+    Pipe_Config& pipe_config {Pipe_Config::get_instance()};
+    std::size_t saved_size {pipe_config.get_session_size()};
+    bool saved_relay {pipe_config.get_relay()};
+
+    constexpr double bytes {64.0 * 1024 * 1024};
+    const std::string pipeline {"head -c 67108864 /dev/zero | tr '\\0' a | wc -c > /dev/null"};
+
+    struct case_info{
+        const char* name;
+        std::size_t size;
+    };
+    const case_info sizes[] {
+        {"pipe/throughput_default", 0},
+        {"pipe/throughput_256k", 256 * 1024},
+        {"pipe/throughput_1m", 1024 * 1024},
+    };
+
+    for(const case_info& info : sizes){
+        pipe_config.set_session_size(info.size);
+        runner.run(info.name, [&](std::uint64_t iterations){
+            for(std::uint64_t i{0}; i < iterations; ++i){
+                executor.execute_line(pipeline);
+            }
+        }, bytes);
+    }
+
+    char path[] {"/tmp/nsh_bench_relay_XXXXXX"};
+    int fd {mkstemp(path)};
+    if(fd < 0){
+        std::perror("Error");
+        return;
+    }
+    close(fd);
+    const std::string to_file {"head -c 67108864 /dev/zero | tr '\\0' a > " + std::string(path)};
+
+    pipe_config.set_session_size(1024 * 1024);
+    for(bool relay : {false, true}){
+        pipe_config.set_relay(relay);
+        runner.run(relay ? "pipe/to_file_relay" : "pipe/to_file_direct", [&](std::uint64_t iterations){
+            for(std::uint64_t i{0}; i < iterations; ++i){
+                executor.execute_line(to_file);
+            }
+        }, bytes);
+    }
+
+    unlink(path);
+    pipe_config.set_session_size(saved_size);
+    pipe_config.set_relay(saved_relay);
+}
+
+
+// A flat directory of 2000 files and a tree of 1000 directories, every
+// iteration starts with an empty listing cache like a new pipeline does
+static void bench_glob(bench::Runner& runner){
+
+    char root[] {"/tmp/nsh_bench_glob_XXXXXX"};
+    if(!mkdtemp(root)){
+        std::perror("Error");
+        return;
+    }
+    const std::string base {root};
+    std::vector<std::string> created;
+    auto touch = [&created](const std::string& path){
+        int fd {open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644)};
+        if(fd >= 0){
+            close(fd);
+            created.push_back(path);
+        }
+    };
+    auto make_dir = [&created](const std::string& path){
+        if(mkdir(path.c_str(), 0755) == 0){
+            created.push_back(path);
+        }
+    };
+
+    make_dir(base + "/flat");
+    for(int i{0}; i < 2000; ++i){
+        touch(base + "/flat/file" + std::to_string(i) + ((i % 4 == 0) ? ".log" : ".txt"));
+    }
+    make_dir(base + "/tree");
+    for(int i{0}; i < 100; ++i){
+        std::string dir {base + "/tree/d" + std::to_string(i)};
+        make_dir(dir);
+        for(int j{0}; j < 9; ++j){
+            std::string sub {dir + "/s" + std::to_string(j)};
+            make_dir(sub);
+            touch(sub + "/data.json");
+        }
+    }
+
+    Path_Glob path_glob;
+    std::vector<std::string> matches;
+    struct case_info{
+        const char* name;
+        std::string pattern;
+    };
+    const case_info cases[] {
+        {"glob/star_2000", base + "/flat/*.log"},
+        {"glob/three_patterns_one_dir", base + "/flat/*.log"},
+        {"glob/recursive_1000_dirs", base + "/tree/**/*.json"},
+    };
+
+    for(const case_info& info : cases){
+        // The second case expands three patterns over the same directory
+        std::size_t patterns {std::string_view(info.name) == "glob/three_patterns_one_dir" ? 3u : 1u};
+        runner.run(info.name, [&](std::uint64_t iterations){
+            for(std::uint64_t i{0}; i < iterations; ++i){
+                path_glob.clear_cache();
+                for(std::size_t p{0}; p < patterns; ++p){
+                    matches.clear();
+                    path_glob.expand(info.pattern, matches);
+                }
+                bench::do_not_optimize(matches.data());
+            }
+        });
+    }
+
+    for(auto iter = created.rbegin(); iter != created.rend(); ++iter){
+        remove(iter->c_str());
+    }
+    rmdir(root);
+}
+
+
+// A $PATH directory of 30000 executables, completed from the prebuilt trie
+static void bench_completion(bench::Runner& runner){
+
+    char root[] {"/tmp/nsh_bench_complete_XXXXXX"};
+    if(!mkdtemp(root)){
+        std::perror("Error");
+        return;
+    }
+    const std::string base {root};
+    std::vector<std::string> created;
+    for(int i{0}; i < 30000; ++i){
+        std::string path {base + "/tool" + std::to_string(i) + ((i % 3 == 0) ? "-ctl" : "")};
+        int fd {open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0755)};
+        if(fd >= 0){
+            close(fd);
+            created.push_back(path);
+        }
+    }
+
+    const char* saved_path {getenv("PATH")};
+    std::string saved {saved_path ? saved_path : ""};
+    setenv("PATH", root, 1);
+
+    Completion completion;
+    completion.refresh();
+    completion.wait_for_index();
+
+    Job_Table jobs;
+    completion_result result;
+    struct case_info{
+        const char* name;
+        const char* line;
+    };
+    const case_info cases[] {
+        {"complete/command_unique_30000", "tool12345-c"},
+        {"complete/command_prefix_30000", "tool12"},
+        {"complete/command_all_30000", ""},
+        {"complete/file", "ls /usr/b"},
+    };
+    for(const case_info& info : cases){
+        std::string_view line {info.line};
+        runner.run(info.name, [&](std::uint64_t iterations){
+            for(std::uint64_t i{0}; i < iterations; ++i){
+                completion.complete(line, line.size(), jobs, result);
+                bench::do_not_optimize(result.replacement.data());
+            }
+        });
+    }
+
+    setenv("PATH", saved.c_str(), 1);
+    for(const std::string& path : created){
+        remove(path.c_str());
+    }
+    rmdir(root);
+}
+
+
+// An executable index of 30000 names in 8 directories: opening it maps the
+// file and checks its header only, so it costs the same at any size
+static void bench_exec_index(bench::Runner& runner){
+
+    char file[] {"/tmp/nsh_bench_index_XXXXXX"};
+    int fd {mkstemp(file)};
+    if(fd < 0){
+        std::perror("Error");
+        return;
+    }
+    close(fd);
+
+    std::vector<std::string> dir_names;
+    std::vector<Exec_Index::dir_state> dirs;
+    for(int i{0}; i < 8; ++i){
+        dir_names.push_back("/opt/tools" + std::to_string(i) + "/bin");
+    }
+    std::string path;
+    for(const std::string& name : dir_names){
+        dirs.push_back({name, {1700000000, 0}, true});
+        path.append(path.empty() ? "" : ":").append(name);
+    }
+    std::vector<std::string> names;
+    for(int i{0}; i < 30000; ++i){
+        names.push_back("tool" + std::to_string(i));
+    }
+    std::sort(names.begin(), names.end());
+    std::vector<Exec_Index::entry_state> entries;
+    for(std::size_t i{0}; i < names.size(); ++i){
+        entries.push_back({names[i], static_cast<std::uint32_t>(i % dirs.size()), {1700000000, 0}});
+    }
+    if(!Exec_Index::write(file, path, dirs, entries)){
+        std::perror("Error");
+        remove(file);
+        return;
+    }
+
+    Exec_Index index;
+    runner.run("exec_index/open_30000", [&](std::uint64_t iterations){
+        for(std::uint64_t i{0}; i < iterations; ++i){
+            bench::do_not_optimize(index.open(file));
+        }
+    });
+    runner.run("exec_index/find_hit_30000", [&](std::uint64_t iterations){
+        for(std::uint64_t i{0}; i < iterations; ++i){
+            bench::do_not_optimize(index.find(names[(i * 7919) % names.size()]));
+        }
+    });
+    runner.run("exec_index/find_miss_30000", [&](std::uint64_t iterations){
+        for(std::uint64_t i{0}; i < iterations; ++i){
+            bench::do_not_optimize(index.find("tool-missing"));
+        }
+    });
+    runner.run("exec_index/write_30000", [&](std::uint64_t iterations){
+        for(std::uint64_t i{0}; i < iterations; ++i){
+            bench::do_not_optimize(Exec_Index::write(file, path, dirs, entries));
+        }
+    });
+
+    index.close();
+    remove(file);
+}
+
+
+// Job tables of 100 and 10000 jobs of three processes, then a shell with
+// 10000 live background jobs: a lookup, a state change and signalling a job
+// must cost the same at both sizes
+static void bench_jobs(bench::Runner& runner){
+
+    constexpr int first_pid {100000};
+    const int stopped_status {(SIGTSTP << 8) | 0x7f};
+    const int continued_status {0xffff};
+
+    for(int job_count : {100, 10000}){
+
+        Job_Table table;
+        for(int i{0}; i < job_count; ++i){
+            const int pids[] {first_pid + 3 * i, first_pid + 3 * i + 1, first_pid + 3 * i + 2};
+            table.add("sleep 1000 | cat | cat", pids[0], pids);
+        }
+
+        const std::string suffix {"_" + std::to_string(job_count)};
+        int next {0};
+
+        runner.run("jobs/find_id" + suffix, [&](std::uint64_t iterations){
+            for(std::uint64_t i{0}; i < iterations; ++i){
+                bench::do_not_optimize(table.find(static_cast<std::size_t>(next % job_count) + 1));
+                ++next;
+            }
+        });
+
+        runner.run("jobs/find_pgid" + suffix, [&](std::uint64_t iterations){
+            for(std::uint64_t i{0}; i < iterations; ++i){
+                bench::do_not_optimize(table.find_pgid(first_pid + 3 * (next % job_count)));
+                ++next;
+            }
+        });
+
+        runner.run("jobs/find_pid" + suffix, [&](std::uint64_t iterations){
+            for(std::uint64_t i{0}; i < iterations; ++i){
+                bench::do_not_optimize(table.find_pid(first_pid + next % (3 * job_count)));
+                ++next;
+            }
+        });
+
+        // One process stops and continues, as the signalfd reports it
+        runner.run("jobs/update" + suffix, [&](std::uint64_t iterations){
+            for(std::uint64_t i{0}; i < iterations; ++i){
+                int pid {first_pid + next % (3 * job_count)};
+                bench::do_not_optimize(table.update(pid, stopped_status));
+                bench::do_not_optimize(table.update(pid, continued_status));
+                ++next;
+            }
+        });
+
+        // The newest job finishes and the next one gets its id again
+        const int new_pids[] {first_pid - 3, first_pid - 2, first_pid - 1};
+        runner.run("jobs/add_erase" + suffix, [&](std::uint64_t iterations){
+            for(std::uint64_t i{0}; i < iterations; ++i){
+                background_execution_unit& unit {table.add("sleep 1", new_pids[0], new_pids)};
+                table.erase(unit.job_id);
+            }
+        });
+    }
+
+    constexpr int live_jobs {10000};
+    Command_Execution executor {false};
+    for(int i{0}; i < live_jobs; ++i){
+        executor.execute_line("sleep 1000 &");
+    }
+
+    // Every line reaps at its start, with nothing finished that is the cost
+    // a prompt pays for the jobs it did not touch
+    runner.run("jobs/live_reap_idle_10000", [&](std::uint64_t iterations){
+        for(std::uint64_t i{0}; i < iterations; ++i){
+            bench::do_not_optimize(executor.execute_line("true"));
+        }
+    });
+
+    runner.run("jobs/live_kill_10000", [&](std::uint64_t iterations){
+        for(std::uint64_t i{0}; i < iterations; ++i){
+            bench::do_not_optimize(executor.execute_line("kill -0 %5000"));
+        }
+    });
+
+    runner.run("jobs/live_jobs_10000", [&](std::uint64_t iterations){
+        for(std::uint64_t i{0}; i < iterations; ++i){
+            bench::do_not_optimize(executor.execute_line("jobs > /dev/null"));
+        }
+    });
+
+    std::string kill_line {"kill -9"};
+    for(int i{1}; i <= live_jobs; ++i){
+        kill_line += " %" + std::to_string(i);
+    }
+    if(executor.execute_line(kill_line) != 0){
+        std::fprintf(stderr, "jobs: not every one of the %d jobs was found\n", live_jobs);
+    }
+
+    // Reaped by the lines that follow, the table has to end up empty
+    char path[] {"/tmp/nsh_bench_jobs_XXXXXX"};
+    int fd {mkstemp(path)};
+    if(fd < 0){
+        std::perror("Error");
+        return;
+    }
+    close(fd);
+    const std::string list_line {"jobs > " + std::string(path)};
+    struct stat info {};
+    for(int attempt{0}; attempt < 100; ++attempt){
+        executor.execute_line("true");
+        executor.execute_line(list_line);
+        if(stat(path, &info) == 0 && info.st_size == 0){
+            break;
+        }
+        usleep(50000);
+    }
+    if(info.st_size != 0){
+        std::fprintf(stderr, "jobs: background jobs left after kill\n");
+    }
+    unlink(path);
+}
+
+
+static void print_usage(const char* prog){
+    std::fprintf(stderr, "usage: %s [--filter SUBSTR] [--json FILE] [--min-time SECONDS] [--samples N]\n", prog);
+}
+
+
+int main(int argc, char* argv[]){
+
+    bench::Runner runner;
+    const char* json_path {nullptr};
+
+    for(int i{1}; i < argc; ++i){
+        std::string_view arg {argv[i]};
+        if(i + 1 >= argc){
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        if(arg == "--filter"){
+            runner.set_filter(argv[++i]);
+        }
+        else if(arg == "--json"){
+            json_path = argv[++i];
+        }
+        else if(arg == "--min-time"){
+            runner.set_min_time(std::strtod(argv[++i], nullptr));
+        }
+        else if(arg == "--samples"){
+            runner.set_samples(std::strtoul(argv[++i], nullptr, 10));
+        }
+        else{
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    const std::string pipeline_8 {make_pipeline(8)};
+    const std::string pipeline_200 {make_pipeline(200)};
+    const std::string assignments_64 {make_assignments(64)};
+    const std::string quoted_64 {make_quoted(64)};
+    const std::string long_line {make_long_line(256 * 1024)};
+
+    bench_lexer(runner, "lex/pipeline_8", pipeline_8);
+    bench_lexer(runner, "lex/pipeline_200", pipeline_200);
+    bench_lexer(runner, "lex/assignments_64", assignments_64);
+    bench_lexer(runner, "lex/quoted_64", quoted_64);
+    bench_lexer(runner, "lex/long_line_256k", long_line);
+
+    bench_parser(runner, "parse/pipeline_8", pipeline_8);
+    bench_parser(runner, "parse/pipeline_200", pipeline_200);
+    bench_parser(runner, "parse/assignments_64", assignments_64);
+    bench_parser(runner, "parse/quoted_64", quoted_64);
+    bench_parser(runner, "parse/long_line_256k", long_line);
+
+    Shell_Variables::get_instance().set("NSH_BENCH_VAR", "/usr/local/share/nsh");
+    bench_expansion(runner, "expand/variable", "$NSH_BENCH_VAR");
+    bench_expansion(runner, "expand/variable_unset", "$NSH_BENCH_UNSET");
+    bench_expansion(runner, "expand/double_quoted_variable", "\"$NSH_BENCH_VAR\"");
+    bench_expansion(runner, "expand/mid_word", "prefix/$NSH_BENCH_VAR/bin:${NSH_BENCH_VAR}/lib");
+    bench_expansion(runner, "expand/default", "${NSH_BENCH_UNSET:-/usr/share}/nsh");
+    bench_expansion(runner, "expand/length", "${#NSH_BENCH_VAR}");
+    bench_expansion(runner, "expand/suffix_removal", "${NSH_BENCH_VAR%/*}");
+    bench_expansion(runner, "expand/mixed_quoting", "'single'\"double $NSH_BENCH_VAR\"\\ plain");
+    bench_expansion(runner, "expand/double_quoted_text", "\"some quoted text with spaces\"");
+    bench_expansion(runner, "expand/single_quoted_text", "'some quoted text with spaces'");
+
+    bench_builtin_dispatch(runner);
+    bench_spawn(runner);
+    bench_pipes(runner);
+    bench_glob(runner);
+    bench_completion(runner);
+    bench_exec_index(runner);
+    bench_jobs(runner);
+
+    if(json_path && !runner.write_json(json_path, "nsh_bench")){
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
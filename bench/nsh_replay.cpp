@@ -0,0 +1,322 @@
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include "bench_harness.hpp"
+#include "execution/command_execution.hpp"
+#include "execution/process_launcher.hpp"
+#include "execution/phase_stats.hpp"
+
+
+// Replays a command corpus, one shell line per corpus line, through
+// Command_Execution as `nsh script` would run it, and reports throughput,
+// per-line latency percentiles and where the time went. Reference shells,
+// or other nsh builds, can run the same corpus for comparison.
+//
+//  nsh_replay CORPUS [--repeat N] [--launcher fork|spawn] [--json FILE]
+//                    [--reference SHELL]...
+//  nsh_replay --generate LINES > corpus.txt
+//
+// Output of the replayed commands goes to /dev/null.
+
+
+using clock_type = std::chrono::steady_clock;
+
+extern char** environ;
+
+
+static void print_usage(const char* prog){
+    std::fprintf(stderr, "usage: %s CORPUS [--repeat N] [--launcher fork|spawn] [--json FILE] [--reference SHELL]...\n"
+                         "       %s --generate LINES\n", prog, prog);
+}
+
+
+// A mix of ; chains, pipelines of up to five stages and background jobs
+static void generate_corpus(std::size_t lines){
+
+    static constexpr const char* templates[] {
+        "true",
+        "true; true; true",
+        "ls /usr/bin | wc -l",
+        "printf '%s\\n' one two three two one | sort | uniq -c | sort -rn | head -n 1",
+        "cat /etc/passwd | cut -d: -f1 | sort | uniq | grep root",
+        "NSH_REPLAY=1 env | grep NSH_REPLAY",
+        "echo \"$HOME\" | wc -c",
+        "date; who | wc -l; uname -a",
+        "sleep 0 &",
+        "ls -l /etc | grep -c conf &",
+        "seq 1 200 | tr 0-9 a-j | paste -sd, | wc -c",
+        "expr 6 \\* 7",
+    };
+    constexpr std::size_t template_count {sizeof(templates) / sizeof(templates[0])};
+
+    // Fixed seed, the same size gives the same corpus
+    std::uint64_t state {0x9e3779b97f4a7c15ull};
+    for(std::size_t i{0}; i < lines; ++i){
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        std::printf("%s\n", templates[(state >> 33) % template_count]);
+    }
+}
+
+
+static bool load_corpus(const char* path, std::vector<std::string>& lines){
+
+    std::FILE* in {std::fopen(path, "r")};
+    if(!in){
+        std::perror(path);
+        return false;
+    }
+
+    char* buffer {nullptr};
+    std::size_t capacity {0};
+    ssize_t length {0};
+    while((length = getline(&buffer, &capacity, in)) >= 0){
+        std::string_view line {buffer, static_cast<std::size_t>(length)};
+        if(!line.empty() && line.back() == '\n'){
+            line.remove_suffix(1);
+        }
+        lines.emplace_back(line);
+    }
+    std::free(buffer);
+    std::fclose(in);
+    return true;
+}
+
+
+// Nearest rank percentile of sorted samples
+static double percentile(const std::vector<double>& sorted, double pct){
+    if(sorted.empty()){
+        return 0;
+    }
+    std::size_t rank {static_cast<std::size_t>(pct / 100.0 * static_cast<double>(sorted.size()))};
+    return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+
+struct reference_result{
+    std::string shell;
+    double wall_s;
+    int status;
+};
+
+// Runs `shell corpus` with output to /dev/null and measures the wall time
+static reference_result run_reference(const char* shell, const char* corpus, int devnull, std::size_t repeat){
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, devnull, STDOUT_FILENO);
+
+    // The replay blocks SIGCHLD for its signalfd, the reference shell must not inherit that
+    posix_spawnattr_t attrs;
+    posix_spawnattr_init(&attrs);
+    sigset_t empty_set;
+    sigemptyset(&empty_set);
+    posix_spawnattr_setflags(&attrs, POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setsigmask(&attrs, &empty_set);
+
+    char* argv[] {const_cast<char*>(shell), const_cast<char*>(corpus), nullptr};
+    reference_result result {shell, 0, 0};
+
+    auto start {clock_type::now()};
+    for(std::size_t r{0}; r < repeat; ++r){
+        pid_t pid {0};
+        int err = posix_spawnp(&pid, shell, &actions, &attrs, argv, environ);
+        if(err != 0){
+            std::fprintf(stderr, "nsh_replay: %s: %s\n", shell, std::strerror(err));
+            result.status = 127;
+            break;
+        }
+        int status {0};
+        while(waitpid(pid, &status, 0) < 0 && errno == EINTR){}
+        result.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+    result.wall_s = std::chrono::duration<double>(clock_type::now() - start).count();
+
+    posix_spawnattr_destroy(&attrs);
+    posix_spawn_file_actions_destroy(&actions);
+    return result;
+}
+
+
+int main(int argc, char* argv[]){
+
+    const char* corpus_path {nullptr};
+    const char* json_path {nullptr};
+    std::size_t repeat {1};
+    std::vector<const char*> references;
+    Process_Launcher& launcher {Process_Launcher::get_instance()};
+
+    for(int i{1}; i < argc; ++i){
+        std::string_view arg {argv[i]};
+        if(arg.starts_with("--") && i + 1 >= argc){
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        if(arg == "--generate"){
+            generate_corpus(std::strtoul(argv[++i], nullptr, 10));
+            return EXIT_SUCCESS;
+        }
+        else if(arg == "--repeat"){
+            repeat = std::max<std::size_t>(std::strtoul(argv[++i], nullptr, 10), 1);
+        }
+        else if(arg == "--json"){
+            json_path = argv[++i];
+        }
+        else if(arg == "--reference"){
+            references.push_back(argv[++i]);
+        }
+        else if(arg == "--launcher"){
+            launcher_mode mode;
+            if(!Process_Launcher::parse_mode(argv[++i], mode)){
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            launcher.set_mode(mode);
+        }
+        else if(!corpus_path && !arg.starts_with("--")){
+            corpus_path = argv[i];
+        }
+        else{
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(!corpus_path){
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<std::string> lines;
+    if(!load_corpus(corpus_path, lines)){
+        return EXIT_FAILURE;
+    }
+
+    // The report keeps the original stdout, the replayed commands get /dev/null
+    int devnull {open("/dev/null", O_WRONLY | O_CLOEXEC)};
+    int report_fd {dup(STDOUT_FILENO)};
+    if(devnull < 0 || report_fd < 0){
+        std::perror("Error");
+        return EXIT_FAILURE;
+    }
+    std::FILE* report {fdopen(report_fd, "w")};
+
+    Phase_Stats& stats {Phase_Stats::get_instance()};
+    std::vector<double> latency_ns;
+    latency_ns.reserve(lines.size() * repeat);
+    double wall_s {0};
+
+    {
+        Command_Execution executor {false};
+
+        std::fflush(stdout);
+        dup2(devnull, STDOUT_FILENO);
+
+        stats.reset();
+        stats.set_enabled(true);
+
+        auto start {clock_type::now()};
+        for(std::size_t r{0}; r < repeat; ++r){
+            for(const std::string& line : lines){
+                auto line_start {clock_type::now()};
+                executor.execute_line(line);
+                latency_ns.push_back(std::chrono::duration<double, std::nano>(clock_type::now() - line_start).count());
+            }
+        }
+        std::fflush(stdout);
+        wall_s = std::chrono::duration<double>(clock_type::now() - start).count();
+
+        stats.set_enabled(false);
+        dup2(report_fd, STDOUT_FILENO);
+    }
+
+    std::sort(latency_ns.begin(), latency_ns.end());
+
+    const double lines_run {static_cast<double>(latency_ns.size())};
+    const double commands_run {static_cast<double>(stats.get_commands())};
+    const double pcts[] {50, 90, 99, 99.9};
+
+    std::fprintf(report, "corpus      %s (%zu lines x %zu)\n", corpus_path, lines.size(), repeat);
+    std::fprintf(report, "launcher    %s\n", Process_Launcher::get_mode_name(launcher.get_mode()));
+    std::fprintf(report, "wall        %.3f s\n", wall_s);
+    std::fprintf(report, "throughput  %.1f lines/s, %.1f commands/s\n", lines_run / wall_s, commands_run / wall_s);
+    std::fprintf(report, "latency    ");
+    for(double pct : pcts){
+        std::fprintf(report, " p%g %.1f us", pct, percentile(latency_ns, pct) / 1e3);
+    }
+    std::fprintf(report, " max %.1f us\n\n", latency_ns.empty() ? 0.0 : latency_ns.back() / 1e3);
+
+    std::fprintf(report, "%-10s %12s %8s %12s %12s\n", "phase", "total ms", "% wall", "samples", "mean us");
+    double accounted_ns {0};
+    for(std::size_t p{0}; p < static_cast<std::size_t>(shell_phase::count); ++p){
+        shell_phase phase {static_cast<shell_phase>(p)};
+        double total {static_cast<double>(stats.get_total_ns(phase))};
+        std::uint64_t samples {stats.get_samples(phase)};
+        accounted_ns += total;
+        std::fprintf(report, "%-10s %12.3f %7.1f%% %12llu %12.2f\n", Phase_Stats::get_phase_name(phase),
+                     total / 1e6, total / 1e7 / wall_s, static_cast<unsigned long long>(samples),
+                     samples ? total / static_cast<double>(samples) / 1e3 : 0.0);
+    }
+    double other_ns {std::max(0.0, wall_s * 1e9 - accounted_ns)};
+    std::fprintf(report, "%-10s %12.3f %7.1f%%\n", "other", other_ns / 1e6, other_ns / 1e7 / wall_s);
+
+    std::vector<reference_result> reference_results;
+    if(!references.empty()){
+        std::fprintf(report, "\n%-32s %10s %14s %8s\n", "reference", "wall s", "commands/s", "status");
+        std::fprintf(report, "%-32s %10.3f %14.1f %8s\n", "nsh_replay (in process)", wall_s, commands_run / wall_s, "-");
+    }
+    for(const char* shell : references){
+        reference_result result {run_reference(shell, corpus_path, devnull, repeat)};
+        std::fprintf(report, "%-32s %10.3f %14.1f %8d\n", shell, result.wall_s, commands_run / result.wall_s, result.status);
+        reference_results.push_back(std::move(result));
+    }
+    std::fflush(report);
+
+    if(json_path){
+        std::FILE* out {std::fopen(json_path, "w")};
+        if(!out){
+            std::perror(json_path);
+            return EXIT_FAILURE;
+        }
+        std::fprintf(out, "{\n");
+        bench::write_context(out, "nsh_replay");
+        std::fprintf(out, ",\n  \"corpus\": \"%s\",\n", corpus_path);
+        std::fprintf(out, "  \"launcher\": \"%s\",\n", Process_Launcher::get_mode_name(launcher.get_mode()));
+        std::fprintf(out, "  \"lines\": %.0f,\n", lines_run);
+        std::fprintf(out, "  \"commands\": %.0f,\n", commands_run);
+        std::fprintf(out, "  \"wall_time_s\": %.6f,\n", wall_s);
+        std::fprintf(out, "  \"commands_per_second\": %.1f,\n", commands_run / wall_s);
+        std::fprintf(out, "  \"latency_ns\": {\"p50\": %.0f, \"p90\": %.0f, \"p99\": %.0f, \"p999\": %.0f, \"max\": %.0f},\n",
+                     percentile(latency_ns, 50), percentile(latency_ns, 90), percentile(latency_ns, 99),
+                     percentile(latency_ns, 99.9), latency_ns.empty() ? 0.0 : latency_ns.back());
+        std::fprintf(out, "  \"phases_ns\": {");
+        for(std::size_t p{0}; p < static_cast<std::size_t>(shell_phase::count); ++p){
+            shell_phase phase {static_cast<shell_phase>(p)};
+            std::fprintf(out, "%s\"%s\": %llu", (p > 0) ? ", " : "", Phase_Stats::get_phase_name(phase),
+                         static_cast<unsigned long long>(stats.get_total_ns(phase)));
+        }
+        std::fprintf(out, "},\n  \"references\": [");
+        for(std::size_t i{0}; i < reference_results.size(); ++i){
+            const reference_result& result {reference_results[i]};
+            std::fprintf(out, "%s\n    {\"shell\": \"%s\", \"wall_time_s\": %.6f, \"commands_per_second\": %.1f, \"status\": %d}",
+                         (i > 0) ? "," : "", result.shell.c_str(), result.wall_s, commands_run / result.wall_s, result.status);
+        }
+        std::fprintf(out, "%s]\n}\n", reference_results.empty() ? "" : "\n  ");
+        std::fclose(out);
+    }
+
+    std::fclose(report);
+    close(devnull);
+    return EXIT_SUCCESS;
+}
@@ -3,25 +3,39 @@
 
 #include <map>
 #include <string>
+#include <string_view>
+#include <span>
+#include <charconv>
 #include <cstdarg>
 #include <cstdlib>
 #include <memory>
-#include <list>
 #include <vector>
 #include <csignal>
 #include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cerrno>
 
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 
-#include "execution/internal/job_control_impl.hpp"
+#include "execution/job_table.hpp"
+#include "execution/command_hash.hpp"
+#include "execution/process_launcher.hpp"
+#include "execution/pipe_config.hpp"
+#include "execution/history.hpp"
+#include "execution/parallel_runner.hpp"
+#include "execution/job_cgroups.hpp"
+#include "system_envs.hpp"
+#include "shell_variables.hpp"
 
 
 struct builtin_base{
 
 public:
     builtin_base() = default;
-    virtual void invoke(std::list<std::string>&, std::map<std::size_t, background_execution_unit>&) = 0;
+    virtual int invoke(std::span<char* const>, Job_Table&) = 0;
     virtual ~builtin_base(){}
 
 };
@@ -29,10 +43,10 @@ public:
 struct builtin_exit : public builtin_base{
 
     builtin_exit() : builtin_base() {}
-    void invoke(std::list<std::string>& arglist,  [[maybe_unused]] std::map<std::size_t, background_execution_unit>& bgjob_table){
-        if(arglist.empty())
+    int invoke(std::span<char* const> args,  [[maybe_unused]] Job_Table& bgjob_table){
+        if(args.empty())
             std::exit(0); // Need to exit with status of last executed command
-        std::exit(std::stoi(arglist.front()));
+        std::exit(std::atoi(args.front()));
     }
 };
 
@@ -44,18 +58,21 @@ private:
 
 public:
     builtin_cd() : builtin_base() {}
-    void invoke(std::list<std::string>& arglist, [[maybe_unused]] std::map<std::size_t, background_execution_unit>& bgjob_table){
-        if(arglist.empty() || arglist.front().c_str() == home_char){
+    int invoke(std::span<char* const> args, [[maybe_unused]] Job_Table& bgjob_table){
+        if(args.empty() || args.front() == home_char){
             char* cwd {getenv("HOME")};
             if(chdir((cwd) ? cwd : "/") == -1){
                 std::perror("Error");
+                return 1;
             }
         }
         else{
-            if(chdir(arglist.front().c_str()) == -1){
+            if(chdir(args.front()) == -1){
                 std::perror("Error");
+                return 1;
             }
         }
+        return 0;
     }
 };
 
@@ -77,122 +94,202 @@ struct builtin_kill : public builtin_base{
     };
 
 
-    bool expect_jobid(const std::string& token){
+    template<typename T>
+    static bool parse_number(std::string_view token, T& value){
+        auto [ptr, ec] = std::from_chars(token.data(), token.data() + token.size(), value);
+        return ec == std::errc{} && ptr == token.data() + token.size();
+    }
 
-        if(token.starts_with("%")){
-            try{
-                jobids.push_back(std::stoi(token.substr(1)));
-            }
-            catch(...){
-                return false;
-            }
+    bool expect_jobid(std::string_view token){
+
+        job_id_t jobid;
+        if(!token.starts_with("%") || !parse_number(token.substr(1), jobid)){
+            return false;
         }
+        jobids.push_back(jobid);
         return true;
     }
 
-    bool expect_signal(const std::string& signal){
-        try{
-            kill_ctx.first = std::stoi(signal);
-            if(kill_ctx.first < 0 || kill_ctx.first > SIGRTMAX)
-                return false;
+    bool expect_signal(std::string_view signal){
+
+        if(signal.starts_with("-")){
+            signal.remove_prefix(1);
         }
-        catch(...){
+        if(!parse_number(signal, kill_ctx.first)){
             return false;
         }
-        return true;
+        return kill_ctx.first >= 0 && kill_ctx.first <= SIGRTMAX;
     }
 
-    bool extract_pids(const std::list<std::string>& tokens){
-        process_ids_t pids;
-        for(const auto& token : tokens){
-            try{
-                kill_ctx.second.push_back(std::stoi(token));
-            }
-            catch(...){
-                return false;
-            }
+    bool extract_pid(std::string_view token){
+
+        unsigned int pid;
+        if(!parse_number(token, pid)){
+            return false;
         }
+        kill_ctx.second.push_back(pid);
         return true;
     }
 
 
-    void parse(std::list<std::string>& tokens){
+    bool parse(std::span<char* const> tokens){
 
-        if(tokens.size() == 1){
+        if(tokens.empty()){
             std::fprintf(stdout, help_text);
+            return false;
+        }
+
+        kill_ctx.first = SIGTERM;
+        if(tokens.size() > 1 && expect_signal(tokens.front())){
+            tokens = tokens.subspan(1);
         }
         else{
+            kill_ctx.first = SIGTERM;
+        }
 
-            if(tokens.size() <= 1){
-                std::printf("Error: Invalid Syntax\n");
+        for(std::string_view token : tokens){
+            if(!expect_jobid(token) && !extract_pid(token)){
+                std::printf("Error: Incorrect process ids\n");
+                return false;
             }
+        }
+        return true;
+    }
 
-            else{
-
-                if(!expect_signal(tokens.front())){
-                    kill_ctx.first = SIGTERM;
+    int invoke(std::span<char* const> args, Job_Table& bgjob_table){
+
+        int status {1};
+        if(parse(args)){
+            status = 0;
+            // States change once wait reports them, not when a signal is sent
+            for(const job_id_t id : jobids){
+                const background_execution_unit* unit {bgjob_table.find(id)};
+                if(!unit){
+                    std::printf("kill: %%%zu: no such job\n", id);
+                    status = 1;
+                    continue;
                 }
-                else{
-                    tokens.erase(tokens.begin());
+                // SIGKILL reaches the whole cgroup, processes that left the group included
+                if(kill_ctx.first == SIGKILL && !unit->cgroup.empty() && Job_Cgroups::kill_leaf(unit->cgroup)){
+                    continue;
                 }
-                int index = 0;
-                for(const std::string& token : tokens){
-                    if(!expect_jobid(token)){
-                        break;
-                    }
-                    index++;
+                if(killpg(unit->pgid, kill_ctx.first) < 0){
+                    status = 1;
                 }
-                tokens.erase(tokens.begin(), std::next(tokens.begin(), index));
-                if(!extract_pids({std::next(tokens.begin()), tokens.end()})){
-                    std::printf("Error: Incorrect process ids\n");
+            }
+            for(const unsigned int pid : kill_ctx.second){
+                if(kill(pid, kill_ctx.first) < 0){
+                    status = 1;
                 }
             }
         }
+
+        jobids.clear();
+        kill_ctx.second.clear();
+        return status;
     }
-    void invoke(std::list<std::string>& arglist, std::map<std::size_t, background_execution_unit>& bgjob_table){
-        parse(arglist);
-        // Handle parsing error here
+};
 
 
-        for(const job_id_t id : jobids){
-            if(killpg(bgjob_table[id].pgid, kill_ctx.first) < 0){
-                continue;
-            }
-            if(kill_ctx.first == SIGSTOP || kill_ctx.first == SIGTSTP){
-                bgjob_table[id].status = job_status::stopped;
-            }
-            else if(kill_ctx.first == SIGCONT){
-                bgjob_table[id].status = job_status::running;
-            }
-            else if(kill_ctx.first == SIGTERM || kill_ctx.first == SIGKILL){
-                bgjob_table[id].status = job_status::done;
-            }
+struct builtin_jobs : public builtin_base{
+    builtin_jobs() : builtin_base() {}
+
+    std::vector<std::size_t> done_jobs;
+
+    constexpr static char help_text[] {
+        "jobs: usage: jobs [-l]\n"
+    };
+
+    // Byte counts as 512B, 1.5K, 20.0M ..., "-" for a missing one
+    static std::string format_size(std::int64_t bytes){
+
+        if(bytes < 0){
+            return "-";
         }
-        for(const unsigned int pid : kill_ctx.second){
-            kill(pid, kill_ctx.first); // Check for return value
+        constexpr char units[] {"KMGT"};
+        if(bytes < 1024){
+            return std::to_string(bytes) + 'B';
         }
+        double size {static_cast<double>(bytes) / 1024};
+        std::size_t unit {0};
+        while(size >= 1024 && unit + 1 < sizeof(units) - 1){
+            size /= 1024;
+            ++unit;
+        }
+        char buffer[32];
+        std::snprintf(buffer, sizeof(buffer), "%.1f%c", size, units[unit]);
+        return buffer;
+    }
 
-        jobids.clear();
+    // -l adds the pgid and what the job's cgroup used so far
+    static void print_usage(const background_execution_unit& execunit){
+
+        cgroup_usage usage {};
+        if(!execunit.cgroup.empty()){
+            Job_Cgroups::read_usage(execunit.cgroup, usage);
+        }
+        char cpu[32] {"-"};
+        if(usage.cpu_usec >= 0){
+            std::snprintf(cpu, sizeof(cpu), "%.2fs", static_cast<double>(usage.cpu_usec) / 1e6);
+        }
+        std::printf("%d cpu %s mem %s/%s io %s/%s ", execunit.pgid, cpu,
+                    format_size(usage.memory_current).c_str(), format_size(usage.memory_peak).c_str(),
+                    format_size(usage.io_read_bytes).c_str(), format_size(usage.io_write_bytes).c_str());
     }
-};
 
+    int invoke(std::span<char* const> args, Job_Table& bgjob_table){
 
-struct builtin_jobs : public builtin_base{
-    builtin_jobs() : builtin_base() {}
-    void invoke(std::list<std::string>&, std::map<std::size_t, background_execution_unit>& bgjob_table){
+        bool long_format {false};
+        for(std::string_view arg : args){
+            if(arg != "-l"){
+                std::fprintf(stdout, help_text);
+                return 2;
+            }
+            long_format = true;
+        }
 
-        for(const auto& [jobid, execunit] : bgjob_table){
+        // A Done job is listed once, like its report it then leaves the table
+        done_jobs.clear();
+        bgjob_table.for_each([this, long_format](const background_execution_unit& execunit){
             std::printf("[%zu] ", execunit.job_id);
+            if(long_format){
+                print_usage(execunit);
+            }
             std::printf((execunit.status == job_status::running ? "Running " :
                         execunit.status == job_status::stopped ? "Stopped " : "Done"));
             std::printf("\t\t\t");
             std::printf("%s\n", execunit.job_cmd.c_str());
+            if(execunit.status == job_status::done){
+                done_jobs.push_back(execunit.job_id);
+            }
+        });
+        for(std::size_t id : done_jobs){
+            bgjob_table.erase(id);
         }
+        return 0;
     }
     ~builtin_jobs(){}
 };
 
 
+// The job named by %N, or the newest job without an argument
+inline background_execution_unit* find_jobspec(Job_Table& bgjob_table, std::span<char* const> args){
+
+    if(args.empty()){
+        return bgjob_table.current();
+    }
+    std::string_view spec {args.front()};
+    std::size_t jobid {0};
+    if(!spec.starts_with("%")){
+        return nullptr;
+    }
+    auto [ptr, ec] = std::from_chars(spec.data() + 1, spec.data() + spec.size(), jobid);
+    if(ec != std::errc{} || ptr != spec.data() + spec.size()){
+        return nullptr;
+    }
+    return bgjob_table.find(jobid);
+}
+
 
 struct builtin_fg : public builtin_base{
 
@@ -202,145 +299,1280 @@ struct builtin_fg : public builtin_base{
         return tcsetpgrp(STDIN_FILENO, pgrp);
     }
 
-    void invoke(std::list<std::string>& arglist, std::map<std::size_t, background_execution_unit>& bgjob_table){
+    int invoke(std::span<char* const> args, Job_Table& bgjob_table){
 
         if(bgjob_table.empty()){
-            return;
+            return 1;
         }
 
-        if(arglist.empty()){
-            auto iter = std::prev(bgjob_table.end());
+        background_execution_unit* unit {find_jobspec(bgjob_table, args)};
+        if(!unit){
+            std::printf("Error executing fg: No such job\n");
+            return 1;
+        }
+
+        int status {0};
+        if(unit->status != job_status::done){
 
             // Hand over the terminal device to the foreground job
-            if(set_fg_job(iter->second.pgid) < 0){
+            if(set_fg_job(unit->pgid) < 0){
                 std::printf("Error executing fg\n");
+                return 1;
             }
-            else{
-                killpg(iter->second.pgid, SIGCONT);
-
-                // Wait for foreground process group to exit
-                int no_of_procs = std::count(iter->second.job_cmd.cbegin(), iter->second.job_cmd.cend(), '|') + 1;
-
-                for(int i = 0; i < no_of_procs; i++){
-                    if(waitid(P_PGID, iter->second.pgid, nullptr, WEXITED) == -1){
+            killpg(unit->pgid, SIGCONT);
+            bgjob_table.set_running(*unit);
+
+            // Wait until every process exited or the job stopped again
+            while(unit->status == job_status::running){
+                int pid {waitpid(-unit->pgid, &status, WUNTRACED)};
+                if(pid < 0){
+                    if(errno == EINTR){
+                        continue;
+                    }
+                    if(errno != ECHILD){
                         std::perror("Error");
                     }
+                    break;
                 }
+                bgjob_table.update(pid, status);
+            }
 
-                // Hand over the terminal device to the shell
-                if(signal(SIGTTOU, SIG_IGN) == SIG_ERR){
-                    std::perror("Error");
+            // Hand over the terminal device to the shell
+            if(signal(SIGTTOU, SIG_IGN) == SIG_ERR){
+                std::perror("Error");
+            }
+            tcsetpgrp(STDIN_FILENO, getpgrp());
+            if(signal(SIGTTOU, SIG_DFL) == SIG_ERR){
+                std::perror("Error");
+            }
+        }
+
+        if(unit->status == job_status::stopped){
+            std::printf("\n[%zu] Stopped \t\t\t%s\n", unit->job_id, unit->job_cmd.c_str());
+            return 128 + WSTOPSIG(status);
+        }
+
+        // The status of a job is the one of its last process
+        status = unit->procs.back().wait_status;
+        bgjob_table.erase(unit->job_id);
+        return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+
+    ~builtin_fg(){}
+
+};
+
+
+struct builtin_bg : public builtin_base{
+    builtin_bg() : builtin_base() {}
+
+    int invoke(std::span<char* const> args, Job_Table& bgjob_table){
+        if(bgjob_table.empty()){
+            return 1;
+        }
+        background_execution_unit* unit {find_jobspec(bgjob_table, args)};
+        if(!unit || killpg(unit->pgid, SIGCONT) < 0){
+            std::printf("Error executing bg\n");
+            return 1;
+        }
+        bgjob_table.set_running(*unit);
+        return 0;
+    }
+};
+
+// wait without operands waits for every background job, with %n or pid
+// operands for those jobs, and returns the status of the last one. A waited
+// job leaves the table without a Done report.
+struct builtin_wait : public builtin_base{
+
+    builtin_wait() : builtin_base() {}
+
+    static int wait_job(Job_Table& bgjob_table, background_execution_unit& unit){
+
+        while(unit.status != job_status::done){
+            int status {0};
+            int pid {waitpid(-unit.pgid, &status, 0)};
+            if(pid < 0){
+                if(errno == EINTR){
+                    continue;
                 }
-                tcsetpgrp(STDIN_FILENO, getpgrp());
-                if(signal(SIGTTOU, SIG_DFL) == SIG_ERR){
+                if(errno != ECHILD){
                     std::perror("Error");
                 }
+                break;
+            }
+            bgjob_table.update(pid, status);
+        }
+
+        // The status of a job is the one of its last process
+        int status {unit.procs.back().wait_status};
+        bgjob_table.erase(unit.job_id);
+        return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
 
-                // Remove job from background job table
-                bgjob_table.erase(iter);
+    int invoke(std::span<char* const> args, Job_Table& bgjob_table){
+
+        if(args.empty()){
+            std::vector<std::size_t> ids;
+            bgjob_table.for_each([&ids](const background_execution_unit& unit){
+                ids.push_back(unit.job_id);
+            });
+            for(std::size_t id : ids){
+                wait_job(bgjob_table, *bgjob_table.find(id));
             }
+            return 0;
         }
-        else{
-            if(arglist.front().starts_with("%")){
-                try{
-                    std::size_t jobid = std::stoi(arglist.front().substr(1));
-                    auto iter = bgjob_table.find(jobid);
-                    if(iter != bgjob_table.end()){
-                        if(set_fg_job(bgjob_table[jobid].pgid) < 0){
-                            std::printf("Error executing fg\n");
-                        }
-                        else{
-                            killpg(bgjob_table[jobid].pgid, SIGCONT);
-                            // Wait for foreground process group to exit
-                            int no_of_procs = std::count(iter->second.job_cmd.cbegin(), iter->second.job_cmd.cend(), '|') + 1;
-
-                            for(int i = 0; i < no_of_procs; i++){
-                                if(waitid(P_PGID, iter->second.pgid, nullptr, WEXITED) == -1){
-                                    std::perror("Error");
-                                }
-                            }
-
-                            // Hand over the terminal device to the shell
-                            if(signal(SIGTTOU, SIG_IGN) == SIG_ERR){
-                                std::perror("Error");
-                            }
-                            tcsetpgrp(STDIN_FILENO, getpgrp());
-                            if(signal(SIGTTOU, SIG_DFL) == SIG_ERR){
-                                std::perror("Error");
-                            }
-
-                            // Remove job from background job table
-                            bgjob_table.erase(iter);
-                        }
+
+        int status {0};
+        for(char* const& arg : args){
+            std::string_view spec {arg};
+            background_execution_unit* unit {nullptr};
+            int pid {0};
+            if(spec.starts_with("%")){
+                unit = find_jobspec(bgjob_table, {&arg, 1});
+            }
+            else if(auto [ptr, ec] = std::from_chars(spec.data(), spec.data() + spec.size(), pid); ec == std::errc{} && ptr == spec.data() + spec.size()){
+                unit = bgjob_table.find_pid(pid);
+            }
+            if(!unit){
+                std::fprintf(stderr, "wait: %s: no such job\n", arg);
+                status = 127;
+                continue;
+            }
+            status = wait_job(bgjob_table, *unit);
+        }
+        return status;
+    }
+};
+
+struct builtin_hash : public builtin_base{
+
+    builtin_hash() : builtin_base() {}
+
+    constexpr static char help_text[] {
+        "hash: usage: hash [-r] [name ...]\n"
+    };
+
+    int invoke(std::span<char* const> args, [[maybe_unused]] Job_Table& bgjob_table){
+
+        Command_Hash& command_hash {Command_Hash::get_instance()};
+
+        if(args.empty()){
+            const Command_Hash::hash_table_type& table {command_hash.get_table()};
+            if(table.empty()){
+                std::printf("hash: hash table empty\n");
+                return 0;
+            }
+            std::printf("hits\tcommand\n");
+            for(const auto& [cmd, entry] : table){
+                std::printf("%4u\t%s\n", entry.hits, entry.path.c_str());
+            }
+            return 0;
+        }
+
+        int status {0};
+
+        for(std::string_view arg : args){
+            if(arg == "-r"){
+                command_hash.clear();
+            }
+            else if(arg.starts_with("-")){
+                std::fprintf(stdout, help_text);
+                return 2;
+            }
+            else if(!command_hash.seed(arg)){
+                std::printf("hash: %.*s: not found\n", static_cast<int>(arg.size()), arg.data());
+                status = 1;
+            }
+        }
+        return status;
+    }
+};
+
+struct builtin_launcher : public builtin_base{
+
+    builtin_launcher() : builtin_base() {}
+
+    constexpr static char help_text[] {
+        "launcher: usage: launcher [fork | spawn]\n"
+    };
+
+    int invoke(std::span<char* const> args, [[maybe_unused]] Job_Table& bgjob_table){
+
+        Process_Launcher& launcher {Process_Launcher::get_instance()};
+
+        if(args.empty()){
+            std::printf("%s\n", Process_Launcher::get_mode_name(launcher.get_mode()));
+            return 0;
+        }
+
+        launcher_mode mode;
+        if(args.size() > 1 || !Process_Launcher::parse_mode(args.front(), mode)){
+            std::fprintf(stdout, help_text);
+            return 2;
+        }
+        launcher.set_mode(mode);
+        return 0;
+    }
+};
+
+struct builtin_cgroups : public builtin_base{
+
+    builtin_cgroups() : builtin_base() {}
+
+    constexpr static char help_text[] {
+        "cgroups: usage: cgroups [on | off]\n"
+    };
+
+    int invoke(std::span<char* const> args, [[maybe_unused]] Job_Table& bgjob_table){
+
+        Job_Cgroups& cgroups {Job_Cgroups::get_instance()};
+
+        if(args.empty()){
+            if(cgroups.is_enabled()){
+                std::printf("on %s\n", cgroups.get_base().c_str());
+            }
+            else{
+                std::printf("off\n");
+            }
+            return 0;
+        }
+
+        std::string_view mode {args.front()};
+        if(args.size() > 1 || (mode != "on" && mode != "off")){
+            std::fprintf(stdout, help_text);
+            return 2;
+        }
+        if(mode == "off"){
+            cgroups.disable();
+            return 0;
+        }
+        return cgroups.enable() ? 0 : 1;
+    }
+};
+
+struct builtin_pipesize : public builtin_base{
+
+    builtin_pipesize() : builtin_base() {}
+
+    constexpr static char help_text[] {
+        "pipesize: usage: pipesize [size[k|m] | default] | pipesize relay [on | off]\n"
+    };
+
+    int invoke(std::span<char* const> args, [[maybe_unused]] Job_Table& bgjob_table){
+
+        Pipe_Config& pipe_config {Pipe_Config::get_instance()};
+
+        if(args.empty()){
+            std::size_t size {pipe_config.get_session_size()};
+            if(size == 0){
+                std::printf("pipe size: default");
+            }
+            else{
+                std::printf("pipe size: %zu", std::min(size, pipe_config.get_max_size()));
+            }
+            std::printf(" (max %zu), relay: %s\n", pipe_config.get_max_size(), pipe_config.get_relay() ? "on" : "off");
+            return 0;
+        }
+
+        std::string_view arg {args.front()};
+        if(arg == "relay" && args.size() == 2){
+            std::string_view mode {args[1]};
+            if(mode == "on" || mode == "off"){
+                pipe_config.set_relay(mode == "on");
+                return 0;
+            }
+        }
+        else if(args.size() == 1){
+            std::size_t size {0};
+            if(arg == "default" || Pipe_Config::parse_size(arg, size)){
+                pipe_config.set_session_size(size);
+                return 0;
+            }
+        }
+        std::fprintf(stdout, help_text);
+        return 2;
+    }
+};
+
+
+// history prints the shared history numbered from 1, history n the last n
+// entries. -s and -p list the entries containing text or starting with
+// prefix, newest first.
+struct builtin_history : public builtin_base{
+
+    builtin_history() : builtin_base() {}
+
+    constexpr static char help_text[] {
+        "history: usage: history [n] | history -s text | history -p prefix\n"
+    };
+
+    static void print_entry(std::size_t index, std::string_view entry){
+        std::printf("%6zu  %.*s\n", index + 1, static_cast<int>(entry.size()), entry.data());
+    }
+
+    int invoke(std::span<char* const> args, [[maybe_unused]] Job_Table& bgjob_table){
+
+        History& history {History::get_instance()};
+        std::size_t count {history.size()};
+
+        if(args.size() == 2 && (std::string_view(args[0]) == "-s" || std::string_view(args[0]) == "-p")){
+            bool prefix {std::string_view(args[0]) == "-p"};
+            std::string_view text {args[1]};
+            std::size_t index {count};
+            while(true){
+                index = prefix ? history.search_prefix(text, index) : history.search_reverse(text, index);
+                if(index == History::npos){
+                    break;
+                }
+                print_entry(index, history.get_entry(index));
+            }
+            return 0;
+        }
+
+        std::size_t first {0};
+        if(args.size() == 1){
+            std::size_t last {0};
+            std::string_view arg {args[0]};
+            auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), last);
+            if(ec != std::errc{} || ptr != arg.data() + arg.size()){
+                std::fprintf(stderr, help_text);
+                return 2;
+            }
+            first = count - std::min(last, count);
+        }
+        else if(!args.empty()){
+            std::fprintf(stderr, help_text);
+            return 2;
+        }
+
+        for(std::size_t index{first}; index < count; ++index){
+            print_entry(index, history.get_entry(index));
+        }
+        return 0;
+    }
+};
+
+
+// parallel runs command once per item, items are the words after ::: or
+// else the lines of stdin. At most N items run at a time (-j, default one
+// per CPU) and their output comes out in item order.
+struct builtin_parallel : public builtin_base{
+
+    Parallel_Runner runner;
+
+    builtin_parallel() : builtin_base() {}
+
+    constexpr static char help_text[] {
+        "parallel: usage: parallel [-j N] command [arg ...] [::: item ...]\n"
+    };
+
+    int invoke(std::span<char* const> args, [[maybe_unused]] Job_Table& bgjob_table){
+
+        long cpus {sysconf(_SC_NPROCESSORS_ONLN)};
+        std::size_t jobs {cpus > 0 ? static_cast<std::size_t>(cpus) : 1};
+
+        while(!args.empty() && args[0][0] == '-'){
+            std::string_view option {args[0]};
+            args = args.subspan(1);
+            if(option == "--"){
+                break;
+            }
+            if(!option.starts_with("-j")){
+                std::fprintf(stderr, help_text);
+                return 2;
+            }
+            std::string_view value {option.substr(2)};
+            if(value.empty() && !args.empty()){
+                value = args[0];
+                args = args.subspan(1);
+            }
+            auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(), jobs);
+            if(ec != std::errc{} || ptr != value.data() + value.size() || jobs == 0){
+                std::fprintf(stderr, help_text);
+                return 2;
+            }
+        }
+
+        auto separator = std::find_if(args.begin(), args.end(), [](const char* arg){
+            return std::string_view(arg) == ":::";
+        });
+        std::span<char* const> command {args.begin(), separator};
+        if(command.empty()){
+            std::fprintf(stderr, help_text);
+            return 2;
+        }
+        if(separator == args.end()){
+            return runner.run(jobs, command, {}, true);
+        }
+        return runner.run(jobs, command, {separator + 1, args.end()}, false);
+    }
+};
+
+
+// Appends text to out with backslash escapes replaced. echo -e and printf %b
+// write octal as \0nnn, a printf format as \nnn. Returns false at \c, after
+// which nothing more may be written.
+inline bool append_escaped(std::string_view text, std::string& out, bool zero_octal){
+
+    for(std::size_t i{0}; i < text.size(); ++i){
+        if(text[i] != '\\' || i + 1 == text.size()){
+            out += text[i];
+            continue;
+        }
+
+        char esc {text[++i]};
+        switch(esc){
+            case 'a': out += '\a'; break;
+            case 'b': out += '\b'; break;
+            case 'e': out += '\x1b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'v': out += '\v'; break;
+            case '\\': out += '\\'; break;
+            case 'c': return false;
+            default:
+                if(esc >= '0' && esc <= '7' && (!zero_octal || esc == '0')){
+                    std::size_t max_digits {3};
+                    unsigned value {0};
+                    if(zero_octal){
+                        ++i;
                     }
-                    else{
-                        std::printf("Error executing fg: No such job\n");
+                    for(; max_digits > 0 && i < text.size() && text[i] >= '0' && text[i] <= '7'; --max_digits, ++i){
+                        value = value * 8 + static_cast<unsigned>(text[i] - '0');
                     }
+                    --i;
+                    out += static_cast<char>(value & 0xff);
                 }
-                catch(...){
-                    std::printf("Error executing fg\n");
+                else{
+                    out += '\\';
+                    out += esc;
                 }
+                break;
+        }
+    }
+    return true;
+}
+
+// Builtins collect their output and write it with a single call
+inline void write_output(const std::string& out){
+    std::fwrite(out.data(), 1, out.size(), stdout);
+}
+
+
+struct builtin_true : public builtin_base{
+
+    builtin_true() : builtin_base() {}
+    int invoke(std::span<char* const>, [[maybe_unused]] Job_Table& bgjob_table){
+        return 0;
+    }
+};
+
+struct builtin_false : public builtin_base{
+
+    builtin_false() : builtin_base() {}
+    int invoke(std::span<char* const>, [[maybe_unused]] Job_Table& bgjob_table){
+        return 1;
+    }
+};
+
+
+struct builtin_echo : public builtin_base{
+
+    std::string out;
+
+    builtin_echo() : builtin_base() {}
+
+    int invoke(std::span<char* const> args, [[maybe_unused]] Job_Table& bgjob_table){
+
+        bool newline {true};
+        bool escapes {false};
+
+        // Leading words made only of -n, -e and -E are options
+        while(!args.empty()){
+            std::string_view arg {args.front()};
+            if(arg.size() < 2 || arg.front() != '-' || arg.find_first_not_of("neE", 1) != std::string_view::npos){
+                break;
             }
-            else{
-                std::printf("Error executing fg: No such job\n");
+            for(char opt : arg.substr(1)){
+                if(opt == 'n'){
+                    newline = false;
+                }
+                else{
+                    escapes = (opt == 'e');
+                }
             }
+            args = args.subspan(1);
         }
+
+        out.clear();
+        for(std::size_t i{0}; i < args.size(); ++i){
+            if(i > 0){
+                out += ' ';
+            }
+            if(escapes && !append_escaped(args[i], out, true)){
+                newline = false;
+                break;
+            }
+            if(!escapes){
+                out += args[i];
+            }
+        }
+        if(newline){
+            out += '\n';
+        }
+        write_output(out);
+        return 0;
     }
+};
 
-    ~builtin_fg(){}
 
-};
+struct builtin_printf : public builtin_base{
 
+    std::string out;
+    std::string spec;
+    std::string escaped;
+    int status {0};
 
-struct builtin_bg : public builtin_base{
-    builtin_bg() : builtin_base() {}
+    builtin_printf() : builtin_base() {}
 
-    void invoke(std::list<std::string>& arglist, std::map<std::size_t, background_execution_unit>& bgjob_table){
-        if(bgjob_table.empty()){
+    constexpr static char help_text[] {
+        "printf: usage: printf format [arguments]\n"
+    };
+
+    void append_formatted(const char* fmt, ...) __attribute__((format(printf, 2, 3))){
+        char buffer[256];
+        std::va_list args;
+        va_start(args, fmt);
+        int length = std::vsnprintf(buffer, sizeof(buffer), fmt, args);
+        va_end(args);
+        if(length < 0){
             return;
         }
-        if(arglist.empty()){
-            auto iter = bgjob_table.find(bgjob_table.size());
-            killpg(iter->second.pgid, SIGCONT);
-            bgjob_table[iter->second.job_id].status = job_status::running;
+        if(static_cast<std::size_t>(length) < sizeof(buffer)){
+            out.append(buffer, static_cast<std::size_t>(length));
+            return;
         }
-        else{
-            if(arglist.front().starts_with("%")){
-                try{
-                    std::size_t jobid = std::stoi(arglist.front().substr(1));
-                    if(bgjob_table.find(jobid) != bgjob_table.end()){
-                        killpg(bgjob_table[jobid].pgid, SIGCONT);
-                        bgjob_table[jobid].status = job_status::running;
+        std::size_t offset {out.size()};
+        out.resize(offset + static_cast<std::size_t>(length) + 1);
+        va_start(args, fmt);
+        std::vsnprintf(out.data() + offset, static_cast<std::size_t>(length) + 1, fmt, args);
+        va_end(args);
+        out.resize(offset + static_cast<std::size_t>(length));
+    }
+
+    // A leading quote gives the character code, like other printf implementations
+    template<typename T>
+    bool parse_number(std::string_view arg, T& value){
+        if(arg.empty()){
+            value = 0;
+            return true;
+        }
+        if(arg.front() == '\'' || arg.front() == '"'){
+            value = (arg.size() > 1) ? static_cast<T>(static_cast<unsigned char>(arg[1])) : 0;
+            return true;
+        }
+        if(arg.front() == '+'){
+            arg.remove_prefix(1);
+        }
+        int base {10};
+        if(arg.starts_with("0x") || arg.starts_with("0X")){
+            base = 16;
+            arg.remove_prefix(2);
+        }
+        else if(arg.size() > 1 && arg.front() == '0'){
+            base = 8;
+        }
+        auto [ptr, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), value, base);
+        if(ec != std::errc{} || ptr != arg.data() + arg.size()){
+            std::fprintf(stderr, "printf: %.*s: invalid number\n", static_cast<int>(arg.size()), arg.data());
+            status = 1;
+            return false;
+        }
+        return true;
+    }
+
+    // One pass over the format. Returns false when output has to stop.
+    bool format_once(std::string_view format, std::span<char* const> args, std::size_t& next){
+
+        auto next_arg = [&]() -> std::string_view {
+            return (next < args.size()) ? std::string_view(args[next++]) : std::string_view();
+        };
+
+        for(std::size_t i{0}; i < format.size(); ++i){
+
+            if(format[i] == '\\'){
+                std::size_t end {i + 1};
+                if(end < format.size() && format[end] >= '0' && format[end] <= '7'){
+                    while(end < format.size() && end < i + 4 && format[end] >= '0' && format[end] <= '7'){
+                        ++end;
+                    }
+                }
+                else{
+                    end = std::min(end + 1, format.size());
+                }
+                if(!append_escaped(format.substr(i, end - i), out, false)){
+                    return false;
+                }
+                i = end - 1;
+                continue;
+            }
+
+            if(format[i] != '%'){
+                out += format[i];
+                continue;
+            }
+            if(i + 1 < format.size() && format[i + 1] == '%'){
+                out += '%';
+                ++i;
+                continue;
+            }
+
+            // Flags and width are passed on to the C library. The precision
+            // is kept apart, strings are cut to it here and numbers get it
+            // back in their spec.
+            spec.assign("%");
+            std::size_t pos {i + 1};
+            while(pos < format.size() && std::string_view("-+ #0").find(format[pos]) != std::string_view::npos){
+                spec += format[pos++];
+            }
+            if(pos < format.size() && format[pos] == '*'){
+                int value {0};
+                parse_number(next_arg(), value);
+                spec += std::to_string(value);
+                ++pos;
+            }
+            while(pos < format.size() && format[pos] >= '0' && format[pos] <= '9'){
+                spec += format[pos++];
+            }
+            int precision {-1};
+            if(pos < format.size() && format[pos] == '.'){
+                precision = 0;
+                ++pos;
+                if(pos < format.size() && format[pos] == '*'){
+                    parse_number(next_arg(), precision);
+                    ++pos;
+                }
+                std::size_t digits {pos};
+                while(pos < format.size() && format[pos] >= '0' && format[pos] <= '9'){
+                    ++pos;
+                }
+                if(pos > digits){
+                    std::from_chars(format.data() + digits, format.data() + pos, precision);
+                }
+                // A negative precision counts as none
+                precision = std::max(precision, -1);
+            }
+            if(pos >= format.size()){
+                std::fprintf(stderr, "printf: %.*s: missing format character\n", static_cast<int>(format.size() - i), format.data() + i);
+                status = 1;
+                return false;
+            }
+
+            char conversion {format[pos]};
+            i = pos;
+            if(precision >= 0 && conversion != 's' && conversion != 'b' && conversion != 'c'){
+                spec += '.';
+                spec += std::to_string(precision);
+            }
+
+            switch(conversion){
+                case 's':
+                case 'b':
+                case 'c': {
+                    std::string_view arg {next_arg()};
+                    bool keep_going {true};
+                    if(conversion == 'b'){
+                        escaped.clear();
+                        keep_going = append_escaped(arg, escaped, true);
+                        arg = escaped;
+                    }
+                    if(conversion == 'c'){
+                        arg = arg.substr(0, 1);
+                    }
+                    else if(precision >= 0){
+                        arg = arg.substr(0, static_cast<std::size_t>(precision));
+                    }
+                    spec += ".*s";
+                    append_formatted(spec.c_str(), static_cast<int>(arg.size()), arg.data());
+                    if(!keep_going){
+                        return false;
+                    }
+                    break;
+                }
+                case 'd':
+                case 'i': {
+                    long long value {0};
+                    parse_number(next_arg(), value);
+                    spec += "lld";
+                    append_formatted(spec.c_str(), value);
+                    break;
+                }
+                case 'u':
+                case 'o':
+                case 'x':
+                case 'X': {
+                    unsigned long long value {0};
+                    std::string_view arg {next_arg()};
+                    long long signed_value {0};
+                    if(arg.starts_with("-") && parse_number(arg.substr(1), signed_value)){
+                        value = static_cast<unsigned long long>(-signed_value);
                     }
                     else{
-                        std::printf("Error executing bg\n");
+                        parse_number(arg, value);
                     }
+                    spec += "ll";
+                    spec += conversion;
+                    append_formatted(spec.c_str(), value);
+                    break;
                 }
-                catch(...){
-                    std::printf("Error executing bg\n");
+                case 'e':
+                case 'E':
+                case 'f':
+                case 'F':
+                case 'g':
+                case 'G':
+                case 'a':
+                case 'A': {
+                    std::string arg {next_arg()};
+                    char* end {nullptr};
+                    double value {arg.empty() ? 0.0 : std::strtod(arg.c_str(), &end)};
+                    if(!arg.empty() && *end != '\0'){
+                        std::fprintf(stderr, "printf: %s: invalid number\n", arg.c_str());
+                        status = 1;
+                    }
+                    spec += conversion;
+                    append_formatted(spec.c_str(), value);
+                    break;
                 }
+                default:
+                    std::fprintf(stderr, "printf: %c: invalid format character\n", conversion);
+                    status = 1;
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    int invoke(std::span<char* const> args, [[maybe_unused]] Job_Table& bgjob_table){
+
+        if(args.empty()){
+            std::fprintf(stderr, help_text);
+            return 2;
+        }
+
+        std::string_view format {args.front()};
+        args = args.subspan(1);
+
+        out.clear();
+        status = 0;
+
+        // The format is reused until every argument is consumed
+        std::size_t next {0};
+        while(format_once(format, args, next) && next > 0 && next < args.size()){}
+
+        write_output(out);
+        return status;
+    }
+};
+
+
+struct builtin_pwd : public builtin_base{
+
+    builtin_pwd() : builtin_base() {}
+
+    int invoke(std::span<char* const>, [[maybe_unused]] Job_Table& bgjob_table){
+
+        char cwd[PATH_MAX];
+        if(getcwd(cwd, sizeof(cwd)) == nullptr){
+            std::perror("pwd");
+            return 1;
+        }
+        std::printf("%s\n", cwd);
+        return 0;
+    }
+};
+
+
+struct builtin_export : public builtin_base{
+
+    builtin_export() : builtin_base() {}
+
+    constexpr static char help_text[] {
+        "export: usage: export [-p] [name[=value] ...]\n"
+    };
+
+    static void print_quoted(std::string_view value){
+        std::putchar('"');
+        for(char ch : value){
+            if(ch == '"' || ch == '\\' || ch == '$' || ch == '`'){
+                std::putchar('\\');
+            }
+            std::putchar(ch);
+        }
+        std::putchar('"');
+    }
+
+    int invoke(std::span<char* const> args, [[maybe_unused]] Job_Table& bgjob_table){
+
+        if(!args.empty() && std::string_view(args.front()) == "-p"){
+            args = args.subspan(1);
+        }
+
+        if(args.empty()){
+            environment::init_env();
+            for(const auto& [name, value] : environment::envmap){
+                std::printf("export %s=", name.c_str());
+                print_quoted(value);
+                std::putchar('\n');
+            }
+            return 0;
+        }
+
+        int status {0};
+        for(std::string_view arg : args){
+            std::string_view::size_type dlim {arg.find('=')};
+            std::string_view name {arg.substr(0, dlim)};
+            if(arg.starts_with("-")){
+                std::fprintf(stderr, help_text);
+                return 2;
+            }
+            if(!environment::is_valid_name(name)){
+                std::fprintf(stderr, "export: `%.*s': not a valid identifier\n", static_cast<int>(arg.size()), arg.data());
+                status = 1;
+                continue;
+            }
+            Shell_Variables& variables {Shell_Variables::get_instance()};
+            bool exported {(dlim == std::string_view::npos) ? variables.export_variable(name) :
+                            variables.set(name, arg.substr(dlim + 1)) && variables.export_variable(name)};
+            if(!exported){
+                std::perror("export");
+                status = 1;
+            }
+        }
+        return status;
+    }
+};
+
+struct builtin_unset : public builtin_base{
+
+    builtin_unset() : builtin_base() {}
+
+    constexpr static char help_text[] {
+        "unset: usage: unset [-v] name ...\n"
+    };
+
+    int invoke(std::span<char* const> args, [[maybe_unused]] Job_Table& bgjob_table){
+
+        if(!args.empty() && std::string_view(args.front()) == "-v"){
+            args = args.subspan(1);
+        }
+
+        int status {0};
+        for(std::string_view name : args){
+            if(name.starts_with("-")){
+                std::fprintf(stderr, help_text);
+                return 2;
+            }
+            if(!environment::is_valid_name(name)){
+                std::fprintf(stderr, "unset: `%.*s': not a valid identifier\n", static_cast<int>(name.size()), name.data());
+                status = 1;
+                continue;
+            }
+            Shell_Variables::get_instance().unset(name);
+        }
+        return status;
+    }
+};
+
+// Prints the environment with NAME=value operands on top. -i starts from an
+// empty environment and -u removes a name. `env [-i] [-u NAME] NAME=value...
+// cmd` never gets here, the shell runs cmd with that environment itself, and
+// forms handles() rejects, other options or a command after expanded words,
+// run the external env.
+struct builtin_env : public builtin_base{
+
+    builtin_env() : builtin_base() {}
+
+    constexpr static char help_text[] {
+        "env: usage: env [-i] [-u name] [name=value ...]\n"
+    };
+
+    static bool handles(std::span<char* const> args){
+
+        std::size_t index {0};
+        for(; index < args.size(); ++index){
+            std::string_view arg {args[index]};
+            if(arg == "-u" && index + 1 < args.size()){
+                ++index;
+            }
+            else if(arg == "--"){
+                ++index;
+                break;
+            }
+            else if(arg != "-i" && arg != "-"){
+                break;
+            }
+        }
+        return std::all_of(args.begin() + static_cast<std::ptrdiff_t>(index), args.end(), [](const char* arg){
+            const char* dlim {std::strchr(arg, '=')};
+            return dlim && dlim != arg;
+        });
+    }
+
+    int invoke(std::span<char* const> args, [[maybe_unused]] Job_Table& bgjob_table){
+
+        environment::init_env();
+        std::map<std::string_view, std::string_view> env;
+        for(const auto& [name, value] : environment::envmap){
+            env.emplace(name, value);
+        }
+
+        std::size_t index {0};
+        for(; index < args.size(); ++index){
+            std::string_view arg {args[index]};
+            if(arg == "-i" || arg == "-"){
+                env.clear();
+            }
+            else if(arg == "-u" && index + 1 < args.size()){
+                env.erase(std::string_view(args[++index]));
+            }
+            else if(arg == "--"){
+                ++index;
+                break;
             }
             else{
-                std::printf("Error executing bg\n");
+                break;
+            }
+        }
+
+        for(; index < args.size(); ++index){
+            std::string_view arg {args[index]};
+            std::string_view::size_type dlim {arg.find('=')};
+            if(dlim == std::string_view::npos || dlim == 0){
+                std::fprintf(stderr, help_text);
+                return 125;
+            }
+            env.insert_or_assign(arg.substr(0, dlim), arg.substr(dlim + 1));
+        }
+
+        for(const auto& [name, value] : env){
+            std::printf("%.*s=%.*s\n", static_cast<int>(name.size()), name.data(), static_cast<int>(value.size()), value.data());
+        }
+        return 0;
+    }
+};
+
+
+// test and [ use the POSIX rules for up to four arguments and a recursive
+// descent parser for longer expressions. Exit status 0 is true, 1 false and
+// 2 a usage error.
+struct builtin_test : public builtin_base{
+
+    const char* name;
+    bool bracket;
+    bool failed {false};
+
+    std::span<char* const> tokens;
+    std::size_t pos {0};
+
+    explicit builtin_test(bool _bracket) :
+        builtin_base(),
+        name{_bracket ? "[" : "test"},
+        bracket{_bracket}
+        {}
+
+    static bool is_unary(std::string_view op) noexcept {
+        return op.size() == 2 && op.front() == '-' && std::string_view("bcdefghLkprsStuwxOGzn").find(op[1]) != std::string_view::npos;
+    }
+
+    static bool is_binary(std::string_view op) noexcept {
+        constexpr std::string_view ops[] {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef"};
+        return std::find(std::begin(ops), std::end(ops), op) != std::end(ops);
+    }
+
+    bool fail(const char* message, std::string_view token){
+        if(!failed){
+            std::fprintf(stderr, "%s: %.*s: %s\n", name, static_cast<int>(token.size()), token.data(), message);
+        }
+        failed = true;
+        return false;
+    }
+
+    bool parse_integer(std::string_view text, long long& value){
+        std::string_view trimmed {text};
+        while(!trimmed.empty() && (trimmed.front() == ' ' || trimmed.front() == '\t')){
+            trimmed.remove_prefix(1);
+        }
+        while(!trimmed.empty() && (trimmed.back() == ' ' || trimmed.back() == '\t')){
+            trimmed.remove_suffix(1);
+        }
+        if(trimmed.starts_with("+")){
+            trimmed.remove_prefix(1);
+        }
+        auto [ptr, ec] = std::from_chars(trimmed.data(), trimmed.data() + trimmed.size(), value);
+        if(trimmed.empty() || ec != std::errc{} || ptr != trimmed.data() + trimmed.size()){
+            return fail("integer expression expected", text);
+        }
+        return true;
+    }
+
+    bool unary(std::string_view op, const char* arg){
+
+        struct stat info {};
+        char flag {op[1]};
+
+        switch(flag){
+            case 'z': return arg[0] == '\0';
+            case 'n': return arg[0] != '\0';
+            case 'r': return access(arg, R_OK) == 0;
+            case 'w': return access(arg, W_OK) == 0;
+            case 'x': return access(arg, X_OK) == 0;
+            case 't': {
+                long long fd {0};
+                return parse_integer(arg, fd) && isatty(static_cast<int>(fd));
+            }
+            case 'h':
+            case 'L':
+                return lstat(arg, &info) == 0 && S_ISLNK(info.st_mode);
+            default:
+                break;
+        }
+
+        if(stat(arg, &info) != 0){
+            return false;
+        }
+        switch(flag){
+            case 'b': return S_ISBLK(info.st_mode);
+            case 'c': return S_ISCHR(info.st_mode);
+            case 'd': return S_ISDIR(info.st_mode);
+            case 'e': return true;
+            case 'f': return S_ISREG(info.st_mode);
+            case 'g': return (info.st_mode & S_ISGID) != 0;
+            case 'k': return (info.st_mode & S_ISVTX) != 0;
+            case 'p': return S_ISFIFO(info.st_mode);
+            case 's': return info.st_size > 0;
+            case 'S': return S_ISSOCK(info.st_mode);
+            case 'u': return (info.st_mode & S_ISUID) != 0;
+            case 'O': return info.st_uid == geteuid();
+            case 'G': return info.st_gid == getegid();
+            default: return false;
+        }
+    }
+
+    bool binary(const char* lhs, std::string_view op, const char* rhs){
+
+        std::string_view left {lhs};
+        std::string_view right {rhs};
+
+        if(op == "=" || op == "=="){
+            return left == right;
+        }
+        if(op == "!="){
+            return left != right;
+        }
+        if(op == "<"){
+            return left < right;
+        }
+        if(op == ">"){
+            return left > right;
+        }
+        if(op == "-a"){
+            return !left.empty() && !right.empty();
+        }
+        if(op == "-o"){
+            return !left.empty() || !right.empty();
+        }
+
+        if(op == "-nt" || op == "-ot" || op == "-ef"){
+            struct stat linfo {};
+            struct stat rinfo {};
+            bool lok {stat(lhs, &linfo) == 0};
+            bool rok {stat(rhs, &rinfo) == 0};
+            if(op == "-ef"){
+                return lok && rok && linfo.st_dev == rinfo.st_dev && linfo.st_ino == rinfo.st_ino;
+            }
+            auto mtime = [](const struct stat& info){
+                return std::pair{info.st_mtim.tv_sec, info.st_mtim.tv_nsec};
+            };
+            if(op == "-nt"){
+                return lok && (!rok || mtime(linfo) > mtime(rinfo));
             }
+            return rok && (!lok || mtime(linfo) < mtime(rinfo));
         }
+
+        long long lvalue {0};
+        long long rvalue {0};
+        if(!parse_integer(left, lvalue) || !parse_integer(right, rvalue)){
+            return false;
+        }
+        if(op == "-eq") return lvalue == rvalue;
+        if(op == "-ne") return lvalue != rvalue;
+        if(op == "-lt") return lvalue < rvalue;
+        if(op == "-le") return lvalue <= rvalue;
+        if(op == "-gt") return lvalue > rvalue;
+        return lvalue >= rvalue;
+    }
+
+    std::string_view peek() const noexcept {
+        return (pos < tokens.size()) ? std::string_view(tokens[pos]) : std::string_view();
+    }
+
+    std::size_t remaining() const noexcept {
+        return tokens.size() - pos;
+    }
+
+    bool parse_or(){
+        bool value {parse_and()};
+        while(!failed && remaining() > 0 && peek() == "-o"){
+            ++pos;
+            bool rhs {parse_and()};
+            value = value || rhs;
+        }
+        return value;
+    }
+
+    bool parse_and(){
+        bool value {parse_not()};
+        while(!failed && remaining() > 0 && peek() == "-a"){
+            ++pos;
+            bool rhs {parse_not()};
+            value = value && rhs;
+        }
+        return value;
+    }
+
+    bool parse_not(){
+        if(remaining() > 1 && peek() == "!"){
+            ++pos;
+            return !parse_not();
+        }
+        return parse_primary();
+    }
+
+    bool parse_primary(){
+
+        if(remaining() == 0){
+            return fail("argument expected", name);
+        }
+        if(remaining() >= 3 && is_binary(tokens[pos + 1])){
+            pos += 3;
+            return binary(tokens[pos - 3], tokens[pos - 2], tokens[pos - 1]);
+        }
+        if(peek() == "(" && remaining() > 1){
+            ++pos;
+            bool value {parse_or()};
+            if(peek() != ")"){
+                return fail("missing `)'", peek());
+            }
+            ++pos;
+            return value;
+        }
+        if(remaining() >= 2 && is_unary(peek())){
+            pos += 2;
+            return unary(tokens[pos - 2], tokens[pos - 1]);
+        }
+        return std::string_view(tokens[pos++]).size() > 0;
+    }
+
+    bool evaluate(std::span<char* const> args){
+
+        std::string_view first {args.empty() ? "" : args[0]};
+
+        switch(args.size()){
+            case 0:
+                return false;
+            case 1:
+                return !first.empty();
+            case 2:
+                if(first == "!"){
+                    return !evaluate(args.subspan(1));
+                }
+                if(is_unary(first)){
+                    return unary(first, args[1]);
+                }
+                return fail("unary operator expected", first);
+            case 3:
+                if(is_binary(args[1]) || std::string_view(args[1]) == "-a" || std::string_view(args[1]) == "-o"){
+                    return binary(args[0], args[1], args[2]);
+                }
+                if(first == "!"){
+                    return !evaluate(args.subspan(1));
+                }
+                if(first == "(" && std::string_view(args[2]) == ")"){
+                    return evaluate(args.subspan(1, 1));
+                }
+                return fail("binary operator expected", args[1]);
+            case 4:
+                if(first == "!"){
+                    return !evaluate(args.subspan(1));
+                }
+                if(first == "(" && std::string_view(args[3]) == ")"){
+                    return evaluate(args.subspan(1, 2));
+                }
+                [[fallthrough]];
+            default:
+                tokens = args;
+                pos = 0;
+                bool value {parse_or()};
+                if(!failed && pos < tokens.size()){
+                    return fail("too many arguments", tokens[pos]);
+                }
+                return value;
+        }
+    }
+
+    int invoke(std::span<char* const> args, [[maybe_unused]] Job_Table& bgjob_table){
+
+        if(bracket){
+            if(args.empty() || std::string_view(args.back()) != "]"){
+                std::fprintf(stderr, "[: missing `]'\n");
+                return 2;
+            }
+            args = args.first(args.size() - 1);
+        }
+
+        failed = false;
+        bool value {evaluate(args)};
+        return failed ? 2 : (value ? 0 : 1);
     }
 };
 
+
 struct Builtin_Table{
 
-    using builtin_table_type =  std::map<std::string, std::unique_ptr<builtin_base>>;
+    using builtin_table_type =  std::map<std::string, std::unique_ptr<builtin_base>, std::less<>>;
     builtin_table_type builtin_map{};
 
 private:
 
     Builtin_Table(){
+        startup_step step {"builtins"};
         builtin_map.insert({"exit", std::make_unique<builtin_exit>()});
         builtin_map.insert({"cd", std::make_unique<builtin_cd>()});
         builtin_map.insert({"kill", std::make_unique<builtin_kill>()});
         builtin_map.insert({"jobs", std::make_unique<builtin_jobs>()});
         builtin_map.insert({"fg", std::make_unique<builtin_fg>()});
         builtin_map.insert({"bg", std::make_unique<builtin_bg>()});
+        builtin_map.insert({"wait", std::make_unique<builtin_wait>()});
+        builtin_map.insert({"hash", std::make_unique<builtin_hash>()});
+        builtin_map.insert({"launcher", std::make_unique<builtin_launcher>()});
+        builtin_map.insert({"cgroups", std::make_unique<builtin_cgroups>()});
+        builtin_map.insert({"pipesize", std::make_unique<builtin_pipesize>()});
+        builtin_map.insert({"true", std::make_unique<builtin_true>()});
+        builtin_map.insert({"false", std::make_unique<builtin_false>()});
+        builtin_map.insert({"echo", std::make_unique<builtin_echo>()});
+        builtin_map.insert({"printf", std::make_unique<builtin_printf>()});
+        builtin_map.insert({"pwd", std::make_unique<builtin_pwd>()});
+        builtin_map.insert({"export", std::make_unique<builtin_export>()});
+        builtin_map.insert({"unset", std::make_unique<builtin_unset>()});
+        builtin_map.insert({"env", std::make_unique<builtin_env>()});
+        builtin_map.insert({"history", std::make_unique<builtin_history>()});
+        builtin_map.insert({"parallel", std::make_unique<builtin_parallel>()});
+        builtin_map.insert({"test", std::make_unique<builtin_test>(false)});
+        builtin_map.insert({"[", std::make_unique<builtin_test>(true)});
     }
 
 public:
@@ -353,14 +1585,17 @@ public:
         return builtin_map;
     }
 
-    bool is_builtin(const std::string& cmd) const noexcept {
+    bool is_builtin(std::string_view cmd) const noexcept {
         return builtin_map.find(cmd) != builtin_map.end();
     }
 
-    void execute(const std::string& cmd, std::list<std::string>& arglist, std::map<std::size_t, background_execution_unit>& bgjob_table) const{
-        if(is_builtin(cmd)){
-            builtin_map.at(cmd)->invoke(arglist, bgjob_table);
+    // Returns the builtin's exit status
+    int execute(std::string_view cmd, std::span<char* const> args, Job_Table& bgjob_table) const{
+        auto iter = builtin_map.find(cmd);
+        if(iter != builtin_map.end()){
+            return iter->second->invoke(args, bgjob_table);
         }
+        return 127;
     }
 };
 
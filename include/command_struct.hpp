@@ -3,27 +3,287 @@
 
 
 #include <vector>
-#include <map>
-#include <string>
-#include <list>
+#include <string_view>
+#include <span>
 #include <cstring>
+#include <cstdint>
 #include <cstdlib>
 
+
+enum class redirect_kind : std::uint8_t{
+    read,
+    write,
+    append,
+    duplicate,
+    procsub,
+    heredoc
+};
+
+// One redirection of a command, applied left to right after the pipeline's
+// pipes. Files are named by an offset into the string buffer, duplicate
+// makes fd a copy of source_fd. procsub connects fd to the pipe of the job's
+// process substitution number source_fd. For heredoc the string is the
+// expanded text the command reads, which may hold NUL bytes, so its length
+// is kept as well.
+struct redirect_info{
+    redirect_kind kind;
+    int fd;
+    int source_fd;
+    std::uint32_t path_offset;
+    std::uint32_t path_length;
+};
+
+
+// One process of a pipeline. argv and envp are index ranges into the arena's
+// pointer slots, both arrays are nullptr terminated. envp holds NAME=value
+// assignments and, for env -u, bare names to remove. Redirections are an
+// index range into the arena's redirections. clear_env (env -i) starts the
+// command with an empty environment.
 struct command_info{
-    std::map<std::string, std::string> envs;
-    std::string execfile;
-    std::vector<std::string> cmdargs;
+    std::uint32_t argv_index;
+    std::uint32_t argc;
+    std::uint32_t envp_index;
+    std::uint32_t envc;
+    std::uint32_t redirect_index;
+    std::uint32_t redirect_count;
+    bool clear_env {false};
+};
+
 
-    int output_fd {1};
-    int input_fd {0};
+enum class time_format : std::uint8_t{
+    none,
+    text,
+    json
+};
 
-    std::string output_filename;
-    std::string input_filename;
+// The commands of <(...) or >(...). For <(...) the last one writes into the
+// pipe, for >(...) the first one reads what the consuming command writes.
+struct procsub_info{
+    std::uint32_t first_command;
+    std::uint32_t command_count;
+    bool output;
 };
 
 
+// One pipeline, run in the foreground or in the background. pipe_size is 0
+// unless the pipeline sets its own pipe size. The commands of its process
+// substitutions come after its own ones.
 struct job_info{
-    std::list<std::list<command_info>> chainlist;
+    std::uint32_t first_command;
+    std::uint32_t command_count;
+    bool background;
+    std::uint32_t pipe_size {0};
+    time_format timing {time_format::none};
+    std::uint32_t first_procsub {0};
+    std::uint32_t procsub_count {0};
+};
+
+
+// All jobs of one input line in contiguous storage. Strings are copied once
+// into a single buffer and argv/envp are laid out as the char* arrays execve
+// expects. While building, slots hold offsets into the string buffer since it
+// may still grow; finalize() turns them into pointers. reset() keeps every
+// buffer's capacity, so the REPL reuses the same memory for every line.
+
+class job_arena
+{
+
+    static constexpr std::uint32_t null_slot {UINT32_MAX};
+
+    std::vector<char> strings;
+    std::vector<std::uint32_t> argv_offsets;
+    std::vector<std::uint32_t> envp_offsets;
+    std::vector<char*> argv_slots;
+    std::vector<char*> envp_slots;
+
+    std::vector<redirect_info> redirects;
+    std::vector<command_info> commands;
+    std::vector<job_info> jobs;
+    std::vector<procsub_info> procsubs;
+    // Commands go to this process substitution instead of the job
+    std::uint32_t building_procsub {null_slot};
+
+    std::uint32_t add_string(std::string_view str){
+        std::uint32_t offset {static_cast<std::uint32_t>(strings.size())};
+        strings.insert(strings.end(), str.begin(), str.end());
+        strings.push_back('\0');
+        return offset;
+    }
+
+    // The command's envp is the last range of envp_offsets while it is built
+    void set_env_entry(std::string_view name, std::uint32_t offset){
+        command_info& cmd {commands.back()};
+        for(std::uint32_t i{cmd.envp_index}; i < cmd.envp_index + cmd.envc; ++i){
+            const char* env {strings.data() + envp_offsets[i]};
+            if(std::strncmp(env, name.data(), name.size()) == 0 && (env[name.size()] == '=' || env[name.size()] == '\0')){
+                envp_offsets[i] = offset;
+                return;
+            }
+        }
+        envp_offsets.push_back(offset);
+        cmd.envc++;
+    }
+
+public:
+    void reset() noexcept {
+        strings.clear();
+        argv_offsets.clear();
+        envp_offsets.clear();
+        argv_slots.clear();
+        envp_slots.clear();
+        redirects.clear();
+        commands.clear();
+        jobs.clear();
+        procsubs.clear();
+        building_procsub = null_slot;
+    }
+
+    void begin_job(bool background){
+        jobs.push_back({static_cast<std::uint32_t>(commands.size()), 0, background});
+        jobs.back().first_procsub = static_cast<std::uint32_t>(procsubs.size());
+    }
+
+    void set_pipe_size(std::uint32_t size) noexcept {
+        jobs.back().pipe_size = size;
+    }
+
+    void set_timing(time_format timing) noexcept {
+        jobs.back().timing = timing;
+    }
+
+    void begin_command(){
+        commands.push_back({static_cast<std::uint32_t>(argv_offsets.size()), 0,
+                            static_cast<std::uint32_t>(envp_offsets.size()), 0,
+                            static_cast<std::uint32_t>(redirects.size()), 0});
+        if(building_procsub != null_slot){
+            procsubs[building_procsub].command_count++;
+        }
+        else{
+            jobs.back().command_count++;
+        }
+    }
+
+    void add_arg(std::string_view arg){
+        argv_offsets.push_back(add_string(arg));
+        commands.back().argc++;
+    }
+
+    // A later assignment to the same name replaces the earlier one
+    void add_env(std::string_view name, std::string_view value){
+        std::uint32_t offset {static_cast<std::uint32_t>(strings.size())};
+        strings.insert(strings.end(), name.begin(), name.end());
+        strings.push_back('=');
+        strings.insert(strings.end(), value.begin(), value.end());
+        strings.push_back('\0');
+        set_env_entry(name, offset);
+    }
+
+    // env -u NAME, the entry is the bare name
+    void add_unset(std::string_view name){
+        set_env_entry(name, add_string(name));
+    }
+
+    // env -i drops what the command was given so far
+    void clear_env(){
+        command_info& cmd {commands.back()};
+        envp_offsets.resize(cmd.envp_index);
+        cmd.envc = 0;
+        cmd.clear_env = true;
+    }
+
+    void add_redirect(redirect_kind kind, int fd, std::string_view path){
+        redirects.push_back({kind, fd, -1, add_string(path), static_cast<std::uint32_t>(path.size())});
+        commands.back().redirect_count++;
+    }
+
+    void add_duplicate(int fd, int source_fd){
+        redirects.push_back({redirect_kind::duplicate, fd, source_fd, 0, 0});
+        commands.back().redirect_count++;
+    }
+
+    // Connects fd of the current command to a new process substitution of
+    // the job and returns its number, its commands are added later
+    std::uint32_t add_procsub(int fd, bool output){
+        std::uint32_t index {jobs.back().procsub_count++};
+        procsubs.push_back({0, 0, output});
+        redirects.push_back({redirect_kind::procsub, fd, static_cast<int>(index), 0, 0});
+        commands.back().redirect_count++;
+        return index;
+    }
+
+    void begin_procsub(std::uint32_t index){
+        building_procsub = jobs.back().first_procsub + index;
+        procsubs[building_procsub].first_command = static_cast<std::uint32_t>(commands.size());
+    }
+
+    void end_procsub() noexcept {
+        building_procsub = null_slot;
+    }
+
+    void end_command(){
+        argv_offsets.push_back(null_slot);
+        envp_offsets.push_back(null_slot);
+    }
+
+    void finalize(){
+        argv_slots.resize(argv_offsets.size());
+        envp_slots.resize(envp_offsets.size());
+        for(std::size_t i{0}; i < argv_offsets.size(); ++i){
+            argv_slots[i] = (argv_offsets[i] == null_slot) ? nullptr : strings.data() + argv_offsets[i];
+        }
+        for(std::size_t i{0}; i < envp_offsets.size(); ++i){
+            envp_slots[i] = (envp_offsets[i] == null_slot) ? nullptr : strings.data() + envp_offsets[i];
+        }
+    }
+
+    const std::vector<job_info>& get_jobs() const noexcept {
+        return jobs;
+    }
+
+    command_info& get_command(const job_info& job, std::size_t index) noexcept {
+        return commands[job.first_command + index];
+    }
+
+    const command_info& get_command(const job_info& job, std::size_t index) const noexcept {
+        return commands[job.first_command + index];
+    }
+
+    std::span<const procsub_info> get_procsubs(const job_info& job) const noexcept {
+        return {procsubs.data() + job.first_procsub, job.procsub_count};
+    }
+
+    const command_info& get_command(const procsub_info& procsub, std::size_t index) const noexcept {
+        return commands[procsub.first_command + index];
+    }
+
+    char* const* get_argv(const command_info& cmd) const noexcept {
+        return argv_slots.data() + cmd.argv_index;
+    }
+
+    char* const* get_envp(const command_info& cmd) const noexcept {
+        return envp_slots.data() + cmd.envp_index;
+    }
+
+    std::size_t get_redirect_count() const noexcept {
+        return redirects.size();
+    }
+
+    std::span<const redirect_info> get_redirects(const command_info& cmd) const noexcept {
+        return {redirects.data() + cmd.redirect_index, cmd.redirect_count};
+    }
+
+    const char* get_path(const redirect_info& redirect) const noexcept {
+        return strings.data() + redirect.path_offset;
+    }
+
+    std::string_view get_text(const redirect_info& redirect) const noexcept {
+        return {strings.data() + redirect.path_offset, redirect.path_length};
+    }
+
+    // Arguments after argv[0], as handed to builtins
+    std::span<char* const> get_args(const command_info& cmd) const noexcept {
+        return {argv_slots.data() + cmd.argv_index + 1, cmd.argc - 1};
+    }
 };
 
 #endif // COMMAND_STRUCT_HPP
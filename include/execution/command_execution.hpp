@@ -2,10 +2,17 @@
 #define COMMAND_EXECUTION_HPP
 
 #include <string>
+#include <string_view>
+#include <vector>
 #include <cstdio>
 #include <csignal>
 
+#include "command_struct.hpp"
+#include "parse_input.hpp"
 #include "execution/job_control.hpp"
+#include "execution/event_loop.hpp"
+#include "execution/path_glob.hpp"
+#include "execution/line_editor.hpp"
 
 class Command_Execution
 {
@@ -13,17 +20,62 @@ class Command_Execution
     std::string prompt_fmt;
     std::string prompt_suffix;
 
+    bool interactive;
+
     Job_Control control_unit;
+    Event_Loop event_loop;
 
-    static sig_atomic_t sigflag;
+    // Reused for every line
+    std::vector<lex::token> line_tokens;
+    parse::line_ast ast;
+    parse::parse_error parse_err;
+    job_arena arena;
+    std::string wordbuf;
+    Path_Glob path_glob;
+    Completion completion;
+    std::vector<std::string> glob_matches;
 
-public:
-    Command_Execution();
+    // Pipelines of <(...) and >(...) met while building a job, as text of
+    // the line, and the fd the next one in a command is seen as. The first
+    // one is 63, or the highest fd below a lower open file limit.
+    std::vector<std::string_view> procsub_texts;
+    std::vector<lex::token> procsub_tokens;
+    parse::line_ast procsub_ast;
+    int procsub_top {63};
+    int procsub_fd {63};
+
+    // A line starting here-documents is joined with the lines of their
+    // bodies that follow it, up to the last delimiter
+    struct heredoc_delimiter{
+        std::string text;
+        bool strip_tabs;
+    };
+    std::vector<heredoc_delimiter> open_heredocs;
+    std::size_t closed_heredocs {0};
+    std::string heredoc_input;
+    std::string heredoc_text;
 
-    static void handle_interrupt(int signum, siginfo_t* info, void* context);
-    static void handle_sigint(Job_Control* job_context);
+    static bool is_useless_cat(const parse::line_ast& ast, const parse::pipeline_node& pipeline, std::string& wordbuf);
+    static std::uint32_t get_env_command_word(const parse::line_ast& ast, const parse::command_node& cmd);
+    bool add_redirect(const parse::line_ast& ast, const parse::redirect_node& redirect, job_arena& arena, std::string& wordbuf);
+    void add_procsub(std::string_view text, int fd, job_arena& arena);
+    bool add_command(const parse::line_ast& ast, const parse::command_node& cmd, job_arena& arena, std::string& wordbuf, const parse::redirect_node* input);
+    bool build_job_arena(const parse::line_ast& ast, const parse::pipeline_node& pipeline, job_arena& arena, std::string& wordbuf);
+    bool add_word(const parse::line_ast& ast, const parse::word_node& word, job_arena& arena);
+    static bool assign_variables(const parse::line_ast& ast, const parse::command_node& cmd, std::string& wordbuf);
+    bool begin_heredocs(std::string_view line);
+    bool add_heredoc_line(std::string_view line);
+
+    // The interactive loop, one coroutine per event source
+    loop_task read_commands(Line_Editor& editor, int signal_fd);
+    loop_task watch_children(Line_Editor& editor);
+    loop_task watch_signals(Line_Editor& editor, int signal_fd);
+
+public:
+    explicit Command_Execution(bool _interactive = true);
 
-    void read_input();
+    int execute_line(std::string_view line);
+    int run_script(int fd);
     void start_loop();
 };
 
@@ -0,0 +1,108 @@
+#ifndef COMMAND_HASH_HPP
+#define COMMAND_HASH_HPP
+
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <cstdint>
+
+#include <sys/stat.h>
+
+#include "execution/exec_index.hpp"
+
+
+// Cache of resolved executables, keyed by the command name typed by the user.
+// Lookups are done in the shell process so that every child receives an
+// absolute path and calls execve exactly once.
+//
+// Entries are dropped when $PATH changes, or when the mtime of a directory
+// in $PATH at or before the directory an entry was resolved from changes.
+// Directory mtimes are checked at most once per epoch; the REPL starts a new
+// epoch for every input line.
+//
+// Names not in the table are looked up in the on-disk Exec_Index next, which
+// is used while it was written for the same $PATH; an entry counts if no
+// directory up to its own has a different mtime than when it was validated.
+// When this session resolved a name the index did not have, or found one of
+// its entries stale, the index is rewritten at exit with the table and the
+// old entries that are still valid.
+
+class Command_Hash
+{
+
+public:
+    struct hash_entry{
+        std::string path;
+        std::size_t dir_index;
+        unsigned int hits;
+    };
+
+    // Transparent hashing lets lookups by string_view skip building a key
+    struct name_hash{
+        using is_transparent = void;
+        std::size_t operator()(std::string_view name) const noexcept {
+            return std::hash<std::string_view>{}(name);
+        }
+    };
+
+    using hash_table_type = std::unordered_map<std::string, hash_entry, name_hash, std::equal_to<>>;
+
+private:
+    struct path_dir{
+        std::string name;
+        struct timespec mtime;
+        bool exists;
+        std::uint64_t checked_epoch;
+    };
+
+    std::string path_value;
+    bool path_set {false};
+    std::vector<path_dir> path_dirs;
+    hash_table_type table;
+    std::uint64_t epoch {1};
+
+    std::string pathbuf;
+
+    Exec_Index index;
+    std::string index_file;
+    bool index_opened {false};
+    bool index_usable {false};
+    bool index_dirty {false};
+    int owner_pid {0};
+
+    Command_Hash() = default;
+    ~Command_Hash();
+
+    void refresh_path();
+    bool check_dir(std::size_t index);
+    bool validate(const hash_entry& entry);
+    hash_entry* resolve(std::string_view cmd);
+    void open_index();
+    bool index_entry_valid(const Exec_Index::index_entry& entry);
+    hash_entry* load_from_index(std::string_view cmd);
+
+public:
+    static Command_Hash& get_instance() noexcept {
+        static Command_Hash command_hash {};
+        return command_hash;
+    }
+
+    Command_Hash(const Command_Hash&) = delete;
+    Command_Hash& operator=(const Command_Hash&) = delete;
+
+    const char* lookup(const char* cmd);
+    bool seed(std::string_view cmd);
+    void clear() noexcept;
+    void new_epoch() noexcept;
+    void save_index();
+
+    const hash_table_type& get_table() const noexcept {
+        return table;
+    }
+};
+
+
+#endif // COMMAND_HASH_HPP
@@ -0,0 +1,126 @@
+#ifndef COMPLETION_HPP
+#define COMPLETION_HPP
+
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdint>
+#include <ctime>
+
+#include "execution/job_table.hpp"
+
+
+// What Tab does with the word under the cursor
+struct completion_result{
+    // The word spans [word_start, cursor) of the line and is replaced with
+    // replacement, which is escaped and ends with a blank once complete
+    std::size_t word_start {0};
+    std::string replacement;
+    // Sorted names to list when the word cannot be extended, at most
+    // max_candidates of match_count
+    std::vector<std::string> candidates;
+    std::size_t match_count {0};
+};
+
+
+// Tab completion of command names, file paths, $variables and %job ids.
+//
+// Command names come from a prefix trie of the executables in $PATH plus
+// the builtins. A worker thread owns the per directory name lists: refresh()
+// only asks it to stat the $PATH directories, it rescans the ones whose
+// mtime changed and publishes a new trie. A completion takes the current
+// trie without waiting, so it never scans a directory of $PATH and walks at
+// most one trie path plus the candidates it lists.
+
+class Completion
+{
+
+    struct trie_node{
+        std::uint32_t first_child;
+        std::uint32_t next_sibling;
+        std::uint32_t count;
+        char label;
+        bool terminal;
+    };
+
+    // Flat trie over sorted names; children are kept in byte order and
+    // count is the number of names below a node
+    class exec_trie
+    {
+        std::vector<trie_node> nodes;
+
+    public:
+        static constexpr std::uint32_t npos {UINT32_MAX};
+
+        explicit exec_trie(const std::vector<std::string_view>& sorted_names);
+
+        std::uint32_t find(std::string_view prefix) const noexcept;
+        std::size_t get_count(std::uint32_t node) const noexcept {
+            return nodes[node].count;
+        }
+        bool contains(std::string_view name) const noexcept;
+        // Appends the characters every name below node continues with
+        void append_common(std::uint32_t node, std::string& text) const;
+        void collect(std::uint32_t node, std::string& text, std::vector<std::string>& names, std::size_t limit) const;
+    };
+
+    struct path_dir{
+        std::string name;
+        struct timespec mtime;
+        bool exists;
+        std::vector<std::string> names;
+    };
+
+    // Shared with the worker under lock
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::string requested_path;
+    bool check_requested {false};
+    bool checking {false};
+    bool stopping {false};
+    std::shared_ptr<const exec_trie> trie;
+    std::thread worker;
+
+    // Worker only
+    std::string worker_path;
+    std::vector<path_dir> dirs;
+
+    void run_worker();
+    void check_dirs(const std::string& path);
+    static void scan_dir(path_dir& dir);
+    void publish();
+
+    void complete_command(std::string_view word, completion_result& result);
+    static void complete_file(std::string_view word, bool dirs_only, completion_result& result);
+    static void complete_variable(std::string_view word, completion_result& result);
+    static void complete_job(std::string_view word, const Job_Table& jobs, completion_result& result);
+
+    static void escape(std::string_view text, std::string& out);
+    static void finish(std::string_view text, bool complete, completion_result& result);
+
+public:
+    static constexpr std::size_t max_candidates {200};
+
+    Completion() = default;
+    ~Completion();
+
+    Completion(const Completion&) = delete;
+    Completion& operator=(const Completion&) = delete;
+
+    // Has the worker check $PATH, starting it the first time; does not wait
+    void refresh();
+
+    // Waits until the trie covers the last refresh()
+    void wait_for_index();
+
+    void complete(std::string_view line, std::size_t cursor, const Job_Table& jobs, completion_result& result);
+};
+
+
+#endif // COMPLETION_HPP
@@ -0,0 +1,135 @@
+#ifndef EVENT_LOOP_HPP
+#define EVENT_LOOP_HPP
+
+
+#include <map>
+#include <memory>
+#include <functional>
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <cstdint>
+
+#include <sys/epoll.h>
+
+
+// Coroutine run by an Event_Loop. It starts right away, runs until its first
+// co_await on the loop and is resumed by poll() from then on. The frame is
+// destroyed with the task, whether the coroutine finished or not.
+
+class loop_task
+{
+
+public:
+    struct promise_type{
+        loop_task get_return_object() noexcept {
+            return loop_task{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+    explicit loop_task(std::coroutine_handle<promise_type> _handle) noexcept :
+        handle{_handle}
+        {}
+
+public:
+    loop_task(loop_task&& other) noexcept :
+        handle{std::exchange(other.handle, {})}
+        {}
+
+    loop_task(const loop_task&) = delete;
+    loop_task& operator=(const loop_task&) = delete;
+    loop_task& operator=(loop_task&&) = delete;
+
+    ~loop_task(){
+        if(handle){
+            handle.destroy();
+        }
+    }
+
+    bool done() const noexcept {
+        return !handle || handle.done();
+    }
+};
+
+
+// Thin epoll wrapper. Each watched fd has a handler which is called with the
+// ready events; epoll hands the handler back directly, so dispatch does not
+// depend on the number of watched fds.
+//
+// Coroutines wait with co_await loop.ready(fd) instead, which arms the fd
+// once and resumes the coroutine from poll(). A fd is either watched or
+// awaited, and is not unwatched from inside a handler or coroutine.
+
+class Event_Loop
+{
+
+public:
+    using handler_type = std::function<void(std::uint32_t)>;
+
+private:
+    struct watch_entry{
+        handler_type handler;
+        std::coroutine_handle<> waiting;
+        std::uint32_t* ready_events {nullptr};
+    };
+
+    int epoll_fd {-1};
+    std::map<int, std::unique_ptr<watch_entry>> entries;
+
+    static constexpr int max_events = 16;
+
+    void open();
+
+    bool arm(int fd, std::uint32_t events, std::coroutine_handle<> handle, std::uint32_t* ready_events);
+
+public:
+    struct ready_awaiter{
+        Event_Loop& loop;
+        int fd;
+        std::uint32_t events;
+        std::uint32_t ready_events {0};
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+        // A fd epoll cannot wait for, like a regular file, is always ready
+        bool await_suspend(std::coroutine_handle<> handle){
+            if(loop.arm(fd, events, handle, &ready_events)){
+                return true;
+            }
+            ready_events = events;
+            return false;
+        }
+        std::uint32_t await_resume() const noexcept {
+            return ready_events;
+        }
+    };
+
+    Event_Loop() = default;
+    ~Event_Loop();
+
+    Event_Loop(const Event_Loop&) = delete;
+    Event_Loop& operator=(const Event_Loop&) = delete;
+
+    bool watch(int fd, std::uint32_t events, handler_type handler);
+    void unwatch(int fd);
+
+    // Resumes the awaiting coroutine with the ready events of fd
+    ready_awaiter ready(int fd, std::uint32_t events = EPOLLIN) noexcept {
+        return {*this, fd, events};
+    }
+
+    // Waits up to timeout_ms (-1 blocks) and runs the handlers of ready fds.
+    // Returns the number of handlers run, 0 on timeout or interruption.
+    int poll(int timeout_ms);
+};
+
+
+#endif // EVENT_LOOP_HPP
@@ -0,0 +1,130 @@
+#ifndef EXEC_INDEX_HPP
+#define EXEC_INDEX_HPP
+
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <span>
+#include <cstdint>
+#include <ctime>
+
+
+// On-disk index of resolved executables, shared by every nsh session of a
+// user so that a new shell starts with the lookups of the ones before it.
+//
+// The file ($NSH_EXEC_INDEX, or ~/.nsh_exec_index) is mapped read only and
+// never parsed: a 32 byte header, the $PATH directories it was written for
+// with their mtimes, the entries sorted by name, then the strings they
+// refer to. An entry is a command name, the index of the directory it was
+// found in and the mtime that directory had when the entry was validated;
+// its path is the directory name, '/' and the name.
+//
+// The file is only ever replaced as a whole, written to a temporary file
+// and renamed over the old one, so a mapping always sees one consistent
+// version.
+
+class Exec_Index
+{
+
+public:
+    struct index_dir{
+        std::uint32_t name_offset;
+        std::uint32_t name_length;
+        std::int64_t mtime_sec;
+        std::int64_t mtime_nsec;
+        std::uint32_t exists;
+        std::uint32_t reserved;
+    };
+
+    struct index_entry{
+        std::uint32_t name_offset;
+        std::uint32_t name_length;
+        std::uint32_t dir_index;
+        std::uint32_t reserved;
+        std::int64_t mtime_sec;
+        std::int64_t mtime_nsec;
+    };
+
+    // What a session writes: directories in $PATH order, entries sorted by name
+    struct dir_state{
+        std::string_view name;
+        timespec mtime;
+        bool exists;
+    };
+
+    struct entry_state{
+        std::string_view name;
+        std::uint32_t dir_index;
+        timespec mtime;
+    };
+
+private:
+    static constexpr char index_magic[8] {'N', 'S', 'H', 'X', 'I', 'D', 'X', '1'};
+
+    struct index_header{
+        char magic[8];
+        std::uint32_t dir_count;
+        std::uint32_t entry_count;
+        std::uint32_t path_offset;
+        std::uint32_t path_length;
+        std::uint32_t strings_size;
+        std::uint32_t reserved;
+    };
+
+    const char* map {nullptr};
+    std::size_t map_size {0};
+
+    std::span<const index_dir> dirs;
+    std::span<const index_entry> entries;
+    std::string_view strings;
+    std::string_view path_value;
+
+    std::string_view get_name(std::uint32_t offset, std::uint32_t length) const noexcept;
+
+public:
+    Exec_Index() = default;
+    ~Exec_Index();
+
+    Exec_Index(const Exec_Index&) = delete;
+    Exec_Index& operator=(const Exec_Index&) = delete;
+
+    // Maps the file; false if it is missing, of another version or damaged
+    bool open(const std::string& file);
+    void close() noexcept;
+
+    bool is_open() const noexcept {
+        return map != nullptr;
+    }
+
+    // The $PATH the index was written for
+    std::string_view get_path() const noexcept {
+        return path_value;
+    }
+
+    std::span<const index_dir> get_dirs() const noexcept {
+        return dirs;
+    }
+
+    std::span<const index_entry> get_entries() const noexcept {
+        return entries;
+    }
+
+    std::string_view get_name(const index_entry& entry) const noexcept {
+        return get_name(entry.name_offset, entry.name_length);
+    }
+
+    std::string_view get_name(const index_dir& dir) const noexcept {
+        return get_name(dir.name_offset, dir.name_length);
+    }
+
+    // Binary search by name, nullptr if the index has no entry for it
+    const index_entry* find(std::string_view name) const noexcept;
+
+    // Writes a new index next to file and renames it over file
+    static bool write(const std::string& file, std::string_view path, std::span<const dir_state> dir_states,
+                      std::span<const entry_state> entry_states);
+};
+
+
+#endif // EXEC_INDEX_HPP
@@ -0,0 +1,84 @@
+#ifndef HISTORY_HPP
+#define HISTORY_HPP
+
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+
+// Persistent command history shared by every nsh session of a user.
+//
+// The history file ($NSH_HISTFILE, or ~/.nsh_history) holds one entry per
+// line and is only ever appended to. A sidecar index file (the same name
+// with .idx) holds an 8 byte magic followed by one 8 byte record per entry:
+// the entry's offset in the low 40 bits and its first three bytes in the
+// high 24 bits, so prefix search can skip entries without touching them.
+//
+// Sessions append under an exclusive flock, entry and index record
+// together. Both files are mapped read only and remapped when another
+// session made them grow; nothing is parsed at startup besides checking
+// that the index covers the file, which only reads its tail.
+
+class History
+{
+
+    static constexpr char index_magic[8] {'N', 'S', 'H', 'H', 'I', 'D', 'X', '1'};
+    static constexpr int prefix_shift {40};
+    static constexpr std::uint64_t offset_mask {(std::uint64_t{1} << prefix_shift) - 1};
+
+    std::string data_path;
+    std::string index_path;
+    int data_fd {-1};
+    int index_fd {-1};
+    bool opened {false};
+
+    const char* data_map {nullptr};
+    std::size_t data_size {0};
+    const char* index_map {nullptr};
+    std::size_t index_size {0};
+
+    std::string entry_buffer;
+    std::vector<std::uint64_t> new_records;
+
+    History() = default;
+    ~History();
+
+    bool open_files();
+    bool remap();
+    void index_tail();
+    static std::uint64_t make_record(std::uint64_t offset, std::string_view entry) noexcept;
+    static bool prefix_matches(std::uint64_t record, std::string_view prefix) noexcept;
+    std::uint64_t get_record(std::size_t index) const noexcept;
+
+public:
+    static constexpr std::size_t npos {static_cast<std::size_t>(-1)};
+
+    static History& get_instance() noexcept {
+        static History history {};
+        return history;
+    }
+
+    History(const History&) = delete;
+    History& operator=(const History&) = delete;
+
+    // Appends line unless it is blank. Returns false if there is no history file.
+    bool add(std::string_view line);
+
+    // Entries of every session so far, this picks up their new entries
+    std::size_t size();
+
+    // Valid until the next call that may remap, i.e. add() and size()
+    std::string_view get_entry(std::size_t index) const noexcept;
+
+    // Newest entry before index before that contains text, or that starts
+    // with prefix; npos if there is none. Passing the last match as before
+    // goes on with the search from there.
+    std::size_t search_reverse(std::string_view text, std::size_t before) const noexcept;
+    std::size_t search_prefix(std::string_view prefix, std::size_t before) const noexcept;
+};
+
+
+#endif // HISTORY_HPP
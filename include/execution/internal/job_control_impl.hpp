@@ -3,6 +3,7 @@
 
 
 #include <string>
+#include <vector>
 #include <cstdint>
 #include <cstdlib>
 
@@ -13,12 +14,24 @@ enum class job_status : std::uint8_t{
 };
 
 
+// One process of a job, wait_status is the last one wait reported
+struct job_process{
+    int pid;
+    job_status status;
+    int wait_status;
+};
+
 
 struct background_execution_unit{
     std::size_t job_id;
     std::string job_cmd;
     job_status status;
     int pgid;
+    std::vector<job_process> procs;
+    std::size_t exited_procs;
+    std::size_t stopped_procs;
+    // The job's cgroup leaf, empty if it has none
+    std::string cgroup;
 };
 
 
@@ -0,0 +1,91 @@
+#ifndef JOB_CGROUPS_HPP
+#define JOB_CGROUPS_HPP
+
+
+#include <string>
+#include <string_view>
+#include <cstdint>
+
+
+// Resource usage of a job's cgroup, -1 where the file is missing because
+// its controller is not enabled for the leaf
+struct cgroup_usage{
+    std::int64_t cpu_usec {-1};
+    std::int64_t memory_current {-1};
+    std::int64_t memory_peak {-1};
+    std::int64_t io_read_bytes {-1};
+    std::int64_t io_write_bytes {-1};
+};
+
+
+// A cgroup v2 leaf per job. Off by default, NSH_JOB_CGROUPS=on in the
+// environment or "cgroups on" turns it on.
+//
+// The shell makes nsh.<pid> under its own cgroup, with the cpu, memory and
+// io controllers enabled for its children where the parent allows it, and
+// a leaf job.<n> in it for every job. Each process of the job is forked,
+// whatever the launcher mode, and moves itself into the leaf before exec,
+// so everything it runs and starts is counted and killed with the job.
+// Where the v2 hierarchy is not mounted or the shell's cgroup was not
+// delegated to the user, the shell says so once and jobs run where they
+// always did.
+//
+// jobs -l reads a leaf's accounting files, and kill -9 %n writes its
+// cgroup.kill, which kills every process in it at once, those that left
+// the job's process group included.
+
+class Job_Cgroups
+{
+
+    bool enabled {false};
+    bool created {false};
+    std::string base;
+    std::uint64_t next_leaf {1};
+    int owner_pid {0};
+
+    Job_Cgroups();
+    ~Job_Cgroups();
+
+    bool create_base();
+    void remove_base();
+
+public:
+    static Job_Cgroups& get_instance() noexcept {
+        static Job_Cgroups cgroups {};
+        return cgroups;
+    }
+
+    Job_Cgroups(const Job_Cgroups&) = delete;
+    Job_Cgroups& operator=(const Job_Cgroups&) = delete;
+
+    bool is_enabled() const noexcept {
+        return enabled;
+    }
+
+    // False, with the reason printed, if the shell cannot make cgroups
+    bool enable();
+    void disable() noexcept {
+        enabled = false;
+    }
+
+    // nsh.<pid>, empty while no job was placed
+    const std::string& get_base() const noexcept {
+        return base;
+    }
+
+    // Makes the leaf of a new job and returns its cgroup.procs opened for
+    // writing, or -1 when jobs are not placed. leaf is set to its path.
+    int create_leaf(std::string& leaf);
+
+    // Removes the leaf once no process is left in it
+    static void remove_leaf(const std::string& leaf) noexcept;
+
+    // Moves the calling process into the leaf whose cgroup.procs is procs_fd
+    static bool move_process(int procs_fd) noexcept;
+
+    static bool kill_leaf(const std::string& leaf);
+    static void read_usage(const std::string& leaf, cgroup_usage& usage);
+};
+
+
+#endif // JOB_CGROUPS_HPP
@@ -3,64 +3,156 @@
 
 
 #include <string>
-#include <map>
-#include <list>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <span>
+#include <thread>
+#include <chrono>
 #include <csignal>
 
 #include <unistd.h>
 #include <sys/wait.h>
 
 #include "command_struct.hpp"
-#include "internal/job_control_impl.hpp"
+#include "job_table.hpp"
+#include "process_launcher.hpp"
+#include "time_report.hpp"
 
 
 class Job_Control
 {
 
-    bool tokenize_path_var(std::list<std::string>& path_dirs);
     void set_foreground_pgid(int pgid);
 
-    bool get_cmdline_opt_args(std::vector<std::string> cmdargs, std::string& filename, std::vector<char*>& argsptrs) noexcept;
-    bool get_cmdline_env_args(std::map<std::string, std::string> envmap, std::vector<std::string>&  envargs, std::vector<char*>& envptrs);
-
-    std::map<std::size_t, background_execution_unit> bgjob_table;
-    std::size_t jobunit_id;
-
-    using job_type = std::list<command_info>;
-
-    std::list<job_type> fg_joblist;
-    std::list<job_type> bg_joblist;
+    int launch_process(const job_arena& arena, const command_info& curr_proc, launch_request& request);
+    bool open_pipes(std::size_t no_of_pipes, std::size_t pipe_size);
+    void close_pipes(std::size_t no_of_pipes);
+    static void close_fd(int& fd) noexcept;
+    bool open_redirections(const job_arena& arena, const job_info& job);
+    bool open_command_redirections(const job_arena& arena, const command_info& cmd, std::span<const procsub_info> procsubs);
+    void launch_procsubs(const job_arena& arena, const job_info& job, int& pgid, std::size_t& launched_procs);
+    void discard_procsubs(int pgid);
+    void close_redirections();
+    static int open_heredoc(std::string_view text);
+    std::span<const fd_action> get_redirect_actions(const command_info& cmd) const noexcept {
+        return {redirect_actions.data() + cmd.redirect_index, cmd.redirect_count};
+    }
+
+    Job_Table bgjob_table;
 
     static constexpr int readindex = 0;
     static constexpr int writeindex = 1;
     int shell_pid;
     int shell_pgid;
 
+    bool interactive;
+    int last_status {0};
+
     bool single_proc_flag {false};
 
-    std::list<std::string> path_dirs;
+    std::vector<std::array<int, 2>> pipevec;
+    // envp of the process being launched when it has its own assignments
+    std::vector<char*> merged_envp;
+    std::vector<int> launched_pids;
+    // pid and wait status of each stage of the foreground job
+    std::vector<std::array<int, 2>> waited_status;
+    std::vector<std::size_t> builtin_stages;
+
+    // Redirected files of the running job, one action per arena redirection
+    std::vector<fd_action> redirect_actions;
+    std::vector<int> redirect_files;
+    std::vector<std::array<int, 2>> procsub_pipes;
+    std::vector<std::array<int, 2>> saved_fds;
+
+    // Splice relay between the last stage and its output file
+    std::thread relay_thread;
+    std::vector<fd_action> relay_actions;
+    std::array<int, 2> relay_fds {-1, -1};
+    int relay_out {-1};
+    bool setup_relay(const job_arena& arena, const job_info& job);
+    void start_relay();
+    void finish_relay(bool stopped);
+
+    // cgroup leaf of the job being launched, made for its first process
+    std::string job_cgroup;
+    int job_cgroup_fd {-1};
+    std::string finish_job_cgroup();
+
+    // Child state changes arrive as SIGCHLD on this signalfd
+    int child_event_fd {-1};
+    void open_child_events();
+    std::vector<std::size_t> finished_jobs;
+
+    // Done and Stopped lines of background jobs, printed by the REPL
+    std::string job_reports;
+    void report_job(const background_execution_unit& unit);
 
     void handle(int, siginfo_t*, void*);
 
-    void execute_bg_job(job_type);
+    // Per stage usage of the job run by the time keyword
+    bool collect_usage {false};
+    std::vector<stage_time> stage_times;
+    void run_timed_job(const job_arena& arena, const job_info& job, time_format timing);
 
+    // time covers its pipeline and every foreground pipeline after it on the line
+    time_format line_timing {time_format::none};
+    std::size_t timed_jobs {0};
+    std::chrono::steady_clock::time_point chain_start;
 
-public:
-    void submit_foreground_jobs(const std::list<job_type>& _fg_jobs);
-    void run_foreground_jobs();
+    static int get_exit_status(int status) noexcept;
+    static void append_command_desc(const job_arena& arena, const command_info& cmd, std::string& desc);
+    static bool runs_in_shell(const job_arena& arena, const command_info& cmd);
+    static bool runs_forked(std::string_view name) noexcept;
+    int run_builtin(const job_arena& arena, const command_info& curr_proc, const launch_request& request);
+    int fork_builtin(const job_arena& arena, const command_info& curr_proc, const launch_request& request);
+    void run_foreground_job(const job_arena& arena, const job_info& job);
+    void execute_bg_job(const job_arena& arena, const job_info& job);
 
-    void submit_background_jobs(std::list<job_type> bg_jobs);
-    void run_background_jobs();
 
-    std::string get_jobunit_desc(const job_type& job);
-    void connect_processes(int no_of_pipes, const std::vector<std::vector<int>>& pipefds, const int& proc_index, const int& total_proc);
+public:
+    // Runs the jobs of one arena, finish_line() ends the input line
+    void run_jobs(const job_arena& arena);
+    void finish_line();
+
+    int get_last_status() const noexcept {
+        return last_status;
+    }
+
+    void set_last_status(int status) noexcept {
+        last_status = status;
+    }
+
+    std::string get_jobunit_desc(const job_arena& arena, const job_info& job);
+    void connect_processes(std::size_t no_of_pipes, const std::vector<std::array<int, 2>>& pipefds, std::size_t proc_index, launch_request& request);
+
+    int get_child_event_fd(){
+        open_child_events();
+        return child_event_fd;
+    }
+    void process_child_events();
+
+    const Job_Table& get_jobs() const noexcept {
+        return bgjob_table;
+    }
+
+    const std::string& get_job_reports() const noexcept {
+        return job_reports;
+    }
+    void clear_job_reports() noexcept {
+        job_reports.clear();
+    }
 
     void wait_for_background_jobs();
     bool kill_foreground_job();
     bool stop_foreground_job();
 
 public:
-    Job_Control();
+    explicit Job_Control(bool _interactive = true);
+    ~Job_Control();
+
+    Job_Control(const Job_Control&) = delete;
+    Job_Control& operator=(const Job_Control&) = delete;
 };
 
 #endif // JOB_CONTROL_H
@@ -0,0 +1,82 @@
+#ifndef JOB_TABLE_HPP
+#define JOB_TABLE_HPP
+
+
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "execution/internal/job_control_impl.hpp"
+
+
+// The background jobs of the shell with the state of every process in them.
+//
+// Job id n lives in slot n - 1, and pgids and pids are hashed to their job,
+// so a lookup by any of the three costs the same with ten or ten thousand
+// jobs. A new job gets the id after the highest one in use, like other
+// shells do: an id is only handed out again once every job above it is gone,
+// never while its job is still in the table.
+
+class Job_Table
+{
+
+    struct process_ref{
+        std::size_t job_id;
+        std::size_t index;
+    };
+
+    // Trailing empty slots are dropped, so the last slot is the newest job
+    std::vector<std::optional<background_execution_unit>> slots;
+    std::size_t job_count {0};
+
+    std::unordered_map<int, std::size_t> pgid_index;
+    // Only processes which have not exited, a pid may be reused after that
+    std::unordered_map<int, process_ref> pid_index;
+
+public:
+    Job_Table() = default;
+
+    Job_Table(const Job_Table&) = delete;
+    Job_Table& operator=(const Job_Table&) = delete;
+
+    background_execution_unit& add(std::string job_cmd, int pgid, std::span<const int> pids);
+
+    background_execution_unit* find(std::size_t job_id) noexcept;
+    background_execution_unit* find_pgid(int pgid) noexcept;
+    background_execution_unit* find_pid(int pid) noexcept;
+    const background_execution_unit* find(std::size_t job_id) const noexcept;
+
+    // The job fg and bg act on without a job id, the newest one
+    background_execution_unit* current() noexcept;
+
+    // Records a status from wait for pid and updates the state of its job,
+    // nullptr if the pid belongs to no job
+    background_execution_unit* update(int pid, int wait_status);
+
+    // Marks the stopped processes of a job running once it was sent SIGCONT
+    void set_running(background_execution_unit& unit) noexcept;
+
+    bool erase(std::size_t job_id);
+
+    std::size_t size() const noexcept {
+        return job_count;
+    }
+    bool empty() const noexcept {
+        return job_count == 0;
+    }
+
+    // Visits the jobs in id order
+    template<typename Fn>
+    void for_each(Fn&& fn) const{
+        for(const std::optional<background_execution_unit>& slot : slots){
+            if(slot){
+                fn(*slot);
+            }
+        }
+    }
+};
+
+
+#endif // JOB_TABLE_HPP
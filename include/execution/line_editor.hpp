@@ -0,0 +1,143 @@
+#ifndef LINE_EDITOR_HPP
+#define LINE_EDITOR_HPP
+
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <functional>
+#include <utility>
+#include <cstddef>
+
+#include <termios.h>
+
+#include "execution/completion.hpp"
+
+
+// Line editor for the interactive shell. The terminal is in raw mode while a
+// line is edited and back in the mode the shell started with while commands
+// run. The editor never reads on its own: the REPL hands it input once the
+// terminal is readable, so it can be driven by the event loop together with
+// child and signal events.
+//
+// Keys: printable text, Enter, Backspace, Delete, Left/Right, Home/End,
+// Ctrl-A/E/B/F/K/U/W/L, Alt-B/F and Ctrl-Left/Right by word, Ctrl-D (end of
+// input on an empty line), Ctrl-C (drop the line), Up/Down or Ctrl-P/N for
+// the history entries that start with the text typed so far, Ctrl-R to
+// search the history for the text typed next (again for an older match,
+// Ctrl-G gives up, any other key takes the match) and Tab, which completes
+// the word and lists the choices when pressed twice.
+//
+// Lines may wrap; the editor keeps track of the row the cursor is on, so
+// output printed through print_above() never mixes with the edited line.
+
+class Line_Editor
+{
+
+public:
+    using complete_type = std::function<void(std::string_view line, std::size_t cursor, completion_result& result)>;
+
+private:
+    int in_fd;
+    int out_fd;
+    termios saved_mode {};
+    bool has_terminal {false};
+    bool raw {false};
+    bool editing {false};
+
+    std::string prompt;
+    std::size_t prompt_columns {0};
+    std::string buffer;
+    std::size_t cursor {0};
+    std::size_t width {80};
+    std::size_t cursor_row {0};
+
+    // Read but not handled yet, a pasted text may hold several lines
+    std::string pending;
+    bool input_closed {false};
+
+    // History browsing: the typed text, its prefix and the entries shown
+    std::string saved_line;
+    std::vector<std::size_t> history_trail;
+
+    // Ctrl-R search: the text looked for and the match for each length of
+    // it, npos once there is none, so Backspace needs no search
+    bool searching {false};
+    std::string search_text;
+    std::vector<std::pair<std::size_t, std::size_t>> search_trail;
+    std::string line_prompt;
+
+    complete_type complete;
+    completion_result completion;
+    std::size_t tab_presses {0};
+
+    std::string output;
+
+    static std::size_t count_columns(std::string_view text) noexcept;
+    std::size_t previous_char(std::size_t pos) const noexcept;
+    std::size_t next_char(std::size_t pos) const noexcept;
+    std::size_t previous_word(std::size_t pos) const noexcept;
+    std::size_t next_word(std::size_t pos) const noexcept;
+
+    void write_output();
+    void refresh();
+    void insert(std::string_view text);
+    void erase(std::size_t from, std::size_t to);
+    void move_to(std::size_t pos);
+    void history_previous();
+    void history_next();
+    void end_history();
+    void show_search();
+    void search_history(bool older);
+    void end_search(bool accept);
+    std::size_t handle_search(std::size_t pos);
+    std::size_t handle_escape(std::size_t pos);
+    void complete_word();
+    void list_candidates();
+
+public:
+    enum class read_status{
+        editing,
+        line,
+        interrupted,
+        eof
+    };
+
+    Line_Editor(int _in_fd, int _out_fd);
+    ~Line_Editor();
+
+    Line_Editor(const Line_Editor&) = delete;
+    Line_Editor& operator=(const Line_Editor&) = delete;
+
+    void set_completion(complete_type _complete){
+        complete = std::move(_complete);
+    }
+
+    // Shows the prompt and starts an empty line in raw mode
+    void start_line(std::string_view _prompt);
+
+    // Handles input already read, then reads what the terminal has.
+    // Call read_input() once the terminal is readable.
+    read_status process_pending();
+    read_status read_input();
+
+    // The finished line, valid until the next start_line()
+    const std::string& get_line() const noexcept {
+        return buffer;
+    }
+
+    // Drops the line being edited like Ctrl-C does
+    void cancel_line();
+
+    // Picks up a new terminal width
+    void resize();
+
+    // Prints text, which ends with a newline, above the edited line
+    void print_above(std::string_view text);
+
+    // Puts the terminal back in the mode commands run in
+    void restore_mode();
+};
+
+
+#endif // LINE_EDITOR_HPP
@@ -0,0 +1,70 @@
+#ifndef PARALLEL_RUNNER_HPP
+#define PARALLEL_RUNNER_HPP
+
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <span>
+
+#include <poll.h>
+
+
+// Runs one command per input item with at most a given number of children,
+// the engine behind the parallel builtin.
+//
+// The command is resolved through Command_Hash and the environment snapshot
+// is taken once, then every item is started with the Process_Launcher in the
+// process group of the caller. That is the job's: the parallel builtin runs
+// in a child of the shell, so Ctrl-C and Ctrl-Z reach every item and a
+// stopped run is resumed by fg. Each {} in the arguments is replaced with
+// the item, without a {} the item is the last argument.
+//
+// Output keeps the item order and is never interleaved: the oldest running
+// item writes straight through, the ones after it are held in memory until
+// every item before them is done. Items are read from stdin one line at a
+// time while children run, so a slow producer does not hold up the workers.
+
+class Parallel_Runner
+{
+
+    struct item_run{
+        int pid {-1};
+        int pidfd {-1};
+        int out_fd {-1};
+        int err_fd {-1};
+        std::string output;
+        std::string errors;
+        bool exited {false};
+        int status {0};
+    };
+
+    std::deque<item_run> window;
+    std::size_t running {0};
+
+    bool from_stdin {false};
+    std::string input;
+    std::size_t input_pos {0};
+    bool input_done {false};
+    std::string item;
+
+    std::vector<std::string> arguments;
+    std::vector<char*> argv;
+    std::vector<pollfd> pollfds;
+    bool output_closed {false};
+
+    bool next_item(std::span<char* const> items, std::size_t& item_index);
+    bool start(const char* binary_file, std::span<char* const> command, char* const* envp, int null_fd);
+    void read_pipe(item_run& run, int& fd, bool errors);
+    void write_out(int fd, std::string_view text);
+    static bool is_finished(const item_run& run) noexcept;
+
+public:
+    // Returns 0 if every item succeeded, otherwise the number of failed
+    // items up to 101, or 130 if an item was interrupted
+    int run(std::size_t jobs, std::span<char* const> command, std::span<char* const> items, bool items_from_stdin);
+};
+
+
+#endif // PARALLEL_RUNNER_HPP
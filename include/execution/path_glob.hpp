@@ -0,0 +1,75 @@
+#ifndef PATH_GLOB_HPP
+#define PATH_GLOB_HPP
+
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+
+// Pathname expansion of *, ? and [...] patterns, plus ** for any number of
+// directories. Patterns use backslash escapes for characters that were
+// quoted in the word.
+//
+// Directories are read with getdents64 and their listings are cached until
+// clear_cache(); the shell clears it before expanding each pipeline, so a
+// pipeline with several patterns over one directory reads it once while
+// the next pipeline sees the files the previous one created.
+//
+// ** walks the tree once to cache every listing. The first directories are
+// read in the shell thread, the rest of a large tree by a pool of threads.
+// Matches are sorted by byte value, hidden names only match a pattern that
+// starts with a dot and ** does not descend into hidden directories or
+// follow symbolic links.
+
+class Path_Glob
+{
+
+    struct dir_entry{
+        std::string name;
+        unsigned char type;
+    };
+
+    struct dir_listing{
+        std::vector<dir_entry> entries;
+        bool readable;
+    };
+
+    std::unordered_map<std::string, dir_listing> cache;
+    std::vector<std::string> paths;
+    std::vector<std::string> next_paths;
+    std::vector<std::string> tree_dirs;
+
+    static void read_dir(const std::string& path, dir_listing& listing);
+    static std::string join(std::string_view dir, std::string_view name);
+
+    const dir_listing& get_listing(const std::string& path);
+    bool is_dir(const std::string& path, const dir_entry& entry) const;
+    void walk_tree(const std::string& root, std::vector<std::string>& dirs);
+    void walk_parallel(std::vector<std::string>& pending, std::vector<std::string>& dirs);
+
+    std::vector<std::string_view> components;
+    std::string component;
+
+public:
+    // True if pattern has an unescaped *, ? or [ that has a closing ]
+    static bool is_pattern(std::string_view pattern) noexcept;
+
+    // Directories walked by the shell thread before ** uses threads
+    static constexpr std::size_t serial_walk_limit {64};
+
+    // Removes the backslash escapes of a pattern that matched nothing
+    static void remove_escapes(std::string& pattern);
+
+    // Appends the sorted matches of pattern, returns how many there were
+    std::size_t expand(std::string_view pattern, std::vector<std::string>& matches);
+
+    void clear_cache() noexcept {
+        cache.clear();
+    }
+};
+
+
+#endif // PATH_GLOB_HPP
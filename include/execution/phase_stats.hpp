@@ -0,0 +1,125 @@
+#ifndef PHASE_STATS_HPP
+#define PHASE_STATS_HPP
+
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+
+enum class shell_phase : std::uint8_t{
+    parse,
+    expand,
+    launch,
+    wait,
+    reap,
+    count
+};
+
+
+// Time spent in each phase of running a line, summed over all lines. Off by
+// default, a disabled phase_timer does not read the clock. The replay
+// benchmark turns it on to report where the time of a session went.
+//
+// launch covers fork() in fork mode, and posix_spawn up to the child's exec
+// in spawn mode. In fork mode the child's exec is part of the wait.
+
+class Phase_Stats
+{
+
+    static constexpr std::size_t phase_count {static_cast<std::size_t>(shell_phase::count)};
+
+    bool enabled {false};
+    std::array<std::uint64_t, phase_count> total_ns {};
+    std::array<std::uint64_t, phase_count> samples {};
+    std::uint64_t commands {0};
+
+    Phase_Stats() = default;
+
+public:
+    static Phase_Stats& get_instance() noexcept {
+        static Phase_Stats stats {};
+        return stats;
+    }
+
+    Phase_Stats(const Phase_Stats&) = delete;
+    Phase_Stats& operator=(const Phase_Stats&) = delete;
+
+    bool is_enabled() const noexcept {
+        return enabled;
+    }
+
+    void set_enabled(bool _enabled) noexcept {
+        enabled = _enabled;
+    }
+
+    void reset() noexcept {
+        total_ns.fill(0);
+        samples.fill(0);
+        commands = 0;
+    }
+
+    void add(shell_phase phase, std::uint64_t ns) noexcept {
+        total_ns[static_cast<std::size_t>(phase)] += ns;
+        samples[static_cast<std::size_t>(phase)]++;
+    }
+
+    // Every builtin or external command the shell tried to run
+    void count_command() noexcept {
+        if(enabled){
+            commands++;
+        }
+    }
+
+    std::uint64_t get_total_ns(shell_phase phase) const noexcept {
+        return total_ns[static_cast<std::size_t>(phase)];
+    }
+
+    std::uint64_t get_samples(shell_phase phase) const noexcept {
+        return samples[static_cast<std::size_t>(phase)];
+    }
+
+    std::uint64_t get_commands() const noexcept {
+        return commands;
+    }
+
+    static const char* get_phase_name(shell_phase phase) noexcept {
+        constexpr const char* names[phase_count] {"parse", "expand", "launch", "wait", "reap"};
+        return names[static_cast<std::size_t>(phase)];
+    }
+};
+
+
+// Adds the time until the end of the enclosing scope to a phase
+class phase_timer
+{
+
+    using clock = std::chrono::steady_clock;
+
+    shell_phase phase;
+    bool active;
+    clock::time_point start;
+
+public:
+    explicit phase_timer(shell_phase _phase) noexcept :
+        phase{_phase},
+        active{Phase_Stats::get_instance().is_enabled()}
+        {
+            if(active){
+                start = clock::now();
+            }
+        }
+
+    ~phase_timer(){
+        if(active){
+            auto elapsed {std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start)};
+            Phase_Stats::get_instance().add(phase, static_cast<std::uint64_t>(elapsed.count()));
+        }
+    }
+
+    phase_timer(const phase_timer&) = delete;
+    phase_timer& operator=(const phase_timer&) = delete;
+};
+
+
+#endif // PHASE_STATS_HPP
@@ -0,0 +1,66 @@
+#ifndef PIPE_CONFIG_HPP
+#define PIPE_CONFIG_HPP
+
+
+#include <string_view>
+#include <cstddef>
+
+
+// Pipe sizing and the splice relay for pipelines.
+//
+// The session pipe size comes from NSH_PIPE_SIZE at startup or the pipesize
+// builtin, a NSH_PIPE_SIZE=<size> assignment in front of a pipeline
+// overrides it for that pipeline only. Sizes are capped at
+// /proc/sys/fs/pipe-max-size, 0 keeps the kernel default of 64 KiB.
+//
+// With the relay on, a foreground pipeline whose last stage writes to a
+// regular file writes into a pipe instead, and a shell thread splices the
+// pipe into the file.
+
+class Pipe_Config
+{
+
+    std::size_t session_size {0};
+    std::size_t max_size {0};
+    bool relay {false};
+
+    Pipe_Config();
+
+public:
+    static Pipe_Config& get_instance() noexcept {
+        static Pipe_Config config {};
+        return config;
+    }
+
+    Pipe_Config(const Pipe_Config&) = delete;
+    Pipe_Config& operator=(const Pipe_Config&) = delete;
+
+    // Bytes, with an optional k or m suffix
+    static bool parse_size(std::string_view text, std::size_t& size) noexcept;
+
+    std::size_t get_max_size();
+    std::size_t get_session_size() const noexcept {
+        return session_size;
+    }
+
+    void set_session_size(std::size_t size) noexcept {
+        session_size = size;
+    }
+
+    bool get_relay() const noexcept {
+        return relay;
+    }
+
+    void set_relay(bool _relay) noexcept {
+        relay = _relay;
+    }
+
+    // Resizes the pipe to size, or the session size when size is 0
+    void apply(int pipe_fd, std::size_t size);
+
+    // Copies in_fd to out_fd until end of file, with splice when possible
+    static void relay_pipe(int in_fd, int out_fd);
+};
+
+
+#endif // PIPE_CONFIG_HPP
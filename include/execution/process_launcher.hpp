@@ -0,0 +1,81 @@
+#ifndef PROCESS_LAUNCHER_HPP
+#define PROCESS_LAUNCHER_HPP
+
+
+#include <string_view>
+#include <span>
+#include <cstdint>
+
+
+enum class launcher_mode : std::uint8_t{
+    fork,
+    spawn
+};
+
+
+// dup2(source_fd, target_fd) in the child
+struct fd_action{
+    int source_fd;
+    int target_fd;
+};
+
+
+// Everything a pipeline stage needs from the shell to start, prepared in the
+// shell process before launching. Pipe fds and redirected files are opened
+// with O_CLOEXEC, so the only file actions a stage needs are dup2 calls: the
+// pipe ends first, then the command's redirections in order.
+struct launch_request{
+    const char* binary_file {nullptr};
+    char* const* argv {nullptr};
+    char* const* envp {nullptr};
+
+    int pgid {0};
+    int input_fd {-1};
+    int output_fd {-1};
+    std::span<const fd_action> actions {};
+
+    // cgroup.procs of the job's cgroup, -1 to stay in the shell's. A stage
+    // with a cgroup is always forked.
+    int cgroup_fd {-1};
+};
+
+
+// Starts pipeline stages either with fork + execve, or with posix_spawn. The
+// glibc posix_spawn clones with CLONE_VM | CLONE_VFORK, so the shell's page
+// tables are never copied.
+
+class Process_Launcher
+{
+
+    launcher_mode mode;
+
+    int fork_process(const launch_request& request);
+    int spawn_process(const launch_request& request);
+
+    Process_Launcher();
+
+public:
+    static Process_Launcher& get_instance() noexcept {
+        static Process_Launcher launcher {};
+        return launcher;
+    }
+
+    Process_Launcher(const Process_Launcher&) = delete;
+    Process_Launcher& operator=(const Process_Launcher&) = delete;
+
+    int launch(const launch_request& request);
+
+    launcher_mode get_mode() const noexcept {
+        return mode;
+    }
+
+    void set_mode(launcher_mode _mode) noexcept {
+        mode = _mode;
+    }
+
+    static bool parse_mode(std::string_view name, launcher_mode& _mode) noexcept;
+    static const char* get_mode_name(launcher_mode _mode) noexcept;
+};
+
+
+#endif // PROCESS_LAUNCHER_HPP
@@ -0,0 +1,137 @@
+#ifndef STARTUP_TRACE_HPP
+#define STARTUP_TRACE_HPP
+
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+
+
+// Time spent setting the shell up, for nsh --startup-trace. Subsystems set
+// themselves up on first use, so a step is recorded when it happens, with
+// its duration and the time it finished at since main() was entered. The
+// records are printed to stderr at the next mark and at exit, so writing
+// them does not count towards the steps. Off by default, a disabled
+// startup_step does not read the clock.
+
+class Startup_Trace
+{
+
+    using clock = std::chrono::steady_clock;
+
+    struct record{
+        const char* name;
+        double duration_us;
+        double at_us;
+    };
+
+    static constexpr std::size_t max_records = 32;
+
+    bool enabled {false};
+    clock::time_point origin;
+    std::array<record, max_records> records {};
+    std::size_t record_count {0};
+
+    Startup_Trace() = default;
+
+    static double to_us(clock::duration duration) noexcept {
+        return std::chrono::duration<double, std::micro>(duration).count();
+    }
+
+    void add(const char* name, double duration_us, double at_us) noexcept {
+        if(record_count == max_records){
+            flush();
+        }
+        records[record_count++] = {name, duration_us, at_us};
+    }
+
+public:
+    static Startup_Trace& get_instance() noexcept {
+        static Startup_Trace trace {};
+        return trace;
+    }
+
+    Startup_Trace(const Startup_Trace&) = delete;
+    Startup_Trace& operator=(const Startup_Trace&) = delete;
+
+    ~Startup_Trace(){
+        flush();
+    }
+
+    bool is_enabled() const noexcept {
+        return enabled;
+    }
+
+    // The CPU time of the process so far is what exec and the dynamic
+    // loader took before main()
+    void enable() noexcept {
+        enabled = true;
+        timespec cpu {};
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+        double before_main_us {static_cast<double>(cpu.tv_sec) * 1e6 + static_cast<double>(cpu.tv_nsec) / 1e3};
+        std::fprintf(stderr, "nsh: startup: %-16s %9.1f us cpu\n", "before main", before_main_us);
+        origin = clock::now();
+    }
+
+    void report(const char* step, clock::time_point start) noexcept {
+        clock::time_point end {clock::now()};
+        add(step, to_us(end - start), to_us(end - origin));
+    }
+
+    // A point the shell reached, like the first prompt. Marks have no
+    // duration and print what was recorded up to them.
+    void mark(const char* event) noexcept {
+        if(enabled){
+            add(event, -1, to_us(clock::now() - origin));
+            flush();
+        }
+    }
+
+    void flush() noexcept {
+        for(std::size_t i{0}; i < record_count; ++i){
+            const record& rec {records[i]};
+            if(rec.duration_us < 0){
+                std::fprintf(stderr, "nsh: startup: %-16s %12s at %9.1f us\n", rec.name, "", rec.at_us);
+            }
+            else{
+                std::fprintf(stderr, "nsh: startup: %-16s %9.1f us at %9.1f us\n", rec.name, rec.duration_us, rec.at_us);
+            }
+        }
+        record_count = 0;
+    }
+};
+
+
+// Reports the time until the end of the enclosing scope as a startup step
+class startup_step
+{
+
+    using clock = std::chrono::steady_clock;
+
+    const char* step;
+    bool active;
+    clock::time_point start;
+
+public:
+    explicit startup_step(const char* _step) noexcept :
+        step{_step},
+        active{Startup_Trace::get_instance().is_enabled()}
+        {
+            if(active){
+                start = clock::now();
+            }
+        }
+
+    ~startup_step(){
+        if(active){
+            Startup_Trace::get_instance().report(step, start);
+        }
+    }
+
+    startup_step(const startup_step&) = delete;
+    startup_step& operator=(const startup_step&) = delete;
+};
+
+
+#endif // STARTUP_TRACE_HPP
@@ -0,0 +1,46 @@
+#ifndef TIME_REPORT_HPP
+#define TIME_REPORT_HPP
+
+
+#include <string>
+#include <string_view>
+#include <span>
+#include <cstdio>
+
+#include <sys/resource.h>
+
+#include "command_struct.hpp"
+
+
+// Resource usage of one pipeline stage. External stages get theirs from
+// wait4, builtins from the shell thread's usage while they ran. A builtin
+// has no maxrss of its own, the shell's peak is not reported for it: "-" in
+// text, null in JSON. Linux counts the memory an external stage had before
+// exec, which is the shell's.
+struct stage_time{
+    std::string command;
+    std::size_t stage;
+    int pid;
+    bool builtin;
+    int status;
+    struct rusage usage;
+};
+
+
+// Output of the time keyword. The text format is a table for people, the
+// json format is one JSON object per line for tools:
+//
+//   {"type":"pipeline","command":"...","real_s":0.1,"status":0,"stages":[...]}
+//   {"type":"total","real_s":0.3,"pipelines":3}
+
+namespace time_report{
+
+void print_pipeline(std::FILE* out, time_format format, std::string_view command, double real_s,
+                    int status, std::span<const stage_time> stages);
+
+void print_total(std::FILE* out, time_format format, double real_s, std::size_t pipelines);
+
+}
+
+
+#endif // TIME_REPORT_HPP
@@ -0,0 +1,92 @@
+#ifndef INPUT_READER_HPP
+#define INPUT_READER_HPP
+
+#include <string_view>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+
+
+// Buffered line reader working directly on a file descriptor. Unlike
+// std::getline it can tell whether a complete line is already buffered, so
+// the REPL only waits for the fd to become readable when it has to.
+//
+// A returned line stays valid until the next call to read_line.
+
+class Input_Reader
+{
+
+    int fd;
+    std::vector<char> buffer;
+    std::size_t begin {0};
+    std::size_t end {0};
+    bool eof {false};
+
+public:
+    enum class read_status{
+        line,
+        interrupted,
+        eof
+    };
+
+    explicit Input_Reader(int _fd, std::size_t capacity = 4096) :
+        fd{_fd},
+        buffer(capacity)
+        {}
+
+    bool has_line() const noexcept {
+        return (eof && begin < end) || std::memchr(buffer.data() + begin, '\n', end - begin) != nullptr;
+    }
+
+    read_status read_line(std::string_view& line){
+
+        while(true){
+            const char* data {buffer.data()};
+            const void* newline {std::memchr(data + begin, '\n', end - begin)};
+            if(newline){
+                std::size_t nl {static_cast<std::size_t>(static_cast<const char*>(newline) - data)};
+                line = std::string_view(data + begin, nl - begin);
+                begin = nl + 1;
+                return read_status::line;
+            }
+
+            if(eof){
+                if(begin < end){
+                    line = std::string_view(data + begin, end - begin);
+                    begin = end;
+                    return read_status::line;
+                }
+                return read_status::eof;
+            }
+
+            // Make room for more input, keeping the partial line
+            if(begin > 0){
+                std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+                end -= begin;
+                begin = 0;
+            }
+            if(end == buffer.size()){
+                buffer.resize(buffer.size() * 2);
+            }
+
+            ssize_t count = read(fd, buffer.data() + end, buffer.size() - end);
+            if(count > 0){
+                end += static_cast<std::size_t>(count);
+            }
+            else if(count == 0){
+                eof = true;
+            }
+            else if(errno == EINTR){
+                return read_status::interrupted;
+            }
+            else{
+                eof = true;
+            }
+        }
+    }
+};
+
+
+#endif // INPUT_READER_HPP
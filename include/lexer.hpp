@@ -0,0 +1,506 @@
+#ifndef LEXER_HPP
+#define LEXER_HPP
+
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+namespace lex{
+
+
+enum class token_type : std::uint8_t{
+    word,
+    semicolon,
+    pipe,
+    ampersand,
+    less,
+    great,
+    dgreat,
+    greatand,
+    andgreat,
+    anddgreat,
+    dless,
+    dlessdash,
+    tless,
+    heredoc_body
+};
+
+// Word flags let later stages skip words that need no expansion
+constexpr std::uint8_t word_quoted {0x1};
+constexpr std::uint8_t word_dollar {0x2};
+constexpr std::uint8_t word_escaped {0x4};
+// <(...) or >(...), the whole token is one process substitution
+constexpr std::uint8_t word_procsub {0x8};
+
+
+// Tokens refer to the input line by offset, no text is copied. For a
+// redirection operator flags holds the fd it applies to: 0 for <, 1 for >,
+// or the single digit written right before it as in 2>. The body of a
+// here-document follows the newline token of its line, in operator order.
+struct token{
+    std::uint32_t offset;
+    std::uint32_t length;
+    token_type type;
+    std::uint8_t flags;
+};
+
+
+enum class lex_error : std::uint8_t{
+    none,
+    unterminated_quote,
+    trailing_escape,
+    unterminated_procsub,
+    unterminated_heredoc
+};
+
+
+enum char_class : std::uint8_t{
+    cc_plain,
+    cc_blank,
+    cc_operator,
+    cc_quote,
+    cc_dollar,
+    cc_escape,
+    cc_comment
+};
+
+constexpr std::array<std::uint8_t, 256> make_char_classes(){
+    std::array<std::uint8_t, 256> classes {};
+    classes[' '] = cc_blank;
+    classes['\t'] = cc_blank;
+    classes['\n'] = cc_operator;
+    classes[';'] = cc_operator;
+    classes['|'] = cc_operator;
+    classes['&'] = cc_operator;
+    classes['<'] = cc_operator;
+    classes['>'] = cc_operator;
+    classes['\''] = cc_quote;
+    classes['\"'] = cc_quote;
+    classes['$'] = cc_dollar;
+    classes['\\'] = cc_escape;
+    classes['#'] = cc_comment;
+    return classes;
+}
+
+inline constexpr std::array<std::uint8_t, 256> char_classes {make_char_classes()};
+
+
+// Returns the position of the first character at or after pos which is not
+// plain word text. '#' only starts a comment at the beginning of a word, so
+// it is treated as plain text here.
+inline std::size_t skip_plain(const char* text, std::size_t pos, std::size_t len) noexcept{
+
+#if defined(__SSE2__)
+    const __m128i blank {_mm_set1_epi8(' ')};
+    const __m128i tab {_mm_set1_epi8('\t')};
+    const __m128i newline {_mm_set1_epi8('\n')};
+    const __m128i semicolon {_mm_set1_epi8(';')};
+    const __m128i pipe {_mm_set1_epi8('|')};
+    const __m128i amp {_mm_set1_epi8('&')};
+    const __m128i less {_mm_set1_epi8('<')};
+    const __m128i great {_mm_set1_epi8('>')};
+    const __m128i squote {_mm_set1_epi8('\'')};
+    const __m128i dquote {_mm_set1_epi8('\"')};
+    const __m128i dollar {_mm_set1_epi8('$')};
+    const __m128i escape {_mm_set1_epi8('\\')};
+
+    while(pos + 16 <= len){
+        __m128i chunk {_mm_loadu_si128(reinterpret_cast<const __m128i*>(text + pos))};
+        __m128i special {_mm_or_si128(
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, blank), _mm_cmpeq_epi8(chunk, tab)),
+                         _mm_or_si128(_mm_cmpeq_epi8(chunk, newline), _mm_cmpeq_epi8(chunk, semicolon))),
+            _mm_or_si128(
+                _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, pipe), _mm_cmpeq_epi8(chunk, amp)),
+                             _mm_or_si128(_mm_cmpeq_epi8(chunk, less), _mm_cmpeq_epi8(chunk, great))),
+                _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, squote), _mm_cmpeq_epi8(chunk, dquote)),
+                             _mm_or_si128(_mm_cmpeq_epi8(chunk, dollar), _mm_cmpeq_epi8(chunk, escape)))))};
+
+        unsigned int mask = static_cast<unsigned int>(_mm_movemask_epi8(special));
+        if(mask != 0){
+            return pos + static_cast<std::size_t>(__builtin_ctz(mask));
+        }
+        pos += 16;
+    }
+#endif
+
+    while(pos < len){
+        std::uint8_t cc {char_classes[static_cast<unsigned char>(text[pos])]};
+        if(cc != cc_plain && cc != cc_comment){
+            break;
+        }
+        pos++;
+    }
+    return pos;
+}
+
+
+// Returns the position of the quote closing the one at pos, or len. Inside
+// double quotes a backslash escapes the next character.
+inline std::size_t find_closing_quote(const char* text, std::size_t pos, std::size_t len) noexcept{
+
+    char quote {text[pos]};
+    std::size_t from {pos + 1};
+    while(from < len){
+        const void* hit {std::memchr(text + from, quote, len - from)};
+        if(!hit){
+            return len;
+        }
+        std::size_t close {static_cast<std::size_t>(static_cast<const char*>(hit) - text)};
+        if(quote == '\''){
+            return close;
+        }
+
+        std::size_t backslashes {0};
+        while(close - backslashes > pos + 1 && text[close - backslashes - 1] == '\\'){
+            backslashes++;
+        }
+        if(backslashes % 2 == 0){
+            return close;
+        }
+        from = close + 1;
+    }
+    return len;
+}
+
+
+// Where the ${ passed by the last failed find_closing_brace() close, by the
+// position of their brace. A ${ that is never closed sends the search to
+// the end of the line, and every ${ after it would do the same; they are
+// looked up here instead, so such a line is still scanned once.
+struct brace_closes{
+    std::vector<std::array<std::size_t, 2>> found;
+    // Scratch space of the search, kept for its capacity
+    std::vector<std::array<std::size_t, 2>> scan;
+    std::vector<std::size_t> open;
+};
+
+// Reused by every tokenize_line(), like the token vector
+inline brace_closes line_braces;
+
+// Returns the position of the brace closing the ${ whose brace is at pos,
+// or len. Quotes, escapes and nested ${ } inside are skipped over.
+inline std::size_t find_closing_brace(const char* text, std::size_t pos, std::size_t len, brace_closes* closes = nullptr){
+
+    if(closes){
+        auto known = std::lower_bound(closes->found.begin(), closes->found.end(), pos, [](const std::array<std::size_t, 2>& entry, std::size_t brace){
+            return entry[0] < brace;
+        });
+        if(known != closes->found.end() && (*known)[0] == pos){
+            return (*known)[1];
+        }
+    }
+
+    // Every ${ on the way is noted in the order it opens, the stack holds
+    // the ones not closed yet
+    if(closes){
+        closes->scan.assign(1, {pos, len});
+        closes->open.assign(1, 0);
+    }
+
+    std::size_t depth {1};
+    for(std::size_t i{pos + 1}; i < len; ++i){
+        switch(text[i]){
+            case '\\':
+                ++i;
+                break;
+            case '\'':
+            case '\"':
+                i = find_closing_quote(text, i, len);
+                break;
+            case '$':
+                if(i + 1 < len && text[i + 1] == '{'){
+                    ++depth;
+                    ++i;
+                    if(closes){
+                        closes->open.push_back(closes->scan.size());
+                        closes->scan.push_back({i, len});
+                    }
+                }
+                break;
+            case '}':
+                if(--depth == 0){
+                    return i;
+                }
+                if(closes){
+                    closes->scan[closes->open.back()][1] = i;
+                    closes->open.pop_back();
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    if(closes){
+        closes->found.swap(closes->scan);
+    }
+    return len;
+}
+
+
+// Returns the position of the parenthesis closing the one at pos, or len.
+// Quotes, escapes and nested parentheses inside are skipped over.
+inline std::size_t find_closing_paren(const char* text, std::size_t pos, std::size_t len) noexcept{
+
+    std::size_t depth {1};
+    for(std::size_t i{pos + 1}; i < len; ++i){
+        switch(text[i]){
+            case '\\':
+                ++i;
+                break;
+            case '\'':
+            case '\"':
+                i = find_closing_quote(text, i, len);
+                break;
+            case '(':
+                ++depth;
+                break;
+            case ')':
+                if(--depth == 0){
+                    return i;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return len;
+}
+
+
+// True if line is the here-document delimiter written as delim, whose
+// quotes and backslashes do not count
+inline bool is_delimiter(std::string_view line, std::string_view delim) noexcept{
+
+    std::size_t pos {0};
+    char quote {0};
+    for(std::size_t i{0}; i < delim.size(); ++i){
+        char ch {delim[i]};
+        if(quote == 0 && (ch == '\'' || ch == '\"')){
+            quote = ch;
+            continue;
+        }
+        if(ch == quote){
+            quote = 0;
+            continue;
+        }
+        if(ch == '\\' && quote != '\'' && i + 1 < delim.size()){
+            ch = delim[++i];
+        }
+        if(pos >= line.size() || line[pos++] != ch){
+            return false;
+        }
+    }
+    return pos == line.size();
+}
+
+// Adds the body of a here-document starting at pos as a token and returns
+// the position after its delimiter line, or npos if the input ends first.
+// <<- ignores leading tabs on the delimiter line.
+inline std::size_t read_heredoc(std::string_view line, std::size_t pos, std::string_view delim, bool strip_tabs, std::vector<token>& tokens){
+
+    std::size_t start {pos};
+    while(pos < line.size()){
+        std::size_t eol {line.find('\n', pos)};
+        std::size_t end {(eol == std::string_view::npos) ? line.size() : eol};
+        std::size_t text {pos};
+        while(strip_tabs && text < end && line[text] == '\t'){
+            ++text;
+        }
+        if(is_delimiter(line.substr(text, end - text), delim)){
+            tokens.push_back({static_cast<std::uint32_t>(start), static_cast<std::uint32_t>(pos - start), token_type::heredoc_body, strip_tabs});
+            return (eol == std::string_view::npos) ? end : eol + 1;
+        }
+        pos = (eol == std::string_view::npos) ? end : eol + 1;
+    }
+    return std::string_view::npos;
+}
+
+
+// Splits a line into words and operators in a single left to right pass.
+// Quotes and escapes are kept in the word text, they are removed during
+// word expansion. The token vector is cleared but keeps its capacity, so
+// a reused vector makes the scan allocation free in the steady state.
+inline lex_error tokenize_line(std::string_view line, std::vector<token>& tokens){
+
+    tokens.clear();
+
+    const char* text {line.data()};
+    std::size_t len {line.size()};
+    std::size_t pos {0};
+    // First token of the current line, whose here-documents are read at
+    // its newline
+    std::size_t line_start {0};
+    line_braces.found.clear();
+
+    auto is_heredoc = [&tokens](std::size_t index){
+        return (tokens[index].type == token_type::dless || tokens[index].type == token_type::dlessdash) &&
+               index + 1 < tokens.size() && tokens[index + 1].type == token_type::word;
+    };
+
+    while(pos < len){
+
+        char ch {text[pos]};
+        std::uint8_t cc {char_classes[static_cast<unsigned char>(ch)]};
+
+        if(cc == cc_blank){
+            pos++;
+            continue;
+        }
+
+        if(cc == cc_comment){
+            const void* eol {std::memchr(text + pos, '\n', len - pos)};
+            pos = (eol) ? static_cast<std::size_t>(static_cast<const char*>(eol) - text) : len;
+            continue;
+        }
+
+        // A single digit right before < or > names the fd to redirect
+        std::uint8_t io_number {0xff};
+        if(ch >= '0' && ch <= '9' && pos + 1 < len && (text[pos + 1] == '<' || text[pos + 1] == '>')){
+            io_number = static_cast<std::uint8_t>(ch - '0');
+            ch = text[++pos];
+            cc = cc_operator;
+        }
+
+        // <(...) and >(...) are words, the command inside is parsed later
+        if((ch == '<' || ch == '>') && io_number == 0xff && pos + 1 < len && text[pos + 1] == '('){
+            std::size_t close {find_closing_paren(text, pos + 1, len)};
+            if(close >= len){
+                return lex_error::unterminated_procsub;
+            }
+            tokens.push_back({static_cast<std::uint32_t>(pos), static_cast<std::uint32_t>(close + 1 - pos), token_type::word, word_procsub});
+            pos = close + 1;
+            continue;
+        }
+
+        if(cc == cc_operator){
+            token tok {static_cast<std::uint32_t>(pos), 1, token_type::semicolon, 0};
+            switch(ch){
+                case '|':
+                    tok.type = token_type::pipe;
+                    break;
+                case '&':
+                    tok.type = token_type::ampersand;
+                    if(pos + 1 < len && text[pos + 1] == '>'){
+                        bool append {pos + 2 < len && text[pos + 2] == '>'};
+                        tok.type = append ? token_type::anddgreat : token_type::andgreat;
+                        tok.length = append ? 3 : 2;
+                        tok.flags = 1;
+                    }
+                    break;
+                case '<':
+                    tok.type = token_type::less;
+                    tok.flags = 0;
+                    if(pos + 1 < len && text[pos + 1] == '<'){
+                        tok.type = token_type::dless;
+                        tok.length = 2;
+                        if(pos + 2 < len && (text[pos + 2] == '<' || text[pos + 2] == '-')){
+                            tok.type = (text[pos + 2] == '<') ? token_type::tless : token_type::dlessdash;
+                            tok.length = 3;
+                        }
+                    }
+                    break;
+                case '>':
+                    tok.type = token_type::great;
+                    tok.flags = 1;
+                    if(pos + 1 < len && text[pos + 1] == '>'){
+                        tok.type = token_type::dgreat;
+                        tok.length = 2;
+                    }
+                    else if(pos + 1 < len && text[pos + 1] == '&'){
+                        tok.type = token_type::greatand;
+                        tok.length = 2;
+                    }
+                    break;
+                default:
+                    break;
+            }
+            if(io_number != 0xff){
+                tok.flags = io_number;
+                tok.offset--;
+                tok.length++;
+            }
+            tokens.push_back(tok);
+            pos = tok.offset + tok.length;
+
+            if(ch == '\n'){
+                std::size_t line_end {tokens.size() - 1};
+                for(std::size_t index{line_start}; index < line_end; ++index){
+                    if(!is_heredoc(index)){
+                        continue;
+                    }
+                    const token& delim {tokens[index + 1]};
+                    pos = read_heredoc(line, pos, line.substr(delim.offset, delim.length), tokens[index].type == token_type::dlessdash, tokens);
+                    if(pos == std::string_view::npos){
+                        return lex_error::unterminated_heredoc;
+                    }
+                }
+                line_start = tokens.size();
+            }
+            continue;
+        }
+
+        // Word: runs of plain text, quoted strings, escapes and '$'
+        token tok {static_cast<std::uint32_t>(pos), 0, token_type::word, 0};
+        while(pos < len){
+            pos = skip_plain(text, pos, len);
+            if(pos >= len){
+                break;
+            }
+
+            cc = char_classes[static_cast<unsigned char>(text[pos])];
+            if(cc == cc_quote){
+                tok.flags |= word_quoted;
+                std::size_t close {find_closing_quote(text, pos, len)};
+                if(close >= len){
+                    return lex_error::unterminated_quote;
+                }
+                if(text[pos] == '\"' && std::memchr(text + pos + 1, '$', close - pos - 1)){
+                    tok.flags |= word_dollar;
+                }
+                pos = close + 1;
+            }
+            else if(cc == cc_dollar){
+                tok.flags |= word_dollar;
+                // ${...} is part of the word, blanks and operators inside included
+                std::size_t close {len};
+                if(pos + 1 < len && text[pos + 1] == '{'){
+                    close = find_closing_brace(text, pos + 1, len, &line_braces);
+                }
+                pos = (close < len) ? close + 1 : pos + 1;
+            }
+            else if(cc == cc_escape){
+                if(pos + 1 >= len){
+                    return lex_error::trailing_escape;
+                }
+                tok.flags |= word_escaped;
+                pos += 2;
+            }
+            else{
+                break;
+            }
+        }
+        tok.length = static_cast<std::uint32_t>(pos - tok.offset);
+        tokens.push_back(tok);
+    }
+
+    // A here-document on the last line has no body yet
+    for(std::size_t index{line_start}; index < tokens.size(); ++index){
+        if(is_heredoc(index)){
+            return lex_error::unterminated_heredoc;
+        }
+    }
+    return lex_error::none;
+}
+
+}
+
+
+#endif // LEXER_HPP
@@ -1,128 +1,326 @@
 #ifndef PARSE_INPUT_HPP
 #define PARSE_INPUT_HPP
 
-#include <string>
-#include <list>
-#include <cstring>
-#include <sstream>
-#include <algorithm>
-#include <iterator>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
 #include <cctype>
-#include <algorithm>
-#include <iostream>
-#include <utility>
 
-#include <unistd.h>
-
-#include "command_struct.hpp"
+#include "lexer.hpp"
 
 namespace parse{
 
 
-std::list<std::string> tokenize_command(const std::string& cmdtext){
+// The syntax tree of one input line. Nodes live in flat vectors and refer to
+// their children by index ranges, words refer to the line text by offset.
+//
+//   line      := pipeline ((';' | '&') pipeline)* [';' | '&']
+//   pipeline  := ['time' ['-j']] command ('|' command)*
+//   command   := (assignment | word | redirection)+
+//   redirection := [digit] ('<' | '>' | '>>' | '>&' | '<<' | '<<-' | '<<<') word
+//                | ('&>' | '&>>') word
+//
+// A word may be a process substitution, <(pipeline) or >(pipeline); the
+// pipeline inside is parsed on its own when the command is expanded. The
+// word after << or <<- is the delimiter, the body is the text between the
+// end of the line and the delimiter line.
+//
+// Clearing keeps the vectors' capacity, so parsing a line allocates nothing
+// once the vectors have grown to fit.
+
+enum class redirect_type : std::uint8_t{
+    input,
+    output,
+    append,
+    duplicate,
+    output_both,
+    append_both,
+    heredoc,
+    herestring
+};
+
+struct word_node{
+    std::uint32_t offset;
+    std::uint32_t length;
+    std::uint8_t flags;
+};
+
+// fd is the descriptor being redirected, for duplicate the target word
+// names the fd it becomes a copy of. A here-document's body has the lexer's
+// flag for <<- in its flags, leading tabs are removed from its lines.
+struct redirect_node{
+    redirect_type type;
+    std::uint8_t fd;
+    word_node target;
+    word_node body {};
+};
+
+struct command_node{
+    std::uint32_t first_assign;
+    std::uint32_t assign_count;
+    std::uint32_t first_word;
+    std::uint32_t word_count;
+    std::uint32_t first_redirect;
+    std::uint32_t redirect_count;
+};
+
+struct pipeline_node{
+    std::uint32_t first_command;
+    std::uint32_t command_count;
+    bool background;
+    bool timed {false};
+    bool time_json {false};
+};
+
+struct line_ast{
+    std::string_view line;
+
+    std::vector<word_node> assigns;
+    std::vector<word_node> words;
+    std::vector<redirect_node> redirects;
+    std::vector<command_node> commands;
+    std::vector<pipeline_node> pipelines;
+
+    std::string_view text(const word_node& word) const noexcept {
+        return line.substr(word.offset, word.length);
+    }
+
+    void clear() noexcept {
+        line = {};
+        assigns.clear();
+        words.clear();
+        redirects.clear();
+        commands.clear();
+        pipelines.clear();
+    }
+};
+
+
+struct parse_error{
+    std::string_view message;
+    std::string_view near;
+};
+
 
-    std::string delims {"\n "};
-    std::string buf (cmdtext);
-    std::list<std::string> cmdtokens;
+inline bool is_assignment(std::string_view word) noexcept{
 
-    char* tok {std::strtok(buf.data(), delims.c_str())};
-    while(tok){
-        cmdtokens.push_back(std::string(tok));
-        tok = std::strtok(nullptr, delims.c_str());
+    if(word.empty() || !(std::isalpha(static_cast<unsigned char>(word.front())) || word.front() == '_')){
+        return false;
     }
-    return cmdtokens;
+    for(char ch : word){
+        if(ch == '='){
+            return true;
+        }
+        if(!std::isalnum(static_cast<unsigned char>(ch)) && ch != '_'){
+            return false;
+        }
+    }
+    return false;
 }
 
 
-std::map<std::string, std::string> extract_env_vars(const std::list<std::string>& tokens, int& curr_token){
+inline bool build_ast(std::string_view line, const std::vector<lex::token>& tokens, line_ast& ast, parse_error& error){
 
-    if(tokens.front().find("=") == std::string::npos)
-        return {};
+    ast.clear();
+    ast.line = line;
 
-    std::map<std::string, std::string> envs;
+    auto describe = [line](const lex::token& tok){
+        if(tok.type == lex::token_type::semicolon && line[tok.offset] == '\n'){
+            return std::string_view{"newline"};
+        }
+        return line.substr(tok.offset, tok.length);
+    };
 
-    std::list<std::string>::const_iterator startptr {tokens.cbegin()};
+    command_node cmd {};
+    pipeline_node pipeline {};
+    bool in_command {false};
+    // Bodies come in the order of the here-documents
+    std::size_t next_heredoc {0};
 
-    char start_char_seq {'\0'};
-    while(startptr != tokens.cend()){
-        std::string::size_type dlim {(*startptr).find("=")};
-        std::string envkey {(*startptr).substr(0, dlim)};
-        std::string envvalue {(*startptr).substr(dlim+1)};
+    auto begin_command = [&ast, &cmd](){
+        cmd = {static_cast<std::uint32_t>(ast.assigns.size()), 0,
+               static_cast<std::uint32_t>(ast.words.size()), 0,
+               static_cast<std::uint32_t>(ast.redirects.size()), 0};
+    };
 
-        if(dlim != std::string::npos){
-            if(envvalue.front() != '\"' && envvalue.front() != '\''){
-                envs.insert(std::make_pair(envkey, envvalue));
-                curr_token++;
-            }
-            else if((envvalue.front() == '\"' && envvalue.back() == '\"') || (envvalue.front() == '\'' && envvalue.back() == '\'')){
-                envs.insert(std::make_pair(envkey, envvalue));
-                curr_token++;
-            }
-            else{
-                start_char_seq = envvalue.front();
-                std::ostringstream envstream (std::string(envvalue + " "), std::ios_base::ate);
-                startptr = std::next(startptr);
-                curr_token++;
-                while(startptr != tokens.cend() && (*startptr).back() != start_char_seq){
-                    envstream << *startptr << " ";
-                    startptr = std::next(startptr);
-                    curr_token++;
+    auto begin_pipeline = [&ast, &pipeline](){
+        pipeline = {static_cast<std::uint32_t>(ast.commands.size()), 0, false, false, false};
+    };
+
+    begin_pipeline();
+    begin_command();
+
+    for(std::size_t index{0}; index < tokens.size(); ++index){
+
+        const lex::token& tok {tokens[index]};
+
+        switch(tok.type){
+            case lex::token_type::word:{
+                word_node word {tok.offset, tok.length, tok.flags};
+
+                // time is a keyword only in front of a pipeline's first command
+                auto is_word = [&tokens](std::size_t next){
+                    return next < tokens.size() && tokens[next].type == lex::token_type::word;
+                };
+                if(!in_command && pipeline.command_count == 0 && !pipeline.timed &&
+                   word.flags == 0 && ast.text(word) == "time" && is_word(index + 1)){
+                    pipeline.timed = true;
+                    if(line.substr(tokens[index + 1].offset, tokens[index + 1].length) == "-j" && is_word(index + 2)){
+                        pipeline.time_json = true;
+                        ++index;
+                    }
+                    break;
                 }
-                if(startptr == tokens.end()){
-                    // Second double quotes not in any tokens
-                    // Handle error
-                    std::terminate();
+                if(cmd.word_count == 0 && is_assignment(ast.text(word))){
+                    ast.assigns.push_back(word);
+                    cmd.assign_count++;
                 }
-                if((*startptr).back() == start_char_seq){
-                    // Found second token with double quotes
-                    envstream << *startptr;
-                    curr_token++;
+                else{
+                    ast.words.push_back(word);
+                    cmd.word_count++;
                 }
-                envs.insert(std::make_pair(envkey, std::move(envstream).str()));
+                in_command = true;
+                break;
             }
-        }
-        startptr = std::next(startptr);
-    }
-    return envs;
-}
-
 
-std::list<command_info> extract_commands(std::list<std::string>& tokens){
+            case lex::token_type::less:
+            case lex::token_type::great:
+            case lex::token_type::dgreat:
+            case lex::token_type::greatand:
+            case lex::token_type::andgreat:
+            case lex::token_type::anddgreat:
+            case lex::token_type::dless:
+            case lex::token_type::dlessdash:
+            case lex::token_type::tless:{
+                if(index + 1 >= tokens.size() || tokens[index + 1].type != lex::token_type::word){
+                    error = {"syntax error near unexpected token",
+                             (index + 1 < tokens.size()) ? describe(tokens[index + 1]) : std::string_view{"newline"}};
+                    return false;
+                }
+                const lex::token& target {tokens[++index]};
+                redirect_type type {redirect_type::input};
+                switch(tok.type){
+                    case lex::token_type::great:
+                        type = redirect_type::output;
+                        break;
+                    case lex::token_type::dgreat:
+                        type = redirect_type::append;
+                        break;
+                    case lex::token_type::greatand:
+                        type = redirect_type::duplicate;
+                        break;
+                    case lex::token_type::andgreat:
+                        type = redirect_type::output_both;
+                        break;
+                    case lex::token_type::anddgreat:
+                        type = redirect_type::append_both;
+                        break;
+                    case lex::token_type::dless:
+                    case lex::token_type::dlessdash:
+                        type = redirect_type::heredoc;
+                        break;
+                    case lex::token_type::tless:
+                        type = redirect_type::herestring;
+                        break;
+                    default:
+                        break;
+                }
+                ast.redirects.push_back({type, tok.flags, {target.offset, target.length, target.flags}});
+                cmd.redirect_count++;
+                in_command = true;
+                break;
+            }
 
-    std::list<command_info> cmds_list;
-    int ctok{0};
-    command_info cinfo;
+            case lex::token_type::heredoc_body:
+                while(next_heredoc < ast.redirects.size() && ast.redirects[next_heredoc].type != redirect_type::heredoc){
+                    ++next_heredoc;
+                }
+                if(next_heredoc < ast.redirects.size()){
+                    ast.redirects[next_heredoc++].body = {tok.offset, tok.length, tok.flags};
+                }
+                break;
 
-    std::list<std::string> cmdtokens;
-    std::map<std::string, std::string> envs;
+            case lex::token_type::pipe:
+                if(!in_command){
+                    error = {"syntax error near unexpected token", describe(tok)};
+                    return false;
+                }
+                ast.commands.push_back(cmd);
+                pipeline.command_count++;
+                begin_command();
+                in_command = false;
+                break;
 
-    for(const std::string& cmdinput : tokens){
-        cmdtokens = tokenize_command(cmdinput);
+            case lex::token_type::semicolon:
+            case lex::token_type::ampersand:
+                if(!in_command){
+                    // Blank lines and a trailing newline separate nothing
+                    if(pipeline.command_count == 0 && tok.type == lex::token_type::semicolon && line[tok.offset] == '\n'){
+                        break;
+                    }
+                    error = {"syntax error near unexpected token", describe(tok)};
+                    return false;
+                }
+                ast.commands.push_back(cmd);
+                pipeline.command_count++;
+                pipeline.background = (tok.type == lex::token_type::ampersand);
+                ast.pipelines.push_back(pipeline);
+                begin_pipeline();
+                begin_command();
+                in_command = false;
+                break;
+        }
+    }
 
-        envs = extract_env_vars(cmdtokens, ctok);
-        cinfo.envs = std::move(envs);
+    if(in_command){
+        ast.commands.push_back(cmd);
+        pipeline.command_count++;
+        ast.pipelines.push_back(pipeline);
+    }
+    else if(pipeline.command_count > 0){
+        error = {"syntax error near unexpected token", "newline"};
+        return false;
+    }
+    return true;
+}
 
-        if(ctok != 0){
-            cmdtokens.erase(cmdtokens.begin(), std::next(cmdtokens.begin(), ctok));
-        }
 
-        // Check if the input is an assignment, parse it appropriately
+inline bool parse_line(std::string_view line, std::vector<lex::token>& tokens, line_ast& ast, parse_error& error){
 
-        cinfo.execfile = std::exchange(cmdtokens.front(), "");
-        cmdtokens.erase(cmdtokens.begin());
+    lex::lex_error lexerr {lex::tokenize_line(line, tokens)};
+    if(lexerr == lex::lex_error::unterminated_quote){
+        error = {"syntax error: unterminated quoted string", {}};
+        return false;
+    }
+    if(lexerr == lex::lex_error::trailing_escape){
+        error = {"syntax error: unexpected end of line after \\", {}};
+        return false;
+    }
+    if(lexerr == lex::lex_error::unterminated_procsub){
+        error = {"syntax error: unterminated process substitution", {}};
+        return false;
+    }
+    if(lexerr == lex::lex_error::unterminated_heredoc){
+        error = {"syntax error: here-document without its delimiter line", {}};
+        return false;
+    }
+    return build_ast(line, tokens, ast, error);
+}
 
-        // CRITICAL: EXTRACT ARGUMENTS
 
-        std::move(cmdtokens.begin(), cmdtokens.end(), std::back_inserter(cinfo.cmdargs));
-        //expand_cmdline_args(cinfo.cmdargs);
-        cmds_list.push_back(cinfo);
+inline void print_error(const parse_error& error){
 
-        cinfo = {};
-        ctok = 0;
+    if(error.near.empty()){
+        std::fprintf(stderr, "nsh: %.*s\n", static_cast<int>(error.message.size()), error.message.data());
+    }
+    else{
+        std::fprintf(stderr, "nsh: %.*s `%.*s'\n", static_cast<int>(error.message.size()), error.message.data(),
+                     static_cast<int>(error.near.size()), error.near.data());
     }
-
-    return cmds_list;
 }
+
+
 }
 
 
@@ -0,0 +1,186 @@
+#ifndef SHELL_VARIABLES_HPP
+#define SHELL_VARIABLES_HPP
+
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+#include "system_envs.hpp"
+
+
+// Shell variables, the environment included. Names are looked up by
+// string_view in a flat open addressing table of (hash, index) slots with
+// linear probing; the variables themselves live in a dense vector, so a
+// lookup touches one or two cache lines and allocates nothing.
+//
+// Unsetting keeps the entry and only clears its flags, which leaves the
+// probe sequences intact without tombstones. Exported variables are written
+// through to the environment store.
+
+class Shell_Variables
+{
+
+public:
+    struct variable{
+        std::string name;
+        std::string value;
+        bool set;
+        bool exported;
+    };
+
+private:
+    struct slot{
+        std::uint32_t hash;
+        std::uint32_t index;
+    };
+
+    static constexpr std::uint32_t empty_slot {UINT32_MAX};
+
+    std::vector<slot> slots;
+    std::vector<variable> variables;
+    std::size_t mask {0};
+
+    int last_status {0};
+    bool imported {false};
+
+    static std::uint32_t hash_name(std::string_view name) noexcept {
+        // FNV-1a
+        std::uint32_t hash {2166136261u};
+        for(char ch : name){
+            hash ^= static_cast<unsigned char>(ch);
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+
+    void rehash(std::size_t capacity){
+        slots.assign(capacity, {0, empty_slot});
+        mask = capacity - 1;
+        for(std::uint32_t i{0}; i < variables.size(); ++i){
+            std::uint32_t hash {hash_name(variables[i].name)};
+            std::size_t pos {hash & mask};
+            while(slots[pos].index != empty_slot){
+                pos = (pos + 1) & mask;
+            }
+            slots[pos] = {hash, i};
+        }
+    }
+
+    // The environment is copied in at the first lookup, so a line that
+    // only reads or sets $? does not pay for it
+    void import_environment(){
+        if(imported){
+            return;
+        }
+        imported = true;
+        environment::init_env();
+        for(const auto& [name, value] : environment::envmap){
+            variable& var {find_or_insert(name)};
+            var.value = value;
+            var.set = true;
+            var.exported = true;
+        }
+    }
+
+    variable* find(std::string_view name){
+        import_environment();
+        if(slots.empty()){
+            return nullptr;
+        }
+        std::uint32_t hash {hash_name(name)};
+        for(std::size_t pos {hash & mask}; slots[pos].index != empty_slot; pos = (pos + 1) & mask){
+            if(slots[pos].hash == hash && variables[slots[pos].index].name == name){
+                return &variables[slots[pos].index];
+            }
+        }
+        return nullptr;
+    }
+
+    variable& find_or_insert(std::string_view name){
+        if(variable* var {find(name)}){
+            return *var;
+        }
+        // At most half full keeps the probe sequences short
+        if((variables.size() + 1) * 2 > slots.size()){
+            rehash(slots.empty() ? 64 : slots.size() * 2);
+        }
+        std::uint32_t hash {hash_name(name)};
+        std::size_t pos {hash & mask};
+        while(slots[pos].index != empty_slot){
+            pos = (pos + 1) & mask;
+        }
+        slots[pos] = {hash, static_cast<std::uint32_t>(variables.size())};
+        variables.push_back({std::string(name), std::string(), false, false});
+        return variables.back();
+    }
+
+    Shell_Variables() = default;
+
+public:
+    static Shell_Variables& get_instance(){
+        static Shell_Variables shell_variables {};
+        return shell_variables;
+    }
+
+    Shell_Variables(const Shell_Variables&) = delete;
+    Shell_Variables& operator=(const Shell_Variables&) = delete;
+
+    // nullptr if name is unset
+    const std::string* get(std::string_view name){
+        variable* var {find(name)};
+        return (var && var->set) ? &var->value : nullptr;
+    }
+
+    bool set(std::string_view name, std::string_view value){
+        variable& var {find_or_insert(name)};
+        var.value.assign(value);
+        var.set = true;
+        if(var.exported){
+            return environment::register_new_env(var.name, var.value);
+        }
+        return true;
+    }
+
+    // An unset name is exported once it gets a value
+    bool export_variable(std::string_view name){
+        variable& var {find_or_insert(name)};
+        var.exported = true;
+        if(var.set){
+            return environment::register_new_env(var.name, var.value);
+        }
+        return true;
+    }
+
+    void unset(std::string_view name){
+        variable* var {find(name)};
+        if(!var){
+            return;
+        }
+        if(var->exported){
+            environment::unregister_env(var->name);
+        }
+        var->value.clear();
+        var->set = false;
+        var->exported = false;
+    }
+
+    // Every name used so far, unset ones included
+    const std::vector<variable>& get_variables(){
+        import_environment();
+        return variables;
+    }
+
+    // $?
+    int get_last_status() const noexcept {
+        return last_status;
+    }
+
+    void set_last_status(int status) noexcept {
+        last_status = status;
+    }
+};
+
+
+#endif // SHELL_VARIABLES_HPP
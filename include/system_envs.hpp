@@ -5,49 +5,174 @@
 #include <map>
 #include <string>
 #include <string_view>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
 
 #include <unistd.h>
 
+#include "execution/startup_trace.hpp"
+
 extern char** environ;
 
+
+// The exported environment. envmap is the source of truth and every change
+// bumps version; children get a prebuilt, name sorted envp that is only
+// rebuilt when the version moved since the last launch. Per-command
+// assignments are merged into a copy of that array instead.
+//
+// Changes are mirrored into environ so that getenv() in the shell, e.g. for
+// $PATH lookups and word expansion, sees the same values.
+
 namespace environment{
 
 using name_t = std::string;
 using value_t = std::string;
 
-std::map<name_t, value_t> envmap;
+inline std::map<name_t, value_t, std::less<>> envmap;
+inline std::uint64_t version {0};
+inline bool initialized {false};
 
+// NAME=value strings of envmap at snapshot_version, nul separated
+inline std::string snapshot_strings;
+inline std::vector<char*> snapshot;
+inline std::uint64_t snapshot_version {UINT64_MAX};
 
 
-bool init_env(){
+
+inline bool init_env(){
+
+    if(initialized){
+        return true;
+    }
+    initialized = true;
+    startup_step step {"environment"};
 
     char** env = environ;
     while(env && *env){
         std::string_view val (*env);
         std::string_view::size_type pos = val.find("=");
-        envmap.insert(std::pair{val.substr(0, pos), val.substr(pos + 1)});
+        if(pos != std::string_view::npos){
+            envmap.insert(std::pair{val.substr(0, pos), val.substr(pos + 1)});
+        }
         env++;
     }
+    ++version;
     return true;
 }
 
 
-bool register_new_env(const std::string& name, const std::string& value){
+// A name made of letters, digits and underscores, not starting with a digit
+inline bool is_valid_name(std::string_view name) noexcept {
+
+    if(name.empty() || (name.front() >= '0' && name.front() <= '9')){
+        return false;
+    }
+    return std::all_of(name.begin(), name.end(), [](char ch){
+        return ch == '_' || (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9');
+    });
+}
+
+
+inline bool register_new_env(const std::string& name, const std::string& value){
 
+    init_env();
     if(setenv(name.data(), value.data(), 1) < 0){
         return false;
     }
-    envmap.insert(std::pair{name.data(), value.data()});
+    envmap.insert_or_assign(name, value);
+    ++version;
+    return true;
+}
+
+// Returns false if name was not set
+inline bool unregister_env(const std::string& name){
+
+    init_env();
+    auto iter = envmap.find(name);
+    if(iter == envmap.end()){
+        return false;
+    }
+    unsetenv(name.data());
+    envmap.erase(iter);
+    ++version;
     return true;
 }
 
-std::string get_env(const std::string& name){
+inline std::string get_env(const std::string& name){
 
+    init_env();
     if(envmap.contains(name)){
         return envmap.at(name);
     }
     return std::string();
 }
+
+
+// The name of a NAME=value entry, or the whole of a bare name
+inline std::string_view entry_name(const char* entry) noexcept {
+    const char* dlim {std::strchr(entry, '=')};
+    return dlim ? std::string_view{entry, static_cast<std::size_t>(dlim - entry)} : std::string_view{entry};
+}
+
+// The environment as a nullptr terminated array, valid until the next change
+inline char* const* get_envp(){
+
+    init_env();
+    if(snapshot_version == version){
+        return snapshot.data();
+    }
+
+    snapshot_strings.clear();
+    for(const auto& [name, value] : envmap){
+        snapshot_strings.append(name).append(1, '=').append(value).append(1, '\0');
+    }
+    snapshot.clear();
+    for(std::size_t offset{0}; offset < snapshot_strings.size(); offset += std::strlen(snapshot_strings.data() + offset) + 1){
+        snapshot.push_back(snapshot_strings.data() + offset);
+    }
+    snapshot.push_back(nullptr);
+    snapshot_version = version;
+    return snapshot.data();
+}
+
+// The environment, or nothing for clear, with the NAME=value entries of
+// overrides on top and their bare names removed. Without overrides this is
+// the snapshot itself, otherwise the merge is written to out, which must
+// outlive the use of the result.
+inline char* const* merge_envp(char* const* overrides, bool clear, std::vector<char*>& out){
+
+    char* const* base {get_envp()};
+    if(!clear && (!overrides || !*overrides)){
+        return base;
+    }
+
+    // The snapshot is sorted by name, each override replaces at most one entry
+    std::size_t base_count {clear ? 0 : snapshot.size() - 1};
+    bool removed {false};
+    out.assign(base, base + base_count);
+    for(char* const* env {overrides}; *env; ++env){
+        std::string_view name {entry_name(*env)};
+        bool assignment {(*env)[name.size()] == '='};
+        auto iter = std::lower_bound(base, base + base_count, name, [](const char* entry, std::string_view key){
+            return entry_name(entry) < key;
+        });
+        if(iter != base + base_count && entry_name(*iter) == name){
+            out[static_cast<std::size_t>(iter - base)] = assignment ? *env : nullptr;
+            removed = removed || !assignment;
+        }
+        else if(assignment){
+            out.push_back(*env);
+        }
+    }
+    if(removed){
+        out.erase(std::remove(out.begin(), out.end(), nullptr), out.end());
+    }
+    out.push_back(nullptr);
+    return out.data();
+}
 }
 
 
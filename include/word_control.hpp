@@ -1,9 +1,16 @@
 #ifndef WORD_CONTROL_HPP
 #define WORD_CONTROL_HPP
 
-#include <vector>
 #include <string>
-#include <map>
+#include <string_view>
+#include <charconv>
+#include <cstdio>
+
+#include <unistd.h>
+#include <fnmatch.h>
+
+#include "lexer.hpp"
+#include "shell_variables.hpp"
 
 
 namespace wexpand{
@@ -14,52 +21,483 @@ constexpr char double_quote {'\"'};
 constexpr char chdollar {'$'};
 
 
-bool expand_word(std::string& word){
+// Expansion is one left to right pass over the word text that appends to a
+// reused output buffer: quotes and backslashes are removed and parameters
+// are expanded wherever they appear in the word. Supported are $NAME,
+// ${NAME}, the special parameters $? $$ $# $0, and
+//
+//   ${#NAME}                           length of the value
+//   ${NAME-word}   ${NAME:-word}       word if NAME is unset (or empty)
+//   ${NAME=word}   ${NAME:=word}       same, and NAME is assigned word
+//   ${NAME?word}   ${NAME:?word}       error with word as message
+//   ${NAME+word}   ${NAME:+word}       word if NAME is set (and not empty)
+//   ${NAME#pat}    ${NAME##pat}        value without the shortest/longest prefix
+//   ${NAME%pat}    ${NAME%%pat}        value without the shortest/longest suffix
+//
+// Results are not split into fields, a word always expands to one word.
+//
+// In glob mode the result is a pathname pattern: *, ?, [, ] and \ that were
+// quoted are written with a backslash in front, so only the unquoted ones
+// stay special. Patterns of # and % are always expanded this way.
+
+// Scratch space for pattern removal, kept between words
+inline std::string pattern_buffer;
+inline std::string candidate_buffer;
+
+
+inline bool is_name_start(char ch) noexcept {
+    return ch == '_' || (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z');
+}
+
+inline bool is_name_char(char ch) noexcept {
+    return is_name_start(ch) || (ch >= '0' && ch <= '9');
+}
+
+inline bool is_special(char ch) noexcept {
+    return ch == '?' || ch == '$' || ch == '#' || (ch >= '0' && ch <= '9');
+}
+
 
-    if(word == "$" || word.length() == 1){
+// The value of a parameter, false if it is unset. Special parameters are
+// formatted into buf.
+inline bool get_parameter(std::string_view name, std::string_view& value, char (&buf)[24]){
+
+    if(name.size() == 1 && is_special(name.front())){
+        int number {0};
+        switch(name.front()){
+            case '?':
+                number = Shell_Variables::get_instance().get_last_status();
+                break;
+            case '$':
+                number = getpid();
+                break;
+            case '#':
+                break;
+            case '0':
+                value = "nsh";
+                return true;
+            default:
+                // There are no positional parameters
+                return false;
+        }
+        auto [ptr, ec] = std::to_chars(buf, buf + sizeof(buf), number);
+        value = {buf, static_cast<std::size_t>(ptr - buf)};
         return true;
     }
+    if(!is_name_start(name.front())){
+        return false;
+    }
 
-    std::string str{};
+    const std::string* var {Shell_Variables::get_instance().get(name)};
+    if(!var){
+        return false;
+    }
+    value = *var;
+    return true;
+}
+
+inline void append_literal(std::string& out, std::string_view text, bool escape){
 
-    if(word.front() == chdollar){
-        if(word.at(1) != single_quote && word.at(1) != double_quote){
-            str = word.substr(1);
-            char* ch {std::getenv(str.c_str())};
-            word = (ch) ? ch : str;
+    if(!escape){
+        out.append(text);
+        return;
+    }
+    for(char ch : text){
+        if(ch == '*' || ch == '?' || ch == '[' || ch == ']' || ch == '\\'){
+            out.push_back('\\');
         }
-        else{
-            word = word.substr(2, word.length()-3).c_str();
+        out.push_back(ch);
+    }
+}
+
+// A parameter value: quoted it is literal text, unquoted in glob mode only
+// its backslashes are escaped so that it keeps them if it matches nothing
+inline void append_value(std::string& out, std::string_view value, bool double_quoted, bool glob){
+
+    if(!glob || double_quoted){
+        append_literal(out, value, glob);
+        return;
+    }
+    for(char ch : value){
+        if(ch == '\\'){
+            out.push_back('\\');
+        }
+        out.push_back(ch);
+    }
+}
+
+// True if word has an unquoted *, ? or [ with a ] after it, so that it has
+// to go through pathname expansion
+inline bool has_glob(std::string_view word) noexcept {
+
+    if(word.find_first_of("*?[") == std::string_view::npos){
+        return false;
+    }
+
+    for(std::size_t pos{0}; pos < word.size(); ++pos){
+        switch(word[pos]){
+            case '\\':
+                ++pos;
+                break;
+            case single_quote:
+                pos = word.find(single_quote, pos + 1);
+                if(pos == std::string_view::npos){
+                    return false;
+                }
+                break;
+            case double_quote:
+                pos = lex::find_closing_quote(word.data(), pos, word.size());
+                break;
+            case chdollar:
+                if(pos + 1 < word.size() && word[pos + 1] == '{'){
+                    pos = lex::find_closing_brace(word.data(), pos + 1, word.size());
+                }
+                break;
+            case '*':
+            case '?':
+                return true;
+            case '[':
+                if(word.find(']', pos + 1) != std::string_view::npos){
+                    return true;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return false;
+}
+
+inline bool bad_substitution(std::string_view body){
+    std::fprintf(stderr, "nsh: ${%.*s}: bad substitution\n", static_cast<int>(body.size()), body.data());
+    return false;
+}
+
+
+inline bool expand_text(std::string_view word, std::string& out, bool double_quoted, bool glob);
+
+
+// Removes the shortest or longest prefix (or suffix) of value matching the
+// pattern in pattern_buffer and appends the rest to out
+inline void remove_pattern(std::string_view value, bool suffix, bool longest, std::string& out, bool double_quoted, bool glob){
+
+    auto matches = [&value](std::size_t from, std::size_t to){
+        candidate_buffer.assign(value.substr(from, to - from));
+        return fnmatch(pattern_buffer.c_str(), candidate_buffer.c_str(), 0) == 0;
+    };
+
+    std::size_t size {value.size()};
+    for(std::size_t step{0}; step <= size; ++step){
+        // Shortest first tries the fewest characters, longest the most
+        std::size_t count {longest ? size - step : step};
+        if(!suffix && matches(0, count)){
+            append_value(out, value.substr(count), double_quoted, glob);
+            return;
+        }
+        if(suffix && matches(size - count, size)){
+            append_value(out, value.substr(0, size - count), double_quoted, glob);
+            return;
         }
     }
-    else if(word.front() == single_quote){
-        word = word.substr(1, word.length()-2).c_str();
+    append_value(out, value, double_quoted, glob);
+}
+
+
+// body is the text between ${ and }
+inline bool expand_braces(std::string_view body, std::string& out, bool double_quoted, bool glob){
+
+    char buf[24];
+    std::string_view value;
+
+    if(body.empty()){
+        return bad_substitution(body);
     }
-    else if(word.front() == double_quote){
-        if(word[1] == chdollar){
-            str = word.substr(2, word.length()-3);
-            char* ch {std::getenv(str.c_str())};
-            word = (ch) ? ch : str;
+
+    // ${#NAME} is a length, ${#} and ${#-word} are about $#
+    if(body.size() > 1 && body.front() == '#' && body[1] != '-' && body[1] != '=' && body[1] != '?' && body[1] != '+'){
+        std::string_view name {body.substr(1)};
+        bool valid {(name.size() == 1 && is_special(name.front())) ||
+                    (is_name_start(name.front()) && name.find_first_not_of(
+                        "_abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789") == std::string_view::npos)};
+        if(!valid){
+            return bad_substitution(body);
         }
-        else{
-            word = word.substr(1, word.length()-2).c_str();
+        std::size_t length {get_parameter(name, value, buf) ? value.size() : 0};
+        auto [ptr, ec] = std::to_chars(buf, buf + sizeof(buf), length);
+        out.append(buf, static_cast<std::size_t>(ptr - buf));
+        return true;
+    }
+
+    std::size_t name_end {1};
+    if(is_name_start(body.front())){
+        while(name_end < body.size() && is_name_char(body[name_end])){
+            ++name_end;
         }
     }
-    return true;
+    else if(!is_special(body.front())){
+        return bad_substitution(body);
+    }
+    std::string_view name {body.substr(0, name_end)};
+    std::string_view rest {body.substr(name_end)};
+
+    bool set {get_parameter(name, value, buf)};
+    if(rest.empty()){
+        append_value(out, value, double_quoted, glob);
+        return true;
+    }
+
+    bool colon {rest.front() == ':'};
+    if(colon){
+        rest.remove_prefix(1);
+    }
+    if(rest.empty()){
+        return bad_substitution(body);
+    }
+    char op {rest.front()};
+    std::string_view arg {rest.substr(1)};
+
+    // With a colon an empty value counts as unset
+    bool use_word {!set || (colon && value.empty())};
+
+    switch(op){
+        case '-':
+            if(use_word){
+                return expand_text(arg, out, double_quoted, glob);
+            }
+            append_value(out, value, double_quoted, glob);
+            return true;
+
+        case '=':{
+            if(!use_word){
+                append_value(out, value, double_quoted, glob);
+                return true;
+            }
+            if(!is_name_start(name.front())){
+                std::fprintf(stderr, "nsh: $%.*s: cannot assign in this way\n", static_cast<int>(name.size()), name.data());
+                return false;
+            }
+            std::size_t start {out.size()};
+            if(!expand_text(arg, out, double_quoted, false)){
+                return false;
+            }
+            Shell_Variables::get_instance().set(name, std::string_view(out).substr(start));
+            if(glob){
+                pattern_buffer.assign(out, start);
+                out.resize(start);
+                append_value(out, pattern_buffer, double_quoted, glob);
+            }
+            return true;
+        }
+
+        case '?':{
+            if(!use_word){
+                append_value(out, value, double_quoted, glob);
+                return true;
+            }
+            std::size_t start {out.size()};
+            if(!expand_text(arg, out, double_quoted, false)){
+                return false;
+            }
+            std::string_view message {std::string_view(out).substr(start)};
+            if(message.empty()){
+                message = set ? "parameter null" : "parameter not set";
+            }
+            std::fprintf(stderr, "nsh: %.*s: %.*s\n", static_cast<int>(name.size()), name.data(),
+                         static_cast<int>(message.size()), message.data());
+            out.resize(start);
+            return false;
+        }
+
+        case '+':
+            if(!use_word){
+                return expand_text(arg, out, double_quoted, glob);
+            }
+            return true;
+
+        case '#':
+        case '%':{
+            if(colon){
+                return bad_substitution(body);
+            }
+            bool longest {!arg.empty() && arg.front() == op};
+            if(longest){
+                arg.remove_prefix(1);
+            }
+            // The pattern is expanded at the end of out, nested expansions
+            // may use the scratch buffers themselves
+            std::size_t start {out.size()};
+            if(!expand_text(arg, out, double_quoted, true)){
+                return false;
+            }
+            pattern_buffer.assign(out, start);
+            out.resize(start);
+            // The pattern may have assigned a variable, so look the value up again
+            if(get_parameter(name, value, buf)){
+                remove_pattern(value, op == '%', longest, out, double_quoted, glob);
+            }
+            return true;
+        }
+
+        default:
+            return bad_substitution(body);
+    }
+}
+
+
+// Expands the parameter at word[pos], which is a '$', and returns the
+// position after it, or npos after an error
+inline std::size_t expand_parameter(std::string_view word, std::size_t pos, std::string& out, bool double_quoted, bool glob){
+
+    if(pos + 1 >= word.size()){
+        out.push_back(chdollar);
+        return pos + 1;
+    }
+
+    char next {word[pos + 1]};
+    if(next == '{'){
+        std::size_t close {lex::find_closing_brace(word.data(), pos + 1, word.size())};
+        if(close >= word.size()){
+            bad_substitution(word.substr(pos + 2));
+            return std::string_view::npos;
+        }
+        if(!expand_braces(word.substr(pos + 2, close - pos - 2), out, double_quoted, glob)){
+            return std::string_view::npos;
+        }
+        return close + 1;
+    }
+
+    char buf[24];
+    std::string_view value;
+    if(is_name_start(next)){
+        std::size_t end {pos + 2};
+        while(end < word.size() && is_name_char(word[end])){
+            ++end;
+        }
+        if(get_parameter(word.substr(pos + 1, end - pos - 1), value, buf)){
+            append_value(out, value, double_quoted, glob);
+        }
+        return end;
+    }
+    if(is_special(next)){
+        if(get_parameter(word.substr(pos + 1, 1), value, buf)){
+            append_value(out, value, double_quoted, glob);
+        }
+        return pos + 2;
+    }
+
+    // $'...' and $"..." are plain quotes, a lone $ stays
+    if(!double_quoted && (next == single_quote || next == double_quote)){
+        return pos + 1;
+    }
+    out.push_back(chdollar);
+    return pos + 1;
 }
 
 
-void expand_cmdline_args(std::vector<std::string>& cmdargs){
-    for(auto& args : cmdargs){
-        expand_word(args);
+inline bool expand_text(std::string_view word, std::string& out, bool double_quoted, bool glob){
+
+    // Inside double quotes only $ and \ are special, and a backslash only
+    // escapes $, `, " and itself, so "a\tb" keeps it for echo -e and printf
+    std::string_view specials {double_quoted ? std::string_view("\\$") : std::string_view("\\$\'\"")};
+
+    std::size_t pos {0};
+    while(pos < word.size()){
+
+        std::size_t next {word.find_first_of(specials, pos)};
+        if(next == std::string_view::npos){
+            append_literal(out, word.substr(pos), glob && double_quoted);
+            return true;
+        }
+        append_literal(out, word.substr(pos, next - pos), glob && double_quoted);
+        pos = next;
+
+        switch(word[pos]){
+            case '\\':
+                if(pos + 1 >= word.size()){
+                    append_literal(out, "\\", glob);
+                    return true;
+                }
+                if(double_quoted && std::string_view("$`\"\\").find(word[pos + 1]) == std::string_view::npos){
+                    append_literal(out, "\\", glob);
+                }
+                append_literal(out, word.substr(pos + 1, 1), glob);
+                pos += 2;
+                break;
+
+            case single_quote:{
+                std::size_t close {word.find(single_quote, pos + 1)};
+                if(close == std::string_view::npos){
+                    close = word.size();
+                }
+                append_literal(out, word.substr(pos + 1, close - pos - 1), glob);
+                pos = close + 1;
+                break;
+            }
+
+            case double_quote:{
+                std::size_t close {lex::find_closing_quote(word.data(), pos, word.size())};
+                if(!expand_text(word.substr(pos + 1, close - pos - 1), out, true, glob)){
+                    return false;
+                }
+                pos = close + 1;
+                break;
+            }
+
+            default:
+                pos = expand_parameter(word, pos, out, double_quoted, glob);
+                if(pos == std::string_view::npos){
+                    return false;
+                }
+                break;
+        }
     }
+    return true;
 }
 
 
-void expand_cmdline_envs(std::map<std::string, std::string>& envs){
-    for(auto& [name, value] : envs){
-        expand_word(value);
+// Expands word into out, returns false after an expansion error. Expansion
+// only allocates when out or a variable's value has to grow.
+inline bool expand_word(std::string_view word, std::string& out, bool glob = false){
+
+    out.clear();
+    return expand_text(word, out, false, glob);
+}
+
+// Expands the body of a here-document. Its quotes are plain characters, so
+// unlike in double quotes a backslash only escapes $, `, itself and a
+// newline, which it removes; \" keeps the backslash.
+inline bool expand_heredoc(std::string_view body, std::string& out){
+
+    out.clear();
+    std::size_t pos {0};
+    while(pos < body.size()){
+
+        std::size_t next {body.find_first_of("\\$", pos)};
+        if(next == std::string_view::npos){
+            out.append(body.substr(pos));
+            return true;
+        }
+        out.append(body.substr(pos, next - pos));
+        pos = next;
+
+        if(body[pos] == chdollar){
+            pos = expand_parameter(body, pos, out, true, false);
+            if(pos == std::string_view::npos){
+                return false;
+            }
+        }
+        else if(pos + 1 < body.size() && std::string_view("$`\\\n").find(body[pos + 1]) != std::string_view::npos){
+            if(body[pos + 1] != '\n'){
+                out.push_back(body[pos + 1]);
+            }
+            pos += 2;
+        }
+        else{
+            out.push_back('\\');
+            ++pos;
+        }
     }
+    return true;
 }
 
 }
@@ -4,227 +4,785 @@
 #include <csignal>
 #include <cassert>
 #include <iterator>
+#include <vector>
+#include <charconv>
 
 #include <unistd.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 
-#include "tokens.hpp"
 #include "parse_input.hpp"
+#include "input_reader.hpp"
 #include "word_control.hpp"
 #include "system_envs.hpp"
+#include "shell_variables.hpp"
 #include "execution/command_execution.hpp"
+#include "execution/command_hash.hpp"
+#include "execution/phase_stats.hpp"
+#include "execution/pipe_config.hpp"
+#include "execution/history.hpp"
+#include "execution/startup_trace.hpp"
+
+// Without a terminal SIGINT keeps its default action, start_loop() blocks
+// it and reads it from a signalfd
+Command_Execution::Command_Execution(bool _interactive) :
+    prompt_fmt {"nsh/:"},
+    prompt_suffix {" => "},
+    interactive {_interactive},
+    control_unit {_interactive}
+    {
+        rlimit limit {};
+        if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur <= static_cast<rlim_t>(procsub_top)){
+            procsub_top = static_cast<int>(limit.rlim_cur) - 1;
+        }
+    }
 
-sig_atomic_t Command_Execution::sigflag = 0;
 
-#define set_signal(sigobj, signum, action, handler_type) \
-    sigobj.handler_type = action; \
-    sigaction(signum, &sa_intr, nullptr);
+// `cat file | cmd` with a plain cat and a cmd whose stdin is not redirected
+// runs as `cmd < file`, which saves a process and a copy through a pipe.
+// Only a regular file the shell can open is read that way: for a missing
+// one cat reports the error and cmd still runs on empty input.
+bool Command_Execution::is_useless_cat(const parse::line_ast& ast, const parse::pipeline_node& pipeline, std::string& wordbuf){
 
+    if(pipeline.command_count < 2){
+        return false;
+    }
 
+    const parse::command_node& cat {ast.commands[pipeline.first_command]};
+    if(cat.word_count != 2 || cat.assign_count != 0 || cat.redirect_count != 0){
+        return false;
+    }
+    const parse::word_node& name {ast.words[cat.first_word]};
+    const parse::word_node& file {ast.words[cat.first_word + 1]};
+    if(name.flags != 0 || (file.flags & lex::word_procsub) || ast.text(name) != "cat" || ast.text(file).starts_with("-") || wexpand::has_glob(ast.text(file))){
+        return false;
+    }
 
-Command_Execution::Command_Execution() :
-    prompt_fmt {"nsh/:"},
-    prompt_suffix {" => "}  {
-        sigflag = 0;
+    const parse::command_node& next {ast.commands[pipeline.first_command + 1]};
+    for(std::uint32_t r{0}; r < next.redirect_count; ++r){
+        if(ast.redirects[next.first_redirect + r].fd == STDIN_FILENO){
+            return false;
+        }
+    }
 
-        // Setup signal handling
-        struct sigaction sa_intr;
+    // ${name?word} would report its error twice, here and when cat runs
+    std::string_view path {ast.text(file)};
+    if(file.flags != 0){
+        if(path.find('?') != std::string_view::npos || !wexpand::expand_word(path, wordbuf)){
+            return false;
+        }
+        path = wordbuf;
+    }
+    int fd {open(std::string(path).c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC)};
+    if(fd < 0){
+        return false;
+    }
+    struct stat info {};
+    bool regular {fstat(fd, &info) == 0 && S_ISREG(info.st_mode)};
+    close(fd);
+    return regular;
+}
 
-        sa_intr.sa_flags = SA_SIGINFO;
-        if(sigemptyset(&sa_intr.sa_mask) < 0){
-            std::puts("Coudn't start shell... unknown error occurred\n");
-            std::exit(EXIT_FAILURE);
+// `env [-i] [-u NAME]... [--] NAME=value... cmd args` runs cmd with that
+// environment as its own, the same as `NAME=value... cmd args` after -i and
+// -u, which saves starting env. Returns the index of cmd's word, 0 if the
+// command is not such an env.
+std::uint32_t Command_Execution::get_env_command_word(const parse::line_ast& ast, const parse::command_node& cmd){
+
+    const parse::word_node& name {ast.words[cmd.first_word]};
+    if(name.flags != 0 || ast.text(name) != "env"){
+        return 0;
+    }
+
+    // Options come first, the first assignment or -- ends them
+    bool options {true};
+    for(std::uint32_t w{1}; w < cmd.word_count; ++w){
+        const parse::word_node& word {ast.words[cmd.first_word + w]};
+        std::string_view text {ast.text(word)};
+        if(options && text.starts_with("-") && word.flags == 0){
+            if(text == "-i" || text == "-"){
+                continue;
+            }
+            if(text == "-u" && w + 1 < cmd.word_count && ast.words[cmd.first_word + w + 1].flags == 0){
+                ++w;
+                continue;
+            }
+            if(text == "--"){
+                options = false;
+                continue;
+            }
+            return 0;
+        }
+        std::string_view::size_type dlim {text.find('=')};
+        if(dlim == std::string_view::npos){
+            return (options && text.starts_with("-")) ? 0 : w;
+        }
+        if(!environment::is_valid_name(text.substr(0, dlim))){
+            return 0;
+        }
+        options = false;
+    }
+    return 0;
+}
+
+bool Command_Execution::add_redirect(const parse::line_ast& ast, const parse::redirect_node& redirect, job_arena& arena, std::string& wordbuf){
+
+    std::string_view target {ast.text(redirect.target)};
+
+    // < <(cmd) and > >(cmd) connect the fd to the pipe itself
+    if(redirect.target.flags & lex::word_procsub){
+        bool input {redirect.type == parse::redirect_type::input};
+        bool output {redirect.type == parse::redirect_type::output || redirect.type == parse::redirect_type::append};
+        if(input == target.starts_with('<') && output == target.starts_with('>')){
+            add_procsub(target, redirect.fd, arena);
+            return true;
         }
+        std::fprintf(stderr, "nsh: %.*s: ambiguous redirect\n", static_cast<int>(target.size()), target.data());
+        return false;
+    }
 
-        set_signal(sa_intr, SIGINT, handle_interrupt, sa_sigaction);
+    // The body is expanded here once, unless the delimiter is quoted, and
+    // the command reads the result from a sealed memfd
+    if(redirect.type == parse::redirect_type::heredoc){
+        std::string_view body {ast.text(redirect.body)};
+        if(redirect.body.flags != 0){
+            heredoc_text.clear();
+            for(std::size_t pos{0}; pos < body.size(); ){
+                pos = body.find_first_not_of('\t', pos);
+                if(pos == std::string_view::npos){
+                    break;
+                }
+                std::size_t eol {body.find('\n', pos)};
+                std::size_t end {(eol == std::string_view::npos) ? body.size() : eol + 1};
+                heredoc_text.append(body.substr(pos, end - pos));
+                pos = end;
+            }
+            body = heredoc_text;
+        }
+        if(redirect.target.flags & (lex::word_quoted | lex::word_escaped)){
+            arena.add_redirect(redirect_kind::heredoc, redirect.fd, body);
+            return true;
+        }
+        if(!wexpand::expand_heredoc(body, wordbuf)){
+            return false;
+        }
+        arena.add_redirect(redirect_kind::heredoc, redirect.fd, wordbuf);
+        return true;
     }
 
-void Command_Execution::handle_interrupt(int signum, [[maybe_unused]] siginfo_t *info, [[maybe_unused]] void *context){
+    if(redirect.target.flags != 0){
+        if(!wexpand::expand_word(target, wordbuf)){
+            return false;
+        }
+        target = wordbuf;
+    }
 
-    switch(signum){
-        case SIGINT:
-            sigflag = SIGINT;
-            break;
-        default:
+    switch(redirect.type){
+        case parse::redirect_type::input:
+            arena.add_redirect(redirect_kind::read, redirect.fd, target);
+            return true;
+        case parse::redirect_type::output:
+            arena.add_redirect(redirect_kind::write, redirect.fd, target);
+            return true;
+        case parse::redirect_type::append:
+            arena.add_redirect(redirect_kind::append, redirect.fd, target);
+            return true;
+        case parse::redirect_type::duplicate:{
+            int source_fd {0};
+            auto [ptr, ec] = std::from_chars(target.data(), target.data() + target.size(), source_fd);
+            if(ec == std::errc{} && ptr == target.data() + target.size()){
+                arena.add_duplicate(redirect.fd, source_fd);
+                return true;
+            }
+            // >&file is &>file
+            if(redirect.fd != STDOUT_FILENO){
+                std::fprintf(stderr, "nsh: %.*s: ambiguous redirect\n", static_cast<int>(target.size()), target.data());
+                return false;
+            }
+            [[fallthrough]];
+        }
+        case parse::redirect_type::output_both:
+            arena.add_redirect(redirect_kind::write, STDOUT_FILENO, target);
+            arena.add_duplicate(STDERR_FILENO, STDOUT_FILENO);
+            return true;
+        case parse::redirect_type::append_both:
+            arena.add_redirect(redirect_kind::append, STDOUT_FILENO, target);
+            arena.add_duplicate(STDERR_FILENO, STDOUT_FILENO);
+            return true;
+        case parse::redirect_type::herestring:
+            if(target.data() != wordbuf.data()){
+                wordbuf.assign(target);
+            }
+            wordbuf.push_back('\n');
+            arena.add_redirect(redirect_kind::heredoc, redirect.fd, wordbuf);
+            return true;
+        case parse::redirect_type::heredoc:
             break;
     }
+    return false;
 }
 
+// Adds the expanded word as an argument, or the pathnames it matches if it
+// is a pattern that matches any. Unquoted parameter values are patterns too.
+bool Command_Execution::add_word(const parse::line_ast& ast, const parse::word_node& word, job_arena& arena){
 
-void Command_Execution::start_loop(){
+    std::string_view text {ast.text(word)};
 
+    // The command opens /dev/fd/N, the pipe is its fd N
+    if(word.flags & lex::word_procsub){
+        if(procsub_fd <= STDERR_FILENO + 7){
+            std::fprintf(stderr, "nsh: too many process substitutions in one command\n");
+            return false;
+        }
+        add_procsub(text, procsub_fd, arena);
+        wordbuf.assign("/dev/fd/");
+        wordbuf.append(std::to_string(procsub_fd--));
+        arena.add_arg(wordbuf);
+        return true;
+    }
 
-    environment::init_env();
+    bool glob {(word.flags & lex::word_dollar) || wexpand::has_glob(text)};
+    if(word.flags == 0 && !glob){
+        arena.add_arg(text);
+        return true;
+    }
 
-    char cwdbuf[1024];
+    if(!wexpand::expand_word(text, wordbuf, glob)){
+        return false;
+    }
+    if(!glob){
+        arena.add_arg(wordbuf);
+        return true;
+    }
+    if(!Path_Glob::is_pattern(wordbuf)){
+        Path_Glob::remove_escapes(wordbuf);
+        arena.add_arg(wordbuf);
+        return true;
+    }
 
-    std::string line;
-    std::list<std::string> proc_tokens;
-    std::list<std::string> cmd_tokens;
-    std::list<std::list<std::string>> line_tokens;
-    std::list<std::list<command_info>> proc_list;
-    std::list<std::list<command_info>> bgjob_list;
-    std::list<std::list<command_info>> fgjob_list;
+    glob_matches.clear();
+    if(path_glob.expand(wordbuf, glob_matches) == 0){
+        Path_Glob::remove_escapes(wordbuf);
+        arena.add_arg(wordbuf);
+        return true;
+    }
+    for(const std::string& match : glob_matches){
+        arena.add_arg(match);
+    }
+    return true;
+}
 
-    std::string shell_cwd(1024, '\0'), shell_prompt;
+void Command_Execution::add_procsub(std::string_view text, int fd, job_arena& arena){
+
+    // Built once the pipeline's own commands are in the arena
+    arena.add_procsub(fd, text.starts_with('>'));
+    procsub_texts.push_back(text.substr(2, text.size() - 3));
+}
 
-    //char filepath[1024];
+bool Command_Execution::add_command(const parse::line_ast& ast, const parse::command_node& cmd, job_arena& arena, std::string& wordbuf, const parse::redirect_node* input){
 
-    if(getcwd(shell_cwd.data(), 1024) != nullptr){
-        shell_prompt = prompt_fmt + shell_cwd.c_str() + prompt_suffix;
+    if(cmd.word_count == 0){
+        std::fprintf(stderr, "nsh: assignments without a command only work outside a pipeline\n");
+        return false;
     }
-    else{
-        std::terminate();
+
+    arena.begin_command();
+    procsub_fd = procsub_top;
+
+    if(input && !add_redirect(ast, *input, arena, wordbuf)){
+        return false;
     }
 
-    while(true){
+    std::uint32_t env_word {get_env_command_word(ast, cmd)};
 
-        std::cin.clear();
+    // Assignments in front of a printing env become its operands
+    bool env_operands {env_word == 0 && cmd.assign_count > 0 && ast.words[cmd.first_word].flags == 0 &&
+                       ast.text(ast.words[cmd.first_word]) == "env"};
+    if(env_operands){
+        arena.add_arg("env");
+    }
 
-        if(getcwd(cwdbuf, 1024) == nullptr){
-            std::perror("Error");
+    for(std::uint32_t a{0}; a < cmd.assign_count; ++a){
+        const parse::word_node& assign {ast.assigns[cmd.first_assign + a]};
+        std::string_view text {ast.text(assign)};
+        std::string_view::size_type dlim {text.find('=')};
+        std::string_view value {text.substr(dlim + 1)};
+        if(assign.flags != 0){
+            if(!wexpand::expand_word(value, wordbuf)){
+                return false;
+            }
+            value = wordbuf;
         }
 
-        if(shell_cwd != cwdbuf){
-            shell_cwd.assign(cwdbuf, std::strlen(cwdbuf));
+        // NSH_PIPE_SIZE=<size> sizes this pipeline's pipes and is not exported
+        if(text.substr(0, dlim) == "NSH_PIPE_SIZE"){
+            std::size_t size {0};
+            if(!Pipe_Config::parse_size(value, size) || size > UINT32_MAX){
+                std::fprintf(stderr, "nsh: NSH_PIPE_SIZE: invalid size %.*s\n", static_cast<int>(value.size()), value.data());
+                return false;
+            }
+            arena.set_pipe_size(static_cast<std::uint32_t>(size));
+            continue;
+        }
 
-            std::string home_dir {environment::get_env("HOME")};
+        if(env_operands){
+            if(assign.flags == 0){
+                arena.add_arg(text);
+                continue;
+            }
+            wordbuf.insert(0, text.substr(0, dlim + 1));
+            arena.add_arg(wordbuf);
+            continue;
+        }
+        arena.add_env(text.substr(0, dlim), value);
+    }
 
-            auto pos = shell_cwd.find(home_dir.c_str(), 0, home_dir.length());
-            if(pos != std::string::npos){
-                shell_cwd.replace(pos, home_dir.length(), "~");
+    for(std::uint32_t w{1}; w < env_word; ++w){
+        const parse::word_node& assign {ast.words[cmd.first_word + w]};
+        std::string_view text {ast.text(assign)};
+        if(text == "-i" || text == "-"){
+            arena.clear_env();
+            continue;
+        }
+        if(text == "-u"){
+            arena.add_unset(ast.text(ast.words[cmd.first_word + ++w]));
+            continue;
+        }
+        if(text == "--"){
+            continue;
+        }
+        std::string_view::size_type dlim {text.find('=')};
+        std::string_view value {text.substr(dlim + 1)};
+        if(assign.flags != 0){
+            if(!wexpand::expand_word(value, wordbuf)){
+                return false;
             }
+            value = wordbuf;
+        }
+        arena.add_env(text.substr(0, dlim), value);
+    }
 
-            shell_prompt = prompt_fmt + shell_cwd + prompt_suffix;
+    for(std::uint32_t w{env_operands ? 1u : env_word}; w < cmd.word_count; ++w){
+        if(!add_word(ast, ast.words[cmd.first_word + w], arena)){
+            return false;
         }
+    }
 
-        std::printf("%s", shell_prompt.c_str());
-        std::getline(std::cin, line);
+    for(std::uint32_t r{0}; r < cmd.redirect_count; ++r){
+        if(!add_redirect(ast, ast.redirects[cmd.first_redirect + r], arena, wordbuf)){
+            return false;
+        }
+    }
 
-        if(sigflag == SIGINT){
-            int saved_errno = errno;
-            errno = 0;
-            if(!control_unit.kill_foreground_job()){
-                if(errno != 0){
-                    std::perror("Error");
-                }
-                sigflag = 0;
+    arena.end_command();
+    return true;
+}
+
+bool Command_Execution::build_job_arena(const parse::line_ast& ast, const parse::pipeline_node& pipeline, job_arena& arena, std::string& wordbuf){
+
+    arena.reset();
+    procsub_texts.clear();
+
+    arena.begin_job(pipeline.background);
+    if(pipeline.timed){
+        arena.set_timing(pipeline.time_json ? time_format::json : time_format::text);
+    }
+
+    bool skip_cat {is_useless_cat(ast, pipeline, wordbuf)};
+
+    for(std::uint32_t index{skip_cat ? 1u : 0u}; index < pipeline.command_count; ++index){
+
+        const parse::command_node& cmd {ast.commands[pipeline.first_command + index]};
+
+        if(skip_cat && index == 1){
+            const parse::command_node& cat {ast.commands[pipeline.first_command]};
+            parse::redirect_node input {parse::redirect_type::input, STDIN_FILENO, ast.words[cat.first_word + 1]};
+            if(!add_command(ast, cmd, arena, wordbuf, &input)){
+                return false;
+            }
+        }
+        else if(!add_command(ast, cmd, arena, wordbuf, nullptr)){
+            return false;
+        }
+    }
+
+    // The pipelines of process substitutions are parsed now, their text is
+    // part of the line. One inside another queues up behind it.
+    for(std::size_t index{0}; index < procsub_texts.size(); ++index){
+
+        if(!parse::parse_line(procsub_texts[index], procsub_tokens, procsub_ast, parse_err)){
+            parse::print_error(parse_err);
+            return false;
+        }
+        if(procsub_ast.pipelines.size() != 1 || procsub_ast.pipelines.front().background || procsub_ast.pipelines.front().timed){
+            std::fprintf(stderr, "nsh: process substitution takes one pipeline: %.*s\n",
+                         static_cast<int>(procsub_texts[index].size()), procsub_texts[index].data());
+            return false;
+        }
+
+        const parse::pipeline_node& inner {procsub_ast.pipelines.front()};
+        arena.begin_procsub(static_cast<std::uint32_t>(index));
+        for(std::uint32_t c{0}; c < inner.command_count; ++c){
+            if(!add_command(procsub_ast, procsub_ast.commands[inner.first_command + c], arena, wordbuf, nullptr)){
+                return false;
+            }
+        }
+        arena.end_procsub();
+    }
+
+    arena.finalize();
+    return true;
+}
+
+// A command of only assignments sets shell variables, left to right
+bool Command_Execution::assign_variables(const parse::line_ast& ast, const parse::command_node& cmd, std::string& wordbuf){
+
+    Shell_Variables& variables {Shell_Variables::get_instance()};
+
+    for(std::uint32_t a{0}; a < cmd.assign_count; ++a){
+        const parse::word_node& assign {ast.assigns[cmd.first_assign + a]};
+        std::string_view text {ast.text(assign)};
+        std::string_view::size_type dlim {text.find('=')};
+        std::string_view value {text.substr(dlim + 1)};
+        if(assign.flags != 0){
+            if(!wexpand::expand_word(value, wordbuf)){
+                return false;
             }
-            errno = saved_errno;
+            value = wordbuf;
         }
+        if(!variables.set(text.substr(0, dlim), value)){
+            std::perror("Error");
+            return false;
+        }
+    }
+    return true;
+}
+
+
+int Command_Execution::execute_line(std::string_view line){
+
+    bool parsed {false};
+    {
+        phase_timer timer {shell_phase::parse};
+        parsed = parse::parse_line(line, line_tokens, ast, parse_err);
+    }
+    if(!parsed){
+        parse::print_error(parse_err);
+        control_unit.wait_for_background_jobs();
+        return 2;
+    }
+
+    if(ast.pipelines.empty()){
+        control_unit.wait_for_background_jobs();
+        return control_unit.get_last_status();
+    }
+
+    // $PATH directories are revalidated at most once per line
+    Command_Hash::get_instance().new_epoch();
+    Shell_Variables& variables {Shell_Variables::get_instance()};
+
+    // Each pipeline is expanded right before it runs, so it sees the
+    // variables set by the ones before it
+    for(const parse::pipeline_node& pipeline : ast.pipelines){
+
+        variables.set_last_status(control_unit.get_last_status());
 
-        if(line.empty()){
-            control_unit.wait_for_background_jobs();
+        const parse::command_node& first {ast.commands[pipeline.first_command]};
+        if(pipeline.command_count == 1 && first.word_count == 0 && !pipeline.timed){
+            bool assigned {false};
+            {
+                phase_timer timer {shell_phase::expand};
+                assigned = assign_variables(ast, first, wordbuf);
+            }
+            control_unit.set_last_status(assigned ? 0 : 1);
             continue;
         }
 
+        // Directory listings are only reused within a pipeline, the one
+        // before may have created or removed files
+        path_glob.clear_cache();
 
-        if(!tokenize_job(line, proc_tokens)){
-            std::puts("Unknown error occured while parsing line");
+        bool built {false};
+        {
+            phase_timer timer {shell_phase::expand};
+            built = build_job_arena(ast, pipeline, arena, wordbuf);
+        }
+        if(!built){
+            control_unit.set_last_status(1);
             continue;
         }
+        control_unit.run_jobs(arena);
+    }
+    control_unit.finish_line();
+    variables.set_last_status(control_unit.get_last_status());
 
+    control_unit.wait_for_background_jobs();
+    return control_unit.get_last_status();
+}
 
-        for(std::string& cmds : proc_tokens){
-            tokenize_cmd(cmds, cmd_tokens);
-            line_tokens.push_back(cmd_tokens);
-            cmd_tokens.clear();
+
+// True if the line starts here-documents, whose bodies are on the lines
+// that follow
+bool Command_Execution::begin_heredocs(std::string_view line){
+
+    open_heredocs.clear();
+    closed_heredocs = 0;
+    if(line.find("<<") == std::string_view::npos || lex::tokenize_line(line, line_tokens) != lex::lex_error::unterminated_heredoc){
+        return false;
+    }
+    for(std::size_t index{0}; index + 1 < line_tokens.size(); ++index){
+        lex::token_type type {line_tokens[index].type};
+        if((type == lex::token_type::dless || type == lex::token_type::dlessdash) && line_tokens[index + 1].type == lex::token_type::word){
+            const lex::token& delim {line_tokens[index + 1]};
+            open_heredocs.push_back({std::string{line.substr(delim.offset, delim.length)}, type == lex::token_type::dlessdash});
         }
+    }
+    heredoc_input.assign(line);
+    return true;
+}
 
+// Adds a line to the input and returns true once it was the delimiter of
+// the last here-document. The lines are checked one at a time, so a long
+// body is not scanned again for every line of it.
+bool Command_Execution::add_heredoc_line(std::string_view line){
 
-        int bg_job_start_index {-1};
-        int index {0};
-        if(std::all_of(line_tokens.begin(), line_tokens.end(), [](std::list<std::string>& elem){
-                auto last_token = elem.back();
-                //auto start_pos = last_token.find_first_not_of(' ');
-                auto end_pos = last_token.find_last_not_of(' ');
-                if(last_token[end_pos] == '&'){
-                    return true;
-                }
-                return false;
-            })){
+    heredoc_input.push_back('\n');
+    heredoc_input.append(line);
+
+    const heredoc_delimiter& delim {open_heredocs[closed_heredocs]};
+    if(delim.strip_tabs){
+        line.remove_prefix(std::min(line.find_first_not_of('\t'), line.size()));
+    }
+    if(lex::is_delimiter(line, delim.text)){
+        ++closed_heredocs;
+    }
+    return closed_heredocs == open_heredocs.size();
+}
 
-            bg_job_start_index = 0;
+
+int Command_Execution::run_script(int fd){
+
+    // Large reads keep the number of syscalls per command low for batch input
+    Input_Reader reader {fd, 1 << 20};
+    std::string_view line;
+    int status {0};
+
+    while(true){
+        Input_Reader::read_status read_status {reader.read_line(line)};
+        if(read_status == Input_Reader::read_status::eof){
+            break;
         }
-        else{
-            for(const std::list<std::string>& elem : line_tokens){
-                auto last_token = elem.back();
-                auto end_pos = last_token.find_last_not_of(' ');
-                if(last_token[end_pos] == '&'){
-                    bg_job_start_index = index;
-                    break;
+        if(read_status == Input_Reader::read_status::interrupted){
+            continue;
+        }
+        if(begin_heredocs(line)){
+            bool complete {false};
+            while(!complete && (read_status = reader.read_line(line)) != Input_Reader::read_status::eof){
+                if(read_status != Input_Reader::read_status::interrupted){
+                    complete = add_heredoc_line(line);
                 }
-                index++;
             }
+            line = heredoc_input;
         }
+        status = execute_line(line);
+    }
+    std::fflush(stdout);
+    return status;
+}
 
 
-        if(bg_job_start_index > -1){
-            bool check_bg_job_syntax = std::all_of(std::next(line_tokens.begin(), bg_job_start_index), line_tokens.end(), [](const std::list<std::string>& elem){
-                auto last_token = elem.back();
-                auto end_pos = last_token.find_last_not_of(' ');
-                if(last_token[end_pos] == '&'){
-                    return true;
-                }
-                return false;
-            });
+// Reads and runs command lines. Returns at the end of input.
+loop_task Command_Execution::read_commands(Line_Editor& editor, int signal_fd){
 
-            if(!check_bg_job_syntax){
-                std::printf("Parse error\n"); // Be clear
-                line_tokens.clear();
-                proc_tokens.clear();
-                cmd_tokens.clear();
-                continue;
+    char cwdbuf[1024];
+
+    std::string shell_cwd(1024, '\0'), shell_prompt;
+    bool first_prompt {true};
+
+    {
+        startup_step step {"prompt"};
+        if(getcwd(shell_cwd.data(), 1024) != nullptr){
+            shell_prompt = prompt_fmt + shell_cwd.c_str() + prompt_suffix;
+        }
+        else{
+            std::terminate();
+        }
+    }
+
+    while(true){
+
+        if(getcwd(cwdbuf, 1024) == nullptr){
+            std::perror("Error");
+        }
+
+        if(shell_cwd != cwdbuf){
+            shell_cwd.assign(cwdbuf, std::strlen(cwdbuf));
+
+            std::string home_dir {environment::get_env("HOME")};
+
+            auto pos = shell_cwd.find(home_dir.c_str(), 0, home_dir.length());
+            if(pos != std::string::npos){
+                shell_cwd.replace(pos, home_dir.length(), "~");
             }
+
+            shell_prompt = prompt_fmt + shell_cwd + prompt_suffix;
         }
 
-        if(bg_job_start_index >= 0){
-            std::for_each(std::next(line_tokens.begin(), bg_job_start_index), line_tokens.end(), [](std::list<std::string>& cmd){
-                std::string& last_token {cmd.back()};
-                auto pos = last_token.find_last_of('&');
-                last_token.erase(pos - 1);
-            });
+        // A SIGINT that came while the last line ran was meant for it
+        signalfd_siginfo siginfo[8];
+        while(read(signal_fd, siginfo, sizeof(siginfo)) > 0){}
+
+        if(!control_unit.get_job_reports().empty()){
+            editor.print_above(control_unit.get_job_reports());
+            control_unit.clear_job_reports();
+        }
+        // The executable index catches up in the background while the
+        // line is typed
+        completion.refresh();
+        if(first_prompt){
+            Startup_Trace::get_instance().mark("first prompt");
+            first_prompt = false;
+            startup_step step {"terminal"};
+            editor.start_line(shell_prompt);
+        }
+        else{
+            editor.start_line(shell_prompt);
         }
 
-        for(std::list<std::string>& chain_key : line_tokens){
-            proc_list.push_back(parse::extract_commands(chain_key));
+        // Keys are handled as they arrive, a pasted text may already hold
+        // the next line
+        Line_Editor::read_status read_status {editor.process_pending()};
+        while(read_status != Line_Editor::read_status::line && read_status != Line_Editor::read_status::eof){
+            if(read_status == Line_Editor::read_status::interrupted){
+                control_unit.set_last_status(130);
+            }
+            co_await event_loop.ready(STDIN_FILENO);
+            read_status = editor.read_input();
         }
+        editor.restore_mode();
 
-        std::for_each(proc_list.begin(), proc_list.end(), [](std::list<command_info>& list){
-            std::for_each(list.begin(), list.end(), [](command_info& cinfo){
-                wexpand::expand_cmdline_envs(cinfo.envs);
-                wexpand::expand_cmdline_args(cinfo.cmdargs);
-            });
-        });
+        if(read_status == Line_Editor::read_status::eof){
+            std::printf("\n");
+            break;
+        }
 
-        if(bg_job_start_index < 0){
-            std::move(proc_list.begin(), proc_list.end(), std::back_inserter(fgjob_list));
+        const std::string& line {editor.get_line()};
+        History::get_instance().add(line);
+
+        // The bodies of here-documents are typed at a continuation prompt,
+        // Ctrl-C drops the whole command
+        if(begin_heredocs(line)){
+            bool complete {false};
+            while(!complete){
+                editor.start_line("> ");
+                read_status = editor.process_pending();
+                while(read_status == Line_Editor::read_status::editing){
+                    co_await event_loop.ready(STDIN_FILENO);
+                    read_status = editor.read_input();
+                }
+                editor.restore_mode();
+                if(read_status != Line_Editor::read_status::line){
+                    break;
+                }
+                complete = add_heredoc_line(editor.get_line());
+            }
+            if(read_status == Line_Editor::read_status::interrupted){
+                control_unit.set_last_status(130);
+                continue;
+            }
+            if(read_status == Line_Editor::read_status::eof){
+                std::printf("\n");
+            }
+            execute_line(heredoc_input);
+            continue;
         }
-        else if(bg_job_start_index == 0){
-            std::move(proc_list.begin(), proc_list.end(), std::back_inserter(bgjob_list));
+        execute_line(line);
+    }
+}
+
+// Background jobs are reported as soon as they finish or stop, above the
+// line being edited
+loop_task Command_Execution::watch_children(Line_Editor& editor){
+
+    while(true){
+        co_await event_loop.ready(control_unit.get_child_event_fd());
+        // A job is reported once, it leaves the table with its report
+        control_unit.wait_for_background_jobs();
+        if(!control_unit.get_job_reports().empty()){
+            editor.print_above(control_unit.get_job_reports());
+            control_unit.clear_job_reports();
         }
-        else if(bg_job_start_index > 0){
-            std::move(proc_list.begin(), std::next(proc_list.begin(), bg_job_start_index), std::back_inserter(fgjob_list));
-            std::move(std::next(proc_list.begin(), bg_job_start_index), proc_list.end(), std::back_inserter(bgjob_list));
+    }
+}
+
+loop_task Command_Execution::watch_signals(Line_Editor& editor, int signal_fd){
+
+    signalfd_siginfo siginfo[8];
+    while(true){
+        co_await event_loop.ready(signal_fd);
+
+        ssize_t count {0};
+        while((count = read(signal_fd, siginfo, sizeof(siginfo))) > 0){
+            for(std::size_t i{0}; i < static_cast<std::size_t>(count) / sizeof(signalfd_siginfo); ++i){
+                if(siginfo[i].ssi_signo == SIGINT){
+                    editor.cancel_line();
+                    control_unit.set_last_status(130);
+                }
+                else if(siginfo[i].ssi_signo == SIGWINCH){
+                    editor.resize();
+                }
+            }
         }
+    }
+}
 
-        control_unit.submit_foreground_jobs(fgjob_list);
-        control_unit.submit_background_jobs(std::move(bgjob_list));
+void Command_Execution::start_loop(){
 
 
-        control_unit.run_foreground_jobs();
-        control_unit.run_background_jobs();
+    environment::init_env();
 
+    // The terminal, child state changes and signals are each served by a
+    // coroutine on the event loop, so a finished job is reported while a
+    // line is typed. SIGINT and SIGWINCH come in through a signalfd; at the
+    // prompt the terminal is in raw mode and Ctrl-C arrives as a key.
+    sigset_t signal_set;
+    int signal_fd {-1};
+    {
+        startup_step step {"signals"};
+        sigemptyset(&signal_set);
+        sigaddset(&signal_set, SIGINT);
+        sigaddset(&signal_set, SIGWINCH);
+        if(sigprocmask(SIG_BLOCK, &signal_set, nullptr) < 0){
+            std::perror("Error");
+            std::exit(EXIT_FAILURE);
+        }
+        signal_fd = signalfd(-1, &signal_set, SFD_NONBLOCK | SFD_CLOEXEC);
+        if(signal_fd < 0){
+            std::perror("Error");
+            std::exit(EXIT_FAILURE);
+        }
+    }
 
-        proc_tokens.clear();
-        cmd_tokens.clear();
-        line_tokens.clear();
-        proc_list.clear();
+    Line_Editor editor {STDIN_FILENO, STDOUT_FILENO};
+    editor.set_completion([this](std::string_view line, std::size_t cursor, completion_result& result){
+        completion.complete(line, cursor, control_unit.get_jobs(), result);
+    });
 
-        fgjob_list.clear();
-        bgjob_list.clear();
+    {
+        loop_task children {watch_children(editor)};
+        loop_task signals {watch_signals(editor, signal_fd)};
+        loop_task commands {read_commands(editor, signal_fd)};
 
-        control_unit.wait_for_background_jobs();
+        while(!commands.done()){
+            event_loop.poll(-1);
+        }
+
+        event_loop.unwatch(STDIN_FILENO);
+        event_loop.unwatch(control_unit.get_child_event_fd());
+        event_loop.unwatch(signal_fd);
     }
+    close(signal_fd);
 }
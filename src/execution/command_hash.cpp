@@ -0,0 +1,265 @@
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <cstdlib>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "execution/command_hash.hpp"
+#include "execution/startup_trace.hpp"
+
+
+Command_Hash::~Command_Hash(){
+    save_index();
+}
+
+void Command_Hash::refresh_path(){
+
+    if(!index_opened){
+        open_index();
+    }
+    const char* path_env_val {getenv("PATH")};
+
+    if(path_set == (path_env_val != nullptr) && (!path_env_val || path_value == path_env_val)){
+        return;
+    }
+
+    // $PATH changed since the last lookup, every cached entry is stale
+    startup_step step {"PATH"};
+    table.clear();
+    path_dirs.clear();
+    path_set = (path_env_val != nullptr);
+    path_value = (path_env_val) ? path_env_val : "";
+
+    std::string_view path_view {path_value};
+    while(!path_view.empty()){
+        std::string_view::size_type pos {path_view.find(':')};
+        std::string_view dir {path_view.substr(0, pos)};
+        if(!dir.empty()){
+            path_dirs.push_back(path_dir{std::string(dir), {}, false, 0});
+        }
+        if(pos == std::string_view::npos){
+            break;
+        }
+        path_view.remove_prefix(pos + 1);
+    }
+    index_usable = index.is_open() && path_set && index.get_path() == path_value && index.get_dirs().size() == path_dirs.size();
+}
+
+// $NSH_EXEC_INDEX names the index file, set and empty it turns the index off
+void Command_Hash::open_index(){
+
+    index_opened = true;
+    owner_pid = getpid();
+
+    if(const char* file {getenv("NSH_EXEC_INDEX")}){
+        index_file = file;
+    }
+    else if(const char* home {getenv("HOME")}){
+        index_file = std::string(home) + "/.nsh_exec_index";
+    }
+    if(!index_file.empty()){
+        startup_step step {"exec index"};
+        index.open(index_file);
+    }
+}
+
+bool Command_Hash::check_dir(std::size_t index){
+
+    path_dir& dir {path_dirs[index]};
+    if(dir.checked_epoch == epoch){
+        return true;
+    }
+
+    struct stat st;
+    bool exists {stat(dir.name.c_str(), &st) == 0};
+    bool first_check {dir.checked_epoch == 0};
+    bool unchanged {exists == dir.exists &&
+                    (!exists || (st.st_mtim.tv_sec == dir.mtime.tv_sec && st.st_mtim.tv_nsec == dir.mtime.tv_nsec))};
+
+    dir.checked_epoch = epoch;
+    dir.exists = exists;
+    if(exists){
+        dir.mtime = st.st_mtim;
+    }
+
+    if(first_check || unchanged){
+        return true;
+    }
+
+    // Entries resolved from this directory or a later one may now be removed or shadowed
+    std::erase_if(table, [index](const auto& item){
+        return item.second.dir_index >= index;
+    });
+    return false;
+}
+
+bool Command_Hash::validate(const hash_entry& entry){
+
+    for(std::size_t index{0}; index <= entry.dir_index; ++index){
+        if(!check_dir(index)){
+            return false;
+        }
+    }
+    return true;
+}
+
+Command_Hash::hash_entry* Command_Hash::resolve(std::string_view cmd){
+
+    struct stat st;
+    for(std::size_t index{0}; index < path_dirs.size(); ++index){
+        check_dir(index);
+        if(!path_dirs[index].exists){
+            continue;
+        }
+
+        pathbuf.assign(path_dirs[index].name);
+        if(pathbuf.back() != '/'){
+            pathbuf.push_back('/');
+        }
+        pathbuf.append(cmd);
+
+        if(stat(pathbuf.c_str(), &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))){
+            auto [iter, inserted] = table.insert_or_assign(std::string(cmd), hash_entry{pathbuf, index, 0});
+            index_dirty = true;
+            return &iter->second;
+        }
+    }
+    return nullptr;
+}
+
+bool Command_Hash::index_entry_valid(const Exec_Index::index_entry& entry){
+
+    std::span<const Exec_Index::index_dir> dirs {index.get_dirs()};
+    if(entry.dir_index >= path_dirs.size()){
+        return false;
+    }
+    for(std::size_t i{0}; i <= entry.dir_index; ++i){
+        check_dir(i);
+        const path_dir& dir {path_dirs[i]};
+        if(dir.exists != (dirs[i].exists != 0) ||
+           (dir.exists && (dir.mtime.tv_sec != dirs[i].mtime_sec || dir.mtime.tv_nsec != dirs[i].mtime_nsec))){
+            return false;
+        }
+    }
+    const path_dir& dir {path_dirs[entry.dir_index]};
+    return dir.exists && dir.mtime.tv_sec == entry.mtime_sec && dir.mtime.tv_nsec == entry.mtime_nsec;
+}
+
+// A name the index has is taken from it without looking at the file
+Command_Hash::hash_entry* Command_Hash::load_from_index(std::string_view cmd){
+
+    if(!index_usable){
+        return nullptr;
+    }
+    const Exec_Index::index_entry* entry {index.find(cmd)};
+    if(!entry){
+        return nullptr;
+    }
+    if(!index_entry_valid(*entry)){
+        index_dirty = true;
+        return nullptr;
+    }
+
+    pathbuf.assign(path_dirs[entry->dir_index].name);
+    if(pathbuf.back() != '/'){
+        pathbuf.push_back('/');
+    }
+    pathbuf.append(cmd);
+    auto [iter, inserted] = table.insert_or_assign(std::string(cmd), hash_entry{pathbuf, entry->dir_index, 0});
+    return &iter->second;
+}
+
+const char* Command_Hash::lookup(const char* cmd){
+
+    std::string_view name {cmd};
+    if(name.empty()){
+        return nullptr;
+    }
+    if(name.find('/') != std::string_view::npos){
+        return cmd;
+    }
+
+    refresh_path();
+
+    auto iter = table.find(name);
+    if(iter != table.end() && validate(iter->second)){
+        iter->second.hits++;
+        return iter->second.path.c_str();
+    }
+
+    hash_entry* entry {load_from_index(name)};
+    if(!entry){
+        entry = resolve(name);
+    }
+    if(!entry){
+        return nullptr;
+    }
+    entry->hits++;
+    return entry->path.c_str();
+}
+
+bool Command_Hash::seed(std::string_view cmd){
+
+    if(cmd.empty() || cmd.find('/') != std::string_view::npos){
+        return false;
+    }
+    refresh_path();
+    return resolve(cmd) != nullptr;
+}
+
+// The index is forgotten too, the one written at exit holds what was
+// resolved after this
+void Command_Hash::clear() noexcept{
+    table.clear();
+    index_usable = false;
+    index_dirty = true;
+}
+
+void Command_Hash::new_epoch() noexcept{
+    epoch++;
+}
+
+// Writes the index back if this session learnt anything it did not have.
+// Every directory is checked first, which drops the stale table entries,
+// so the rest and the old entries that are still valid can go in as they
+// are. A child that exits without exec must not write it.
+void Command_Hash::save_index(){
+
+    if(!index_dirty || index_file.empty() || !path_set || getpid() != owner_pid){
+        return;
+    }
+    index_dirty = false;
+
+    new_epoch();
+    for(std::size_t i{0}; i < path_dirs.size(); ++i){
+        check_dir(i);
+    }
+
+    std::vector<Exec_Index::entry_state> entries;
+    entries.reserve(table.size() + index.get_entries().size());
+    for(const auto& [name, entry] : table){
+        if(path_dirs[entry.dir_index].exists){
+            entries.push_back({name, static_cast<std::uint32_t>(entry.dir_index), path_dirs[entry.dir_index].mtime});
+        }
+    }
+    if(index_usable){
+        for(const Exec_Index::index_entry& entry : index.get_entries()){
+            std::string_view name {index.get_name(entry)};
+            if(!name.empty() && !table.contains(name) && index_entry_valid(entry)){
+                entries.push_back({name, entry.dir_index, path_dirs[entry.dir_index].mtime});
+            }
+        }
+    }
+    std::sort(entries.begin(), entries.end(), [](const Exec_Index::entry_state& a, const Exec_Index::entry_state& b){
+        return a.name < b.name;
+    });
+
+    std::vector<Exec_Index::dir_state> dirs;
+    dirs.reserve(path_dirs.size());
+    for(const path_dir& dir : path_dirs){
+        dirs.push_back({dir.name, dir.mtime, dir.exists});
+    }
+    Exec_Index::write(index_file, path_value, dirs, entries);
+}
@@ -0,0 +1,547 @@
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "execution/completion.hpp"
+#include "builtin.hpp"
+#include "shell_variables.hpp"
+
+
+namespace{
+
+std::size_t common_length(std::string_view first, std::string_view second) noexcept {
+    std::size_t length {0};
+    while(length < first.size() && length < second.size() && first[length] == second[length]){
+        ++length;
+    }
+    return length;
+}
+
+void add_candidate(std::string_view name, std::string& common, completion_result& result){
+    if(++result.match_count == 1){
+        common.assign(name);
+    }
+    else{
+        common.resize(common_length(common, name));
+    }
+    result.candidates.emplace_back(name);
+}
+
+bool is_name_char(char c) noexcept {
+    return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+bool is_assignment(std::string_view word) noexcept {
+    std::size_t equals {word.find('=')};
+    return equals != std::string_view::npos && equals > 0 &&
+           std::all_of(word.begin(), word.begin() + static_cast<std::ptrdiff_t>(equals), is_name_char);
+}
+
+}
+
+
+Completion::exec_trie::exec_trie(const std::vector<std::string_view>& sorted_names){
+
+    nodes.push_back({0, 0, 0, '\0', false});
+
+    // path[d] is the node of the previous name at depth d and last_child[d]
+    // its newest child, which sorted input only ever appends to
+    std::vector<std::uint32_t> path {0};
+    std::vector<std::uint32_t> last_child {0};
+    std::string_view previous;
+
+    for(std::string_view name : sorted_names){
+        std::size_t common {common_length(previous, name)};
+        path.resize(common + 1);
+        last_child.resize(common + 1);
+
+        for(std::size_t depth{common}; depth < name.size(); ++depth){
+            std::uint32_t index {static_cast<std::uint32_t>(nodes.size())};
+            nodes.push_back({0, 0, 0, name[depth], false});
+            if(last_child[depth] != 0){
+                nodes[last_child[depth]].next_sibling = index;
+            }
+            else{
+                nodes[path[depth]].first_child = index;
+            }
+            last_child[depth] = index;
+            path.push_back(index);
+            last_child.push_back(0);
+        }
+
+        nodes[path[name.size()]].terminal = true;
+        for(std::uint32_t node : path){
+            nodes[node].count++;
+        }
+        previous = name;
+    }
+}
+
+std::uint32_t Completion::exec_trie::find(std::string_view prefix) const noexcept{
+
+    std::uint32_t node {0};
+    for(char c : prefix){
+        std::uint32_t child {nodes[node].first_child};
+        while(child != 0 && nodes[child].label != c){
+            child = nodes[child].next_sibling;
+        }
+        if(child == 0){
+            return npos;
+        }
+        node = child;
+    }
+    return node;
+}
+
+bool Completion::exec_trie::contains(std::string_view name) const noexcept{
+    std::uint32_t node {find(name)};
+    return node != npos && nodes[node].terminal;
+}
+
+void Completion::exec_trie::append_common(std::uint32_t node, std::string& text) const{
+
+    while(!nodes[node].terminal){
+        std::uint32_t child {nodes[node].first_child};
+        if(child == 0 || nodes[child].next_sibling != 0){
+            break;
+        }
+        text.push_back(nodes[child].label);
+        node = child;
+    }
+}
+
+void Completion::exec_trie::collect(std::uint32_t node, std::string& text, std::vector<std::string>& names, std::size_t limit) const{
+
+    if(names.size() >= limit){
+        return;
+    }
+    if(nodes[node].terminal){
+        names.push_back(text);
+    }
+    for(std::uint32_t child {nodes[node].first_child}; child != 0 && names.size() < limit; child = nodes[child].next_sibling){
+        text.push_back(nodes[child].label);
+        collect(child, text, names, limit);
+        text.pop_back();
+    }
+}
+
+
+Completion::~Completion(){
+
+    if(worker.joinable()){
+        {
+            std::lock_guard<std::mutex> guard {lock};
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+}
+
+void Completion::refresh(){
+
+    // $PATH is read here, the worker never touches the environment
+    const char* path {getenv("PATH")};
+    {
+        std::lock_guard<std::mutex> guard {lock};
+        requested_path = path ? path : "";
+        check_requested = true;
+    }
+    if(!worker.joinable()){
+        startup_step step {"completion"};
+        worker = std::thread(&Completion::run_worker, this);
+    }
+    else{
+        wake.notify_one();
+    }
+}
+
+void Completion::wait_for_index(){
+
+    std::unique_lock<std::mutex> guard {lock};
+    idle.wait(guard, [this](){
+        return !check_requested && !checking;
+    });
+}
+
+void Completion::run_worker(){
+
+    std::unique_lock<std::mutex> guard {lock};
+    while(true){
+        wake.wait(guard, [this](){
+            return check_requested || stopping;
+        });
+        if(stopping){
+            return;
+        }
+        std::string path {requested_path};
+        check_requested = false;
+        checking = true;
+        guard.unlock();
+
+        check_dirs(path);
+
+        guard.lock();
+        checking = false;
+        idle.notify_all();
+    }
+}
+
+void Completion::check_dirs(const std::string& path){
+
+    bool changed {false};
+
+    // Directories that stay in $PATH keep their names
+    if(path != worker_path){
+        worker_path = path;
+        std::vector<path_dir> previous {std::move(dirs)};
+        dirs.clear();
+
+        std::string_view path_view {worker_path};
+        while(!path_view.empty()){
+            std::string_view::size_type pos {path_view.find(':')};
+            std::string_view name {path_view.substr(0, pos)};
+            if(!name.empty()){
+                auto iter = std::find_if(previous.begin(), previous.end(), [name](const path_dir& dir){
+                    return dir.name == name;
+                });
+                if(iter != previous.end()){
+                    dirs.push_back(std::move(*iter));
+                    iter->name.clear();
+                }
+                else{
+                    dirs.push_back(path_dir{std::string(name), {}, false, {}});
+                }
+            }
+            if(pos == std::string_view::npos){
+                break;
+            }
+            path_view.remove_prefix(pos + 1);
+        }
+        changed = true;
+    }
+
+    for(path_dir& dir : dirs){
+        struct stat info;
+        bool exists {stat(dir.name.c_str(), &info) == 0 && S_ISDIR(info.st_mode)};
+        if(exists == dir.exists && (!exists || (info.st_mtim.tv_sec == dir.mtime.tv_sec && info.st_mtim.tv_nsec == dir.mtime.tv_nsec))){
+            continue;
+        }
+        dir.exists = exists;
+        if(exists){
+            dir.mtime = info.st_mtim;
+        }
+        dir.names.clear();
+        if(exists){
+            scan_dir(dir);
+        }
+        // Completions use the directories scanned so far while the rest
+        // of a new $PATH is read
+        publish();
+        changed = false;
+    }
+
+    if(changed){
+        publish();
+    }
+}
+
+void Completion::scan_dir(path_dir& dir){
+
+    DIR* stream {opendir(dir.name.c_str())};
+    if(!stream){
+        return;
+    }
+    int fd {dirfd(stream)};
+    while(const dirent* entry = readdir(stream)){
+        if(entry->d_type == DT_DIR){
+            continue;
+        }
+        // Same test as Command_Hash, symbolic links are followed
+        struct stat info;
+        if(fstatat(fd, entry->d_name, &info, 0) == 0 && S_ISREG(info.st_mode) && (info.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))){
+            dir.names.emplace_back(entry->d_name);
+        }
+    }
+    closedir(stream);
+}
+
+void Completion::publish(){
+
+    std::vector<std::string_view> names;
+    for(const path_dir& dir : dirs){
+        names.insert(names.end(), dir.names.begin(), dir.names.end());
+    }
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+
+    auto next {std::make_shared<const exec_trie>(names)};
+    std::lock_guard<std::mutex> guard {lock};
+    trie = std::move(next);
+}
+
+
+void Completion::escape(std::string_view text, std::string& out){
+
+    for(char c : text){
+        if(std::strchr(" \t\n\\'\"$`&;|<>()*?[]#!", c)){
+            out.push_back('\\');
+        }
+        out.push_back(c);
+    }
+}
+
+// A word that is complete gets a blank, a directory does not
+void Completion::finish(std::string_view text, bool complete, completion_result& result){
+
+    escape(text, result.replacement);
+    if(complete && !text.ends_with('/')){
+        result.replacement.push_back(' ');
+    }
+}
+
+void Completion::complete_command(std::string_view word, completion_result& result){
+
+    std::shared_ptr<const exec_trie> current;
+    {
+        std::lock_guard<std::mutex> guard {lock};
+        current = trie;
+    }
+
+    std::string common;
+    if(current){
+        std::uint32_t node {current->find(word)};
+        if(node != exec_trie::npos){
+            result.match_count = current->get_count(node);
+            common.assign(word);
+            current->append_common(node, common);
+            std::string text {word};
+            current->collect(node, text, result.candidates, max_candidates);
+        }
+    }
+
+    const auto& builtins {Builtin_Table::get_instance().get_table()};
+    for(auto iter = builtins.lower_bound(word); iter != builtins.end() && iter->first.starts_with(word); ++iter){
+        if(!current || !current->contains(iter->first)){
+            add_candidate(iter->first, common, result);
+        }
+    }
+
+    if(result.match_count > 0){
+        finish(common, result.match_count == 1, result);
+    }
+}
+
+void Completion::complete_file(std::string_view word, bool dirs_only, completion_result& result){
+
+    std::size_t slash {word.rfind('/')};
+    std::string_view dir_part {slash == std::string_view::npos ? std::string_view{} : word.substr(0, slash + 1)};
+    std::string_view base {word.substr(dir_part.size())};
+
+    DIR* stream {opendir(dir_part.empty() ? "." : std::string(dir_part).c_str())};
+    if(!stream){
+        return;
+    }
+    int fd {dirfd(stream)};
+
+    std::string common;
+    std::string name;
+    while(const dirent* entry = readdir(stream)){
+        name.assign(entry->d_name);
+        if(name == "." || name == ".." || !name.starts_with(base) || (name.front() == '.' && !base.starts_with('.'))){
+            continue;
+        }
+        struct stat info;
+        bool is_dir {entry->d_type == DT_DIR ||
+                     ((entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) && fstatat(fd, entry->d_name, &info, 0) == 0 && S_ISDIR(info.st_mode))};
+        if(dirs_only && !is_dir){
+            continue;
+        }
+        if(is_dir){
+            name.push_back('/');
+        }
+        add_candidate(name, common, result);
+    }
+    closedir(stream);
+
+    if(result.match_count > 0){
+        std::string text {dir_part};
+        text += common;
+        finish(text, result.match_count == 1, result);
+    }
+}
+
+void Completion::complete_variable(std::string_view word, completion_result& result){
+
+    std::size_t dollar {word.rfind('$')};
+    std::string_view name {word.substr(dollar + 1)};
+    bool braced {name.starts_with('{')};
+    if(braced){
+        name.remove_prefix(1);
+    }
+
+    std::string common;
+    for(const Shell_Variables::variable& var : Shell_Variables::get_instance().get_variables()){
+        if(var.set && var.name.starts_with(name)){
+            add_candidate(var.name, common, result);
+        }
+    }
+    if(result.match_count == 0){
+        return;
+    }
+
+    escape(word.substr(0, dollar), result.replacement);
+    result.replacement += braced ? "${" : "$";
+    result.replacement += common;
+    if(braced && result.match_count == 1){
+        result.replacement.push_back('}');
+    }
+}
+
+void Completion::complete_job(std::string_view word, const Job_Table& jobs, completion_result& result){
+
+    std::string common;
+    std::string spec;
+    jobs.for_each([&](const background_execution_unit& unit){
+        spec = '%' + std::to_string(unit.job_id);
+        if(spec.starts_with(word)){
+            add_candidate(spec, common, result);
+        }
+    });
+    if(result.match_count > 0){
+        finish(common, result.match_count == 1, result);
+    }
+}
+
+
+void Completion::complete(std::string_view line, std::size_t cursor, const Job_Table& jobs, completion_result& result){
+
+    line = line.substr(0, cursor);
+    result.replacement.clear();
+    result.candidates.clear();
+    result.match_count = 0;
+
+    // Find the word before the cursor with its quotes removed, and whether
+    // it names a command, a redirection target or an argument of which command
+    std::string word;
+    std::string command;
+    std::size_t word_start {0};
+    bool in_word {false};
+    bool command_position {true};
+    bool redirect {false};
+    char quote {'\0'};
+
+    auto end_word = [&](){
+        if(!in_word){
+            return;
+        }
+        in_word = false;
+        if(redirect){
+            redirect = false;
+        }
+        else if(command_position && !is_assignment(word) && word != "time"){
+            command = word;
+            command_position = false;
+        }
+    };
+
+    for(std::size_t pos{0}; pos < line.size(); ++pos){
+        char c {line[pos]};
+        if(quote == '\''){
+            if(c == '\''){
+                quote = '\0';
+            }
+            else{
+                word.push_back(c);
+            }
+            continue;
+        }
+        if(quote == '"'){
+            if(c == '"'){
+                quote = '\0';
+            }
+            else if(c == '\\' && pos + 1 < line.size() && std::strchr("$`\"\\", line[pos + 1])){
+                word.push_back(line[++pos]);
+            }
+            else{
+                word.push_back(c);
+            }
+            continue;
+        }
+
+        if(c == ' ' || c == '\t'){
+            end_word();
+            continue;
+        }
+        if(c == '<' || c == '>' || (c == '&' && pos + 1 < line.size() && line[pos + 1] == '>')){
+            end_word();
+            redirect = true;
+            while(pos + 1 < line.size() && (line[pos + 1] == '>' || line[pos + 1] == '&')){
+                ++pos;
+            }
+            continue;
+        }
+        if(c == ';' || c == '|' || c == '&'){
+            end_word();
+            command_position = true;
+            redirect = false;
+            command.clear();
+            continue;
+        }
+
+        if(!in_word){
+            in_word = true;
+            word_start = pos;
+            word.clear();
+        }
+        if(c == '\\'){
+            if(pos + 1 < line.size()){
+                word.push_back(line[++pos]);
+            }
+        }
+        else if(c == '\'' || c == '"'){
+            quote = c;
+        }
+        else{
+            word.push_back(c);
+        }
+    }
+    if(!in_word){
+        word.clear();
+        word_start = line.size();
+    }
+    result.word_start = word_start;
+
+    std::size_t dollar {word.rfind('$')};
+    bool variable {dollar != std::string::npos};
+    if(variable){
+        std::string_view name {std::string_view(word).substr(dollar + 1)};
+        if(name.starts_with('{')){
+            name.remove_prefix(1);
+        }
+        variable = std::all_of(name.begin(), name.end(), is_name_char);
+    }
+
+    if(variable){
+        complete_variable(word, result);
+    }
+    else if(!command_position && (command == "fg" || command == "bg" || command == "kill") && (word.empty() || word.starts_with('%'))){
+        complete_job(word, jobs, result);
+    }
+    else if(command_position && !redirect && word.find('/') == std::string::npos){
+        complete_command(word, result);
+    }
+    else{
+        complete_file(word, !command_position && !redirect && command == "cd", result);
+    }
+
+    std::sort(result.candidates.begin(), result.candidates.end());
+    result.candidates.erase(std::unique(result.candidates.begin(), result.candidates.end()), result.candidates.end());
+    if(result.candidates.size() > max_candidates){
+        result.candidates.resize(max_candidates);
+    }
+}
@@ -0,0 +1,111 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <utility>
+
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "execution/event_loop.hpp"
+#include "execution/startup_trace.hpp"
+
+
+Event_Loop::~Event_Loop(){
+    if(epoll_fd >= 0){
+        close(epoll_fd);
+    }
+}
+
+// The epoll instance is made when the first fd is watched, a shell that
+// never waits on the loop does not pay for it
+void Event_Loop::open(){
+
+    if(epoll_fd >= 0){
+        return;
+    }
+    startup_step step {"event loop"};
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(epoll_fd < 0){
+        std::perror("Error");
+        std::exit(EXIT_FAILURE);
+    }
+}
+
+bool Event_Loop::watch(int fd, std::uint32_t events, handler_type handler){
+
+    open();
+    auto entry {std::make_unique<watch_entry>()};
+    entry->handler = std::move(handler);
+
+    epoll_event event {};
+    event.events = events;
+    event.data.ptr = entry.get();
+
+    int op {entries.contains(fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD};
+    if(epoll_ctl(epoll_fd, op, fd, &event) < 0){
+        return false;
+    }
+    entries.insert_or_assign(fd, std::move(entry));
+    return true;
+}
+
+// Awaited fds are one shot, so a fd nobody waits for does not keep waking
+// the loop up
+bool Event_Loop::arm(int fd, std::uint32_t events, std::coroutine_handle<> handle, std::uint32_t* ready_events){
+
+    open();
+    auto [iter, added] = entries.try_emplace(fd);
+    if(added){
+        iter->second = std::make_unique<watch_entry>();
+    }
+    watch_entry& entry {*iter->second};
+
+    epoll_event event {};
+    event.events = events | EPOLLONESHOT;
+    event.data.ptr = &entry;
+
+    if(epoll_ctl(epoll_fd, added ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &event) < 0){
+        if(added){
+            entries.erase(iter);
+        }
+        return false;
+    }
+    entry.waiting = handle;
+    entry.ready_events = ready_events;
+    return true;
+}
+
+void Event_Loop::unwatch(int fd){
+
+    if(entries.erase(fd) > 0){
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    }
+}
+
+int Event_Loop::poll(int timeout_ms){
+
+    if(epoll_fd < 0){
+        return 0;
+    }
+    epoll_event events[max_events];
+
+    int ready = epoll_wait(epoll_fd, events, max_events, timeout_ms);
+    if(ready < 0){
+        if(errno != EINTR){
+            std::perror("Error");
+        }
+        return 0;
+    }
+
+    for(int i{0}; i<ready; ++i){
+        watch_entry& entry {*static_cast<watch_entry*>(events[i].data.ptr)};
+        if(entry.waiting){
+            *entry.ready_events = events[i].events;
+            std::exchange(entry.waiting, {}).resume();
+        }
+        else if(entry.handler){
+            entry.handler(events[i].events);
+        }
+    }
+    return ready;
+}
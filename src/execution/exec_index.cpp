@@ -0,0 +1,154 @@
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "execution/exec_index.hpp"
+
+
+Exec_Index::~Exec_Index(){
+    close();
+}
+
+bool Exec_Index::open(const std::string& file){
+
+    close();
+
+    int fd {::open(file.c_str(), O_RDONLY | O_CLOEXEC)};
+    if(fd < 0){
+        return false;
+    }
+    struct stat info;
+    if(fstat(fd, &info) < 0 || static_cast<std::size_t>(info.st_size) < sizeof(index_header)){
+        ::close(fd);
+        return false;
+    }
+    std::size_t size {static_cast<std::size_t>(info.st_size)};
+    void* addr {mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)};
+    ::close(fd);
+    if(addr == MAP_FAILED){
+        return false;
+    }
+    map = static_cast<const char*>(addr);
+    map_size = size;
+
+    // The sections have to add up to the file size exactly, names out of
+    // range read as empty and never match
+    const index_header& header {*reinterpret_cast<const index_header*>(map)};
+    std::uint64_t dirs_end {sizeof(index_header) + std::uint64_t{header.dir_count} * sizeof(index_dir)};
+    std::uint64_t entries_end {dirs_end + std::uint64_t{header.entry_count} * sizeof(index_entry)};
+    if(std::memcmp(header.magic, index_magic, sizeof(index_magic)) != 0 || entries_end + header.strings_size != size ||
+       std::uint64_t{header.path_offset} + header.path_length > header.strings_size){
+        close();
+        return false;
+    }
+
+    dirs = {reinterpret_cast<const index_dir*>(map + sizeof(index_header)), header.dir_count};
+    entries = {reinterpret_cast<const index_entry*>(map + dirs_end), header.entry_count};
+    strings = {map + entries_end, header.strings_size};
+    path_value = strings.substr(header.path_offset, header.path_length);
+    return true;
+}
+
+void Exec_Index::close() noexcept{
+
+    if(map){
+        munmap(const_cast<char*>(map), map_size);
+    }
+    map = nullptr;
+    map_size = 0;
+    dirs = {};
+    entries = {};
+    strings = {};
+    path_value = {};
+}
+
+std::string_view Exec_Index::get_name(std::uint32_t offset, std::uint32_t length) const noexcept{
+
+    if(offset > strings.size()){
+        return {};
+    }
+    return strings.substr(offset, length);
+}
+
+const Exec_Index::index_entry* Exec_Index::find(std::string_view name) const noexcept{
+
+    auto iter = std::lower_bound(entries.begin(), entries.end(), name, [this](const index_entry& entry, std::string_view key){
+        return get_name(entry) < key;
+    });
+    if(iter == entries.end() || get_name(*iter) != name){
+        return nullptr;
+    }
+    return &*iter;
+}
+
+
+bool Exec_Index::write(const std::string& file, std::string_view path, std::span<const dir_state> dir_states,
+                       std::span<const entry_state> entry_states){
+
+    std::string strings_out;
+    std::vector<index_dir> dirs_out;
+    std::vector<index_entry> entries_out;
+    dirs_out.reserve(dir_states.size());
+    entries_out.reserve(entry_states.size());
+
+    auto add_string = [&strings_out](std::string_view text){
+        std::uint32_t offset {static_cast<std::uint32_t>(strings_out.size())};
+        strings_out.append(text);
+        return offset;
+    };
+
+    index_header header {};
+    std::memcpy(header.magic, index_magic, sizeof(index_magic));
+    header.dir_count = static_cast<std::uint32_t>(dir_states.size());
+    header.entry_count = static_cast<std::uint32_t>(entry_states.size());
+    header.path_offset = add_string(path);
+    header.path_length = static_cast<std::uint32_t>(path.size());
+
+    for(const dir_state& dir : dir_states){
+        dirs_out.push_back({add_string(dir.name), static_cast<std::uint32_t>(dir.name.size()),
+                            dir.mtime.tv_sec, dir.mtime.tv_nsec, dir.exists, 0});
+    }
+    for(const entry_state& entry : entry_states){
+        entries_out.push_back({add_string(entry.name), static_cast<std::uint32_t>(entry.name.size()), entry.dir_index, 0,
+                               entry.mtime.tv_sec, entry.mtime.tv_nsec});
+    }
+    header.strings_size = static_cast<std::uint32_t>(strings_out.size());
+
+    // A session writing at the same time uses a name of its own, the last
+    // rename wins and both versions are whole
+    std::string temp {file + ".tmp." + std::to_string(getpid())};
+    int fd {::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)};
+    if(fd < 0){
+        return false;
+    }
+
+    auto write_all = [fd](const void* data, std::size_t size){
+        const char* bytes {static_cast<const char*>(data)};
+        for(std::size_t done{0}; done < size; ){
+            ssize_t count {::write(fd, bytes + done, size - done)};
+            if(count < 0){
+                if(errno == EINTR){
+                    continue;
+                }
+                return false;
+            }
+            done += static_cast<std::size_t>(count);
+        }
+        return true;
+    };
+
+    bool written {write_all(&header, sizeof(header)) &&
+                  write_all(dirs_out.data(), dirs_out.size() * sizeof(index_dir)) &&
+                  write_all(entries_out.data(), entries_out.size() * sizeof(index_entry)) &&
+                  write_all(strings_out.data(), strings_out.size())};
+    if(::close(fd) < 0 || !written || rename(temp.c_str(), file.c_str()) < 0){
+        unlink(temp.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,313 @@
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "execution/history.hpp"
+#include "execution/startup_trace.hpp"
+
+
+History::~History(){
+
+    if(data_map){
+        munmap(const_cast<char*>(data_map), data_size);
+    }
+    if(index_map){
+        munmap(const_cast<char*>(index_map), index_size);
+    }
+    if(data_fd >= 0){
+        close(data_fd);
+    }
+    if(index_fd >= 0){
+        close(index_fd);
+    }
+}
+
+bool History::open_files(){
+
+    if(opened){
+        return index_fd >= 0;
+    }
+    opened = true;
+    startup_step step {"history"};
+
+    const char* path {getenv("NSH_HISTFILE")};
+    if(path && *path){
+        data_path = path;
+    }
+    else if(const char* home {getenv("HOME")}){
+        data_path = std::string(home) + "/.nsh_history";
+    }
+    else{
+        return false;
+    }
+    index_path = data_path + ".idx";
+
+    data_fd = open(data_path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if(data_fd < 0){
+        std::fprintf(stderr, "nsh: history: %s: %s\n", data_path.c_str(), std::strerror(errno));
+        return false;
+    }
+    index_fd = open(index_path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if(index_fd < 0){
+        std::fprintf(stderr, "nsh: history: %s: %s\n", index_path.c_str(), std::strerror(errno));
+        close(data_fd);
+        data_fd = -1;
+        return false;
+    }
+
+    flock(data_fd, LOCK_EX);
+    index_tail();
+    flock(data_fd, LOCK_UN);
+    return true;
+}
+
+// Maps both files at their current size. The index is looked at first, so
+// every record in the mapped index refers to mapped history text.
+bool History::remap(){
+
+    auto map_file = [](int fd, const char*& map, std::size_t& size){
+        struct stat info;
+        if(fstat(fd, &info) < 0){
+            return false;
+        }
+        std::size_t new_size {static_cast<std::size_t>(info.st_size)};
+        if(new_size == size){
+            return true;
+        }
+        if(map){
+            munmap(const_cast<char*>(map), size);
+        }
+        map = nullptr;
+        size = 0;
+        if(new_size == 0){
+            return true;
+        }
+        void* addr {mmap(nullptr, new_size, PROT_READ, MAP_SHARED, fd, 0)};
+        if(addr == MAP_FAILED){
+            return false;
+        }
+        map = static_cast<const char*>(addr);
+        size = new_size;
+        return true;
+    };
+
+    return map_file(index_fd, index_map, index_size) && map_file(data_fd, data_map, data_size);
+}
+
+std::uint64_t History::make_record(std::uint64_t offset, std::string_view entry) noexcept{
+
+    std::uint64_t record {offset & offset_mask};
+    for(std::size_t i{0}; i < 3 && i < entry.size(); ++i){
+        record |= std::uint64_t{static_cast<unsigned char>(entry[i])} << (prefix_shift + 8 * i);
+    }
+    return record;
+}
+
+bool History::prefix_matches(std::uint64_t record, std::string_view prefix) noexcept{
+
+    for(std::size_t i{0}; i < 3 && i < prefix.size(); ++i){
+        if(((record >> (prefix_shift + 8 * i)) & 0xff) != static_cast<unsigned char>(prefix[i])){
+            return false;
+        }
+    }
+    return true;
+}
+
+std::uint64_t History::get_record(std::size_t index) const noexcept{
+
+    std::uint64_t record;
+    std::memcpy(&record, index_map + sizeof(index_magic) + index * sizeof(record), sizeof(record));
+    return record;
+}
+
+
+// Indexes entries that are in the history file but not in the index, which
+// is normally none. A missing or inconsistent index is rebuilt from scratch.
+// Called with the exclusive lock held.
+void History::index_tail(){
+
+    if(!remap()){
+        return;
+    }
+
+    bool valid {index_size >= sizeof(index_magic) && std::memcmp(index_map, index_magic, sizeof(index_magic)) == 0};
+    std::size_t records {valid ? (index_size - sizeof(index_magic)) / sizeof(std::uint64_t) : 0};
+    std::size_t start {0};
+
+    if(records > 0){
+        std::uint64_t offset {get_record(records - 1) & offset_mask};
+        valid = offset < data_size && (offset == 0 || data_map[offset - 1] == '\n');
+        if(valid){
+            const void* eol {std::memchr(data_map + offset, '\n', data_size - offset)};
+            start = eol ? static_cast<std::size_t>(static_cast<const char*>(eol) - data_map) + 1 : data_size;
+        }
+    }
+
+    if(!valid){
+        records = 0;
+        if(ftruncate(index_fd, 0) < 0 || write(index_fd, index_magic, sizeof(index_magic)) < 0){
+            return;
+        }
+    }
+    // A torn last record is dropped
+    else if(index_size != sizeof(index_magic) + records * sizeof(std::uint64_t)){
+        if(ftruncate(index_fd, static_cast<off_t>(sizeof(index_magic) + records * sizeof(std::uint64_t))) < 0){
+            return;
+        }
+    }
+
+    new_records.clear();
+    while(start < data_size){
+        const void* eol {std::memchr(data_map + start, '\n', data_size - start)};
+        if(!eol){
+            break;
+        }
+        std::size_t end {static_cast<std::size_t>(static_cast<const char*>(eol) - data_map)};
+        new_records.push_back(make_record(start, {data_map + start, end - start}));
+        start = end + 1;
+    }
+    if(!new_records.empty()){
+        std::size_t bytes {new_records.size() * sizeof(std::uint64_t)};
+        if(write(index_fd, new_records.data(), bytes) != static_cast<ssize_t>(bytes)){
+            std::perror("nsh: history");
+        }
+    }
+    remap();
+}
+
+
+bool History::add(std::string_view line){
+
+    if(line.find_first_not_of(" \t") == std::string_view::npos){
+        return true;
+    }
+    if(!open_files()){
+        return false;
+    }
+
+    entry_buffer.assign(line);
+    std::replace(entry_buffer.begin(), entry_buffer.end(), '\n', ' ');
+    entry_buffer.push_back('\n');
+
+    flock(data_fd, LOCK_EX);
+
+    // Under the lock the mapped size is where this entry goes
+    index_tail();
+    std::uint64_t offset {data_size};
+
+    bool written {true};
+    for(std::size_t done{0}; done < entry_buffer.size(); ){
+        ssize_t count {write(data_fd, entry_buffer.data() + done, entry_buffer.size() - done)};
+        if(count < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            std::perror("nsh: history");
+            written = false;
+            break;
+        }
+        done += static_cast<std::size_t>(count);
+    }
+    if(written){
+        std::uint64_t record {make_record(offset, std::string_view(entry_buffer).substr(0, entry_buffer.size() - 1))};
+        if(write(index_fd, &record, sizeof(record)) != sizeof(record)){
+            std::perror("nsh: history");
+        }
+    }
+
+    flock(data_fd, LOCK_UN);
+    return written;
+}
+
+std::size_t History::size(){
+
+    if(!open_files() || !remap() || index_size < sizeof(index_magic)){
+        return 0;
+    }
+    return (index_size - sizeof(index_magic)) / sizeof(std::uint64_t);
+}
+
+std::string_view History::get_entry(std::size_t index) const noexcept{
+
+    std::size_t count {(index_size < sizeof(index_magic)) ? 0 : (index_size - sizeof(index_magic)) / sizeof(std::uint64_t)};
+    if(index >= count){
+        return {};
+    }
+
+    std::size_t offset {get_record(index) & offset_mask};
+    if(offset >= data_size){
+        return {};
+    }
+    std::size_t end {data_size};
+    if(index + 1 < count){
+        end = std::min<std::size_t>(get_record(index + 1) & offset_mask, data_size) - 1;
+    }
+    else if(const void* eol {std::memchr(data_map + offset, '\n', data_size - offset)}){
+        end = static_cast<std::size_t>(static_cast<const char*>(eol) - data_map);
+    }
+    return {data_map + offset, end - std::min(end, offset)};
+}
+
+// Searches the mapped text backwards from the end of entry before - 1, a hit
+// is mapped to its entry by a binary search of the offsets in the index.
+// Entries hold no newline, so a hit never spans two of them. Called with the
+// entry it returned it goes on from there instead of from the end.
+std::size_t History::search_reverse(std::string_view text, std::size_t before) const noexcept{
+
+    std::size_t count {(index_size < sizeof(index_magic)) ? 0 : (index_size - sizeof(index_magic)) / sizeof(std::uint64_t)};
+    before = std::min(before, count);
+    if(before == 0 || text.find('\n') != std::string_view::npos){
+        return npos;
+    }
+    if(text.empty()){
+        return before - 1;
+    }
+
+    std::string_view last {get_entry(before - 1)};
+    std::size_t end {last.data() ? static_cast<std::size_t>(last.data() - data_map) + last.size() : data_size};
+
+    while(end >= text.size()){
+        const void* hit {memrchr(data_map, static_cast<unsigned char>(text.front()), end - text.size() + 1)};
+        if(!hit){
+            break;
+        }
+        std::size_t offset {static_cast<std::size_t>(static_cast<const char*>(hit) - data_map)};
+        if(std::memcmp(data_map + offset + 1, text.data() + 1, text.size() - 1) == 0){
+            std::size_t low {0};
+            std::size_t high {before};
+            while(high - low > 1){
+                std::size_t middle {low + (high - low) / 2};
+                if((get_record(middle) & offset_mask) <= offset){
+                    low = middle;
+                }
+                else{
+                    high = middle;
+                }
+            }
+            return low;
+        }
+        end = offset + text.size() - 1;
+    }
+    return npos;
+}
+
+std::size_t History::search_prefix(std::string_view prefix, std::size_t before) const noexcept{
+
+    std::size_t count {(index_size < sizeof(index_magic)) ? 0 : (index_size - sizeof(index_magic)) / sizeof(std::uint64_t)};
+    for(std::size_t index {std::min(before, count)}; index > 0; --index){
+        // The index holds the first bytes, most entries are rejected without
+        // touching the history text
+        if(prefix_matches(get_record(index - 1), prefix) && get_entry(index - 1).starts_with(prefix)){
+            return index - 1;
+        }
+    }
+    return npos;
+}
@@ -0,0 +1,228 @@
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "execution/job_cgroups.hpp"
+#include "execution/startup_trace.hpp"
+
+
+// Reads a small kernel file whole, false if it does not exist
+static bool read_file(const std::string& path, std::string& out){
+
+    int fd {open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+    if(fd < 0){
+        return false;
+    }
+    out.clear();
+    char chunk[4096];
+    ssize_t count {0};
+    while((count = read(fd, chunk, sizeof(chunk))) > 0){
+        out.append(chunk, static_cast<std::size_t>(count));
+    }
+    close(fd);
+    return count == 0;
+}
+
+static bool write_file(const std::string& path, std::string_view text){
+
+    int fd {open(path.c_str(), O_WRONLY | O_CLOEXEC)};
+    if(fd < 0){
+        return false;
+    }
+    bool written {write(fd, text.data(), text.size()) == static_cast<ssize_t>(text.size())};
+    close(fd);
+    return written;
+}
+
+static std::int64_t parse_count(std::string_view text){
+
+    std::int64_t value {-1};
+    std::from_chars(text.data(), text.data() + text.size(), value);
+    return value;
+}
+
+// The value of key in "key value" lines, or of key=value fields summed over
+// all lines, as in io.stat
+static std::int64_t find_count(std::string_view text, std::string_view key, bool sum){
+
+    std::int64_t total {-1};
+    for(std::size_t pos {text.find(key)}; pos != std::string_view::npos; pos = text.find(key, pos + 1)){
+        if(pos > 0 && text[pos - 1] != ' ' && text[pos - 1] != '\n'){
+            continue;
+        }
+        std::int64_t value {parse_count(text.substr(pos + key.size()))};
+        if(value < 0){
+            continue;
+        }
+        total = (total < 0 ? 0 : total) + value;
+        if(!sum){
+            break;
+        }
+    }
+    return total;
+}
+
+
+Job_Cgroups::Job_Cgroups() :
+    owner_pid{getpid()}
+    {
+        const char* mode_env {getenv("NSH_JOB_CGROUPS")};
+        if(!mode_env){
+            return;
+        }
+        std::string_view mode {mode_env};
+        if(mode == "on"){
+            enable();
+        }
+        else if(mode != "off"){
+            std::fprintf(stderr, "nsh: NSH_JOB_CGROUPS: expected on or off, not %s\n", mode_env);
+        }
+    }
+
+Job_Cgroups::~Job_Cgroups(){
+    if(created && getpid() == owner_pid){
+        remove_base();
+    }
+}
+
+// nsh.<pid> goes under the shell's own cgroup, found from the "0::" line of
+// /proc/self/cgroup and the mount point of the cgroup2 file system
+bool Job_Cgroups::create_base(){
+
+    startup_step step {"cgroups"};
+
+    std::string text;
+    std::string_view path;
+    if(read_file("/proc/self/cgroup", text)){
+        std::string_view lines {text};
+        std::size_t pos {lines.starts_with("0::") ? 0 : lines.find("\n0::")};
+        if(pos != std::string_view::npos){
+            path = lines.substr(pos + (lines[pos] == '\n' ? 4 : 3));
+            path = path.substr(0, path.find('\n'));
+        }
+    }
+
+    // mountinfo: id parent dev root mount-point options ... - type source ...
+    std::string mounts;
+    std::string_view mount;
+    if(!path.empty() && read_file("/proc/self/mountinfo", mounts)){
+        std::string_view lines {mounts};
+        std::size_t pos {lines.find(" - cgroup2 ")};
+        if(pos != std::string_view::npos){
+            std::size_t start {lines.rfind('\n', pos)};
+            std::string_view line {lines.substr(start == std::string_view::npos ? 0 : start + 1)};
+            for(int field{0}; field < 4; ++field){
+                std::size_t space {line.find(' ')};
+                line = (space == std::string_view::npos) ? std::string_view{} : line.substr(space + 1);
+            }
+            mount = line.substr(0, line.find(' '));
+        }
+    }
+    if(path.empty() || mount.empty()){
+        std::fprintf(stderr, "nsh: cgroups: no cgroup v2 hierarchy, jobs stay in the shell's cgroup\n");
+        return false;
+    }
+
+    base.assign(mount);
+    if(path != "/"){
+        base.append(path);
+    }
+    base.append("/nsh.").append(std::to_string(getpid()));
+    if(mkdir(base.c_str(), 0755) < 0 && errno != EEXIST){
+        std::fprintf(stderr, "nsh: cgroups: %s: %s, jobs stay in the shell's cgroup\n", base.c_str(), std::strerror(errno));
+        base.clear();
+        return false;
+    }
+
+    // Each controller on its own, one the parent does not hand down only
+    // leaves its files out of the leaves
+    for(std::string_view controller : {"+cpu", "+memory", "+io"}){
+        write_file(base + "/cgroup.subtree_control", controller);
+    }
+    created = true;
+    return true;
+}
+
+// Leaves of jobs that still run at exit are left behind with their processes
+void Job_Cgroups::remove_base(){
+
+    if(DIR* dir {opendir(base.c_str())}){
+        while(dirent* entry {readdir(dir)}){
+            if(std::strncmp(entry->d_name, "job.", 4) == 0){
+                remove_leaf(base + '/' + entry->d_name);
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(base.c_str());
+}
+
+bool Job_Cgroups::enable(){
+
+    if(!created && !create_base()){
+        return false;
+    }
+    enabled = true;
+    return true;
+}
+
+int Job_Cgroups::create_leaf(std::string& leaf){
+
+    if(!enabled){
+        return -1;
+    }
+    leaf.assign(base).append("/job.").append(std::to_string(next_leaf++));
+    if(mkdir(leaf.c_str(), 0755) < 0){
+        std::fprintf(stderr, "nsh: cgroups: %s: %s, turning job cgroups off\n", leaf.c_str(), std::strerror(errno));
+        leaf.clear();
+        enabled = false;
+        return -1;
+    }
+    int fd {open((leaf + "/cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC)};
+    if(fd < 0){
+        remove_leaf(leaf);
+        leaf.clear();
+    }
+    return fd;
+}
+
+void Job_Cgroups::remove_leaf(const std::string& leaf) noexcept{
+    rmdir(leaf.c_str());
+}
+
+// Runs in the forked child, "0" names the writer
+bool Job_Cgroups::move_process(int procs_fd) noexcept{
+    return write(procs_fd, "0", 1) == 1;
+}
+
+bool Job_Cgroups::kill_leaf(const std::string& leaf){
+    return write_file(leaf + "/cgroup.kill", "1");
+}
+
+void Job_Cgroups::read_usage(const std::string& leaf, cgroup_usage& usage){
+
+    usage = {};
+    std::string text;
+    if(read_file(leaf + "/cpu.stat", text)){
+        usage.cpu_usec = find_count(text, "usage_usec ", false);
+    }
+    if(read_file(leaf + "/memory.current", text)){
+        usage.memory_current = parse_count(text);
+    }
+    if(read_file(leaf + "/memory.peak", text)){
+        usage.memory_peak = parse_count(text);
+    }
+    // One line per device, an idle job has none
+    if(read_file(leaf + "/io.stat", text)){
+        usage.io_read_bytes = std::max<std::int64_t>(find_count(text, "rbytes=", true), 0);
+        usage.io_write_bytes = std::max<std::int64_t>(find_count(text, "wbytes=", true), 0);
+    }
+}
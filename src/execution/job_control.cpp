@@ -1,455 +1,1007 @@
-#include <list>
 #include <algorithm>
+#include <utility>
+#include <chrono>
+#include <limits>
 #include <string>
 #include <string_view>
 #include <cstring>
-#include <filesystem>
+#include <cstdlib>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
 
 #include "execution/job_control.hpp"
+#include "execution/command_hash.hpp"
+#include "execution/process_launcher.hpp"
+#include "execution/phase_stats.hpp"
+#include "execution/pipe_config.hpp"
+#include "execution/time_report.hpp"
+#include "execution/startup_trace.hpp"
+#include "execution/job_cgroups.hpp"
 #include "builtin.hpp"
+#include "system_envs.hpp"
 
 
-Job_Control::Job_Control() :
+Job_Control::Job_Control(bool _interactive) :
     bgjob_table(),
-    jobunit_id{0},
-    fg_joblist(),
-    bg_joblist(),
     shell_pid{getpid()},
-    shell_pgid{getpgrp()}
-    {
-        if(!tokenize_path_var(path_dirs)){
-            // Cannot proceed forward in case of error in getting directory list in $PATH
-            std::exit(EXIT_FAILURE);
+    shell_pgid{getpgrp()},
+    interactive{_interactive}
+    {}
+
+Job_Control::~Job_Control(){
+    if(child_event_fd >= 0){
+        close(child_event_fd);
+    }
+}
+
+// SIGCHLD is only delivered through the signalfd, the launcher unblocks it
+// again in every child. It is set up before the first child starts, so a
+// shell that only runs builtins never does.
+void Job_Control::open_child_events(){
+
+    if(child_event_fd >= 0){
+        return;
+    }
+    startup_step step {"child events"};
+    sigset_t sigchld_set;
+    sigemptyset(&sigchld_set);
+    sigaddset(&sigchld_set, SIGCHLD);
+    if(sigprocmask(SIG_BLOCK, &sigchld_set, nullptr) < 0){
+        std::perror("Error");
+        std::exit(EXIT_FAILURE);
+    }
+
+    child_event_fd = signalfd(-1, &sigchld_set, SFD_NONBLOCK | SFD_CLOEXEC);
+    if(child_event_fd < 0){
+        std::perror("Error");
+        std::exit(EXIT_FAILURE);
+    }
+}
+
+int Job_Control::launch_process(const job_arena& arena, const command_info& curr_proc, launch_request& request){
+
+    char* const* argv {arena.get_argv(curr_proc)};
+    Phase_Stats::get_instance().count_command();
+    open_child_events();
+
+    // Resolve in the shell so that the cache outlives the child
+    bool forked {runs_forked(argv[0])};
+    const char* binary_file {forked ? nullptr : Command_Hash::get_instance().lookup(argv[0])};
+    if(!forked && !binary_file){
+        std::fprintf(stderr, "nsh: %s: command not found\n", argv[0]);
+        return -1;
+    }
+
+    request.binary_file = binary_file;
+    request.argv = argv;
+    request.envp = environment::merge_envp(arena.get_envp(curr_proc), curr_proc.clear_env, merged_envp);
+
+    // A job of builtins only never gets a leaf
+    if(job_cgroup_fd < 0 && Job_Cgroups::get_instance().is_enabled()){
+        job_cgroup_fd = Job_Cgroups::get_instance().create_leaf(job_cgroup);
+    }
+    request.cgroup_fd = job_cgroup_fd;
+
+    phase_timer timer {shell_phase::launch};
+    if(forked){
+        return fork_builtin(arena, curr_proc, request);
+    }
+    return Process_Launcher::get_instance().launch(request);
+}
+
+// parallel starts processes of its own. It runs in a child of the shell in
+// the job's process group, so its workers are part of the job: Ctrl-C and
+// Ctrl-Z reach all of them, and fg, bg and kill act on them as one job.
+bool Job_Control::runs_forked(std::string_view name) noexcept{
+    return name == "parallel";
+}
+
+// The child joins the job's process group and cgroup and sets up its fds
+// the way a launched stage does. The shell's own fds are closed as exec
+// would, a pipe's write end left open keeps the reader from ever seeing
+// end of file. Then it runs the builtin and exits with its status.
+int Job_Control::fork_builtin(const job_arena& arena, const command_info& curr_proc, const launch_request& request){
+
+    // What stdio holds would otherwise be written by both
+    std::fflush(stdout);
+
+    int pid = fork();
+    if(pid == 0){
+        setpgid(0, request.pgid);
+        if(request.cgroup_fd >= 0){
+            Job_Cgroups::move_process(request.cgroup_fd);
+        }
+        sigset_t empty_set;
+        sigemptyset(&empty_set);
+        sigprocmask(SIG_SETMASK, &empty_set, nullptr);
+
+        if(request.input_fd >= 0){
+            dup2(request.input_fd, STDIN_FILENO);
+        }
+        if(request.output_fd >= 0){
+            dup2(request.output_fd, STDOUT_FILENO);
         }
+        for(const fd_action& action : request.actions){
+            if(dup2(action.source_fd, action.target_fd) < 0){
+                std::perror("Error");
+                _exit(1);
+            }
+            if(action.source_fd == action.target_fd){
+                fcntl(action.target_fd, F_SETFD, 0);
+            }
+        }
+        if(DIR* dir {opendir("/proc/self/fd")}){
+            while(dirent* entry {readdir(dir)}){
+                int fd {std::atoi(entry->d_name)};
+                if(fd > STDERR_FILENO && fd != dirfd(dir) && (fcntl(fd, F_GETFD) & FD_CLOEXEC)){
+                    close(fd);
+                }
+            }
+            closedir(dir);
+        }
+
+        int status {Builtin_Table::get_instance().execute(arena.get_argv(curr_proc)[0], arena.get_args(curr_proc), bgjob_table)};
+        std::fflush(stdout);
+        _exit(status);
+    }
+    else if(pid < 0){
+        std::perror("Error");
+        return -1;
     }
 
-bool Job_Control::get_cmdline_opt_args(std::vector<std::string> cmdargs, std::string& filename, std::vector<char*>& argsptrs) noexcept{
+    if(setpgid(pid, request.pgid) < 0 && errno != EACCES){
+        std::perror("Error");
+    }
+    return pid;
+}
+
+// Closes the leaf of the job that was launched and hands its path over
+std::string Job_Control::finish_job_cgroup(){
+
+    close_fd(job_cgroup_fd);
+    return std::exchange(job_cgroup, {});
+}
 
-    unsigned int index {0};
-    argsptrs[index++] = filename.data();
-    for(auto& str : cmdargs){
-        argsptrs[index++] = str.data();
+bool Job_Control::open_pipes(std::size_t no_of_pipes, std::size_t pipe_size){
+
+    Pipe_Config& pipe_config {Pipe_Config::get_instance()};
+
+    if(no_of_pipes > pipevec.size()){
+        pipevec.resize(no_of_pipes);
+    }
+    for(std::size_t i{0}; i<no_of_pipes; ++i){
+        if(pipe2(pipevec[i].data(), O_CLOEXEC)){
+            std::perror("Error");
+            close_pipes(i);
+            return false;
+        }
+        pipe_config.apply(pipevec[i][writeindex], pipe_size);
     }
-    argsptrs[index] = nullptr;
     return true;
 }
 
-bool Job_Control::get_cmdline_env_args(std::map<std::string, std::string> envmap, std::vector<std::string>&  envargs, std::vector<char*>& envptrs){
+bool Job_Control::setup_relay(const job_arena& arena, const job_info& job){
+
+    if(!Pipe_Config::get_instance().get_relay()){
+        return false;
+    }
+
+    const command_info& last_proc {arena.get_command(job, job.command_count - 1)};
+    if(runs_in_shell(arena, last_proc)){
+        return false;
+    }
+
+    // Only the redirection that finally decides fd 1 counts, and only a file
+    std::span<const redirect_info> redirects {arena.get_redirects(last_proc)};
+    std::span<const fd_action> actions {get_redirect_actions(last_proc)};
+    std::size_t index {actions.size()};
+    for(std::size_t i{0}; i<actions.size(); ++i){
+        if(actions[i].target_fd == STDOUT_FILENO){
+            index = i;
+        }
+    }
+    if(index == actions.size() || (redirects[index].kind != redirect_kind::write && redirects[index].kind != redirect_kind::append)){
+        return false;
+    }
+
+    struct stat info {};
+    if(fstat(actions[index].source_fd, &info) < 0 || !S_ISREG(info.st_mode)){
+        return false;
+    }
 
-    int index{0};
-    for(const auto& [name, value] : envmap){
-        std::string str (name + "=" + value);
-        envargs[index] = std::move(str);
-        envptrs[index] = envargs[index].data();
-        index++;
+    if(pipe2(relay_fds.data(), O_CLOEXEC) < 0){
+        return false;
+    }
+    // The relay keeps its own copy, the job's files are closed before the wait
+    relay_out = fcntl(actions[index].source_fd, F_DUPFD_CLOEXEC, 0);
+    if(relay_out < 0){
+        close_fd(relay_fds[readindex]);
+        close_fd(relay_fds[writeindex]);
+        return false;
     }
-    envptrs[index] = nullptr;
+    Pipe_Config::get_instance().apply(relay_fds[writeindex], job.pipe_size);
+
+    relay_actions.assign(actions.begin(), actions.end());
+    relay_actions[index].source_fd = relay_fds[writeindex];
     return true;
 }
 
-void Job_Control::set_foreground_pgid(int pgid){
+void Job_Control::start_relay(){
 
-    if(pgid != shell_pgid){
-        tcsetpgrp(STDIN_FILENO, pgid);
+    close_fd(relay_fds[writeindex]);
+    relay_thread = std::thread([in_fd = relay_fds[readindex], out_fd = relay_out](){
+        Pipe_Config::relay_pipe(in_fd, out_fd);
+        close(in_fd);
+        close(out_fd);
+    });
+    relay_fds[readindex] = -1;
+    relay_out = -1;
+}
+
+void Job_Control::finish_relay(bool stopped){
+
+    if(!relay_thread.joinable()){
+        return;
+    }
+    // A stopped stage may still write, the relay then finishes on its own
+    if(stopped){
+        relay_thread.detach();
     }
     else{
-        if(signal(SIGTTOU, SIG_IGN) == SIG_ERR){
-            std::perror("Error");
-        }
-        tcsetpgrp(STDIN_FILENO, pgid);
-        if(signal(SIGTTOU, SIG_DFL) == SIG_ERR){
-            std::perror("Error");
-        }
+        relay_thread.join();
     }
 }
 
+void Job_Control::close_pipes(std::size_t no_of_pipes){
 
+    for(std::size_t i{0}; i<no_of_pipes; ++i){
+        close_fd(pipevec[i][readindex]);
+        close_fd(pipevec[i][writeindex]);
+    }
+}
 
-void Job_Control::execute_bg_job(job_type job){
+void Job_Control::close_fd(int& fd) noexcept{
 
-    static std::vector<char*> argsptrs;
-    static std::vector<std::string> envstrs;
-    static std::vector<char*> envptrs;
+    if(fd >= 0){
+        close(fd);
+        fd = -1;
+    }
+}
 
-    int newpgrpid {0};
-    std::size_t no_of_pipes {0};
+bool Job_Control::open_redirections(const job_arena& arena, const job_info& job){
 
-    jobunit_id++;
-    no_of_pipes = job.size() - 1;
+    // Every file and process substitution pipe of the job is opened before
+    // any of its stages starts, so a bad redirection runs nothing
+    redirect_actions.resize(arena.get_redirect_count());
 
-    static std::vector<std::vector<int>> pipevec(no_of_pipes, std::vector<int>(2));
-    if(no_of_pipes > pipevec.size()){
-        pipevec.resize(no_of_pipes, std::vector<int>(2));
+    std::span<const procsub_info> procsubs {arena.get_procsubs(job)};
+    procsub_pipes.resize(procsubs.size());
+    for(std::array<int, 2>& fds : procsub_pipes){
+        if(pipe2(fds.data(), O_CLOEXEC) < 0){
+            std::perror("Error");
+            close_redirections();
+            return false;
+        }
+        redirect_files.push_back(fds[readindex]);
+        redirect_files.push_back(fds[writeindex]);
     }
 
+    for(std::size_t i{0}; i<job.command_count; ++i){
+        if(!open_command_redirections(arena, arena.get_command(job, i), procsubs)){
+            return false;
+        }
+    }
+    for(const procsub_info& procsub : procsubs){
+        for(std::size_t i{0}; i<procsub.command_count; ++i){
+            if(!open_command_redirections(arena, arena.get_command(procsub, i), procsubs)){
+                return false;
+            }
+        }
+    }
 
-    for(auto& pipefds : pipevec){
-        if(pipe(pipefds.data())){
+    // Redirections name fds 0 to 9, the pipes of <(...) arguments are seen
+    // as the highest fds below the open file limit. Once the job's own files
+    // reach those, a dup2 onto one could replace a pipe or file that a later
+    // one still needs, so that is running out of fds.
+    if(!procsubs.empty()){
+        int lowest {std::numeric_limits<int>::max()};
+        auto find_lowest = [&arena, &lowest](const command_info& cmd){
+            for(const redirect_info& redirect : arena.get_redirects(cmd)){
+                if(redirect.kind == redirect_kind::procsub && redirect.fd > 9){
+                    lowest = std::min(lowest, redirect.fd);
+                }
+            }
+        };
+        for(std::size_t i{0}; i<job.command_count; ++i){
+            find_lowest(arena.get_command(job, i));
+        }
+        for(const procsub_info& procsub : procsubs){
+            for(std::size_t i{0}; i<procsub.command_count; ++i){
+                find_lowest(arena.get_command(procsub, i));
+            }
+        }
+        if(std::any_of(redirect_files.begin(), redirect_files.end(), [lowest](int fd){ return fd >= lowest; })){
+            errno = EMFILE;
             std::perror("Error");
-            continue;
+            close_redirections();
+            return false;
         }
     }
+    return true;
+}
 
-    std::size_t proc_index {0};
-    std::size_t total_procs {job.size()};
+bool Job_Control::open_command_redirections(const job_arena& arena, const command_info& cmd, std::span<const procsub_info> procsubs){
 
-    for(command_info& curr_proc : job){
+    std::span<const redirect_info> redirects {arena.get_redirects(cmd)};
 
-        int pid = fork();
-        if(pid == 0){
-            connect_processes(no_of_pipes, pipevec, proc_index, total_procs);
+    for(std::size_t r{0}; r<redirects.size(); ++r){
 
-            argsptrs.reserve(curr_proc.cmdargs.size() + 2);
-            if(!get_cmdline_opt_args(std::move(curr_proc.cmdargs), curr_proc.execfile, argsptrs)){
-                break;
+        const redirect_info& redirect {redirects[r]};
+        fd_action& action {redirect_actions[cmd.redirect_index + r]};
+        action.target_fd = redirect.fd;
+
+        if(redirect.kind == redirect_kind::duplicate){
+            action.source_fd = redirect.source_fd;
+            continue;
+        }
+        // The command writes into >(...) and reads from <(...)
+        if(redirect.kind == redirect_kind::procsub){
+            std::size_t index {static_cast<std::size_t>(redirect.source_fd)};
+            action.source_fd = procsub_pipes[index][procsubs[index].output ? writeindex : readindex];
+            continue;
+        }
+        if(redirect.kind == redirect_kind::heredoc){
+            int fd {open_heredoc(arena.get_text(redirect))};
+            if(fd < 0){
+                close_redirections();
+                return false;
             }
-            envstrs.reserve(curr_proc.envs.size());
-            envptrs.reserve(curr_proc.envs.size() + 1);
-            if(!get_cmdline_env_args(std::move(curr_proc.envs), envstrs, envptrs)){
+            redirect_files.push_back(fd);
+            action.source_fd = fd;
+            continue;
+        }
+
+        int flags {O_CLOEXEC};
+        switch(redirect.kind){
+            case redirect_kind::read:
+                flags |= O_RDONLY;
                 break;
-            }
+            case redirect_kind::write:
+                flags |= O_WRONLY | O_CREAT | O_TRUNC;
+                break;
+            default:
+                flags |= O_WRONLY | O_CREAT | O_APPEND;
+                break;
+        }
+
+        const char* path {arena.get_path(redirect)};
+        int fd = open(path, flags, 0666);
+        if(fd < 0){
+            std::fprintf(stderr, "nsh: %s: %s\n", path, std::strerror(errno));
+            close_redirections();
+            return false;
+        }
+        redirect_files.push_back(fd);
+        action.source_fd = fd;
+    }
+    return true;
+}
 
+// The text goes into an anonymous file sealed against changes, which the
+// command reads from the start: nothing touches the filesystem and no
+// process has to feed a pipe, whatever the size
+int Job_Control::open_heredoc(std::string_view text){
 
-            std::filesystem::path binary_file;
-            std::move_iterator<std::list<std::string>::iterator> first{path_dirs.begin()}, last{path_dirs.end()};
-            for(; first != last; first = std::next(first)){
-                binary_file = *first;
-                binary_file.append(std::move(curr_proc.execfile));
-                execve(binary_file.string().c_str(), argsptrs.data(), envptrs.data());
+    int fd {memfd_create("nsh-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING)};
+    if(fd < 0){
+        std::perror("nsh: here-document");
+        return -1;
+    }
+    for(std::size_t done{0}; done < text.size(); ){
+        ssize_t count {write(fd, text.data() + done, text.size() - done)};
+        if(count < 0){
+            if(errno == EINTR){
+                continue;
             }
+            std::perror("nsh: here-document");
+            close(fd);
+            return -1;
+        }
+        done += static_cast<std::size_t>(count);
+    }
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+void Job_Control::close_redirections(){
+
+    for(int fd : redirect_files){
+        close(fd);
+    }
+    redirect_files.clear();
+}
+
+void Job_Control::set_foreground_pgid(int pgid){
+
+    // Without a terminal there is nothing to hand over
+    if(!interactive){
+        return;
+    }
+
+    if(pgid != shell_pgid){
+        tcsetpgrp(STDIN_FILENO, pgid);
+    }
+    else{
+        if(signal(SIGTTOU, SIG_IGN) == SIG_ERR){
             std::perror("Error");
-            std::exit(EXIT_FAILURE);
         }
-        else{
+        tcsetpgrp(STDIN_FILENO, pgid);
+        if(signal(SIGTTOU, SIG_DFL) == SIG_ERR){
+            std::perror("Error");
+        }
+    }
+}
+
+
 
-            if(proc_index == 0){
+void Job_Control::execute_bg_job(const job_arena& arena, const job_info& job){
+
+    int newpgrpid {0};
+    std::size_t no_of_pipes {0};
+    std::size_t launched_procs {0};
+
+    no_of_pipes = job.command_count - 1;
+    if(!open_redirections(arena, job)){
+        return;
+    }
+    launched_pids.clear();
+    launch_procsubs(arena, job, newpgrpid, launched_procs);
+    if(!open_pipes(no_of_pipes, job.pipe_size)){
+        discard_procsubs(newpgrpid);
+        close_redirections();
+        last_status = 1;
+        return;
+    }
+
+    launch_request request;
+
+    for(std::size_t proc_index{0}; proc_index<job.command_count; ++proc_index){
+
+        const command_info& curr_proc {arena.get_command(job, proc_index)};
+
+        request.pgid = newpgrpid;
+        connect_processes(no_of_pipes, pipevec, proc_index, request);
+        request.actions = get_redirect_actions(curr_proc);
+
+        int pid = launch_process(arena, curr_proc, request);
+        if(pid > 0){
+            if(launched_procs == 0){
                 newpgrpid = pid;
-                if(newpgrpid < 0){
-                    std::perror("Error");
-                }
             }
-            if(setpgid(pid, newpgrpid) < 0){
-                std::perror("Error");
-            }
-            // Print the status of the job
+            launched_procs++;
+            launched_pids.push_back(pid);
         }
-        proc_index++;
     }
 
+    close_pipes(no_of_pipes);
+    close_redirections();
+    std::string cgroup {finish_job_cgroup()};
 
-    background_execution_unit unit {jobunit_id, get_jobunit_desc(job), job_status::running, newpgrpid};
-    bgjob_table.insert({unit.job_id, std::move(unit)});
-
-    for(std::size_t i{0}; i<no_of_pipes; ++i){
-        close(pipevec[i][readindex]);
-        close(pipevec[i][writeindex]);
+    if(launched_procs == 0){
+        if(!cgroup.empty()){
+            Job_Cgroups::remove_leaf(cgroup);
+        }
+        return;
     }
 
-    siginfo_t waitinfo;
-    waitinfo.si_pid = 0;
-    for(std::size_t m{0}; m<total_procs; ++m){
-        int status = waitid(P_PGID, newpgrpid, &waitinfo, WNOHANG | WEXITED | WSTOPPED);
-        if(status == 0){
-            if(waitinfo.si_pid == 0){
-                break;
-            }
+    // State changes are picked up by process_child_events, by pid
+    bgjob_table.add(get_jobunit_desc(arena, job), newpgrpid, launched_pids).cgroup = std::move(cgroup);
+}
+
+
+void Job_Control::run_jobs(const job_arena& arena){
+
+    // Jobs run in the order they were written, background ones are not waited for
+    for(const job_info& job : arena.get_jobs()){
+        if(job.timing != time_format::none && line_timing == time_format::none){
+            line_timing = job.timing;
+            chain_start = std::chrono::steady_clock::now();
+        }
+
+        if(job.background){
+            execute_bg_job(arena, job);
+            last_status = 0;
+        }
+        else if(line_timing != time_format::none){
+            run_timed_job(arena, job, line_timing);
+            timed_jobs++;
         }
         else{
-            std::perror("Unknown error occurred\n");
-            break;
+            run_foreground_job(arena, job);
         }
     }
 }
 
+void Job_Control::finish_line(){
 
-bool Job_Control::tokenize_path_var(std::list<std::string>& path_dirs){
+    if(timed_jobs > 1){
+        std::chrono::duration<double> real {std::chrono::steady_clock::now() - chain_start};
+        time_report::print_total(stderr, line_timing, real.count(), timed_jobs);
+    }
+    line_timing = time_format::none;
+    timed_jobs = 0;
+}
 
+void Job_Control::run_timed_job(const job_arena& arena, const job_info& job, time_format timing){
 
-    std::string_view delim {":"};
+    stage_times.clear();
+    collect_usage = true;
 
-    char* path_env_val {getenv("PATH")};
-    if(!path_env_val)
-        return false;
+    auto start {std::chrono::steady_clock::now()};
+    run_foreground_job(arena, job);
+    std::chrono::duration<double> real {std::chrono::steady_clock::now() - start};
+
+    collect_usage = false;
 
-    std::string path_dir_toks;
-    path_dir_toks.resize(std::strlen(path_env_val) + 1);
+    // Stages are reported in pipeline order, whatever order they finished in
+    std::sort(stage_times.begin(), stage_times.end(), [](const stage_time& lhs, const stage_time& rhs){
+        return lhs.stage < rhs.stage;
+    });
+    std::fflush(stdout);
+    time_report::print_pipeline(stderr, timing, get_jobunit_desc(arena, job), real.count(), last_status, stage_times);
+}
 
-    std::copy(path_env_val, path_env_val + std::strlen(path_env_val) + 1, path_dir_toks.begin());
+int Job_Control::get_exit_status(int status) noexcept{
 
-    char* tok {std::strtok(path_dir_toks.data(), delim.data())};
-    while(tok){
-        path_dirs.push_back(std::string(tok));
-        tok = std::strtok(nullptr, delim.data());
+    if(WIFEXITED(status)){
+        return WEXITSTATUS(status);
     }
-    return true;
+    if(WIFSIGNALED(status)){
+        return 128 + WTERMSIG(status);
+    }
+    return 128 + WSTOPSIG(status);
 }
 
-void Job_Control::submit_foreground_jobs(const std::list<job_type>& _fg_jobs){
-    fg_joblist = _fg_jobs;
+// Builtins are timed by the shell thread's usage before and after
+static void subtract_usage(struct rusage& usage, const struct rusage& before) noexcept{
+
+    timersub(&usage.ru_utime, &before.ru_utime, &usage.ru_utime);
+    timersub(&usage.ru_stime, &before.ru_stime, &usage.ru_stime);
+    usage.ru_nvcsw -= before.ru_nvcsw;
+    usage.ru_nivcsw -= before.ru_nivcsw;
+    usage.ru_minflt -= before.ru_minflt;
+    usage.ru_majflt -= before.ru_majflt;
+}
+
+// A builtin given an environment of its own by env (env -i pwd, env X=1 env)
+// or an env form the builtin does not handle runs as an external command,
+// parallel always runs in a child of the shell
+bool Job_Control::runs_in_shell(const job_arena& arena, const command_info& cmd){
+
+    std::string_view name {arena.get_argv(cmd)[0]};
+    if(!Builtin_Table::get_instance().is_builtin(name) || cmd.clear_env || runs_forked(name)){
+        return false;
+    }
+    return name != "env" || (cmd.envc == 0 && builtin_env::handles(arena.get_args(cmd)));
 }
 
-void Job_Control::run_foreground_jobs(){
+int Job_Control::run_builtin(const job_arena& arena, const command_info& curr_proc, const launch_request& request){
+
+    Builtin_Table& builtin_table {Builtin_Table::get_instance()};
+    Phase_Stats::get_instance().count_command();
+
+    // Builtins write through stdio, so stdout is flushed before fd 1 changes
+    std::fflush(stdout);
+
+    // Each fd the stage redirects is saved once and restored afterwards
+    saved_fds.clear();
+    auto redirect = [this](int source_fd, int target_fd){
+        auto saved = std::find_if(saved_fds.begin(), saved_fds.end(), [target_fd](const std::array<int, 2>& fds){
+            return fds[0] == target_fd;
+        });
+        if(saved == saved_fds.end()){
+            saved_fds.push_back({target_fd, fcntl(target_fd, F_DUPFD_CLOEXEC, 10)});
+        }
+        return source_fd == target_fd || dup2(source_fd, target_fd) >= 0;
+    };
+
+    bool redirected {true};
+    if(request.input_fd >= 0){
+        redirect(request.input_fd, STDIN_FILENO);
+    }
+    if(request.output_fd >= 0){
+        redirect(request.output_fd, STDOUT_FILENO);
+    }
+    for(const fd_action& action : request.actions){
+        if(!redirect(action.source_fd, action.target_fd)){
+            std::fprintf(stderr, "nsh: %d: %s\n", action.source_fd, std::strerror(errno));
+            redirected = false;
+            break;
+        }
+    }
+
+    int status {1};
+    if(redirected){
+        status = builtin_table.execute(arena.get_argv(curr_proc)[0], arena.get_args(curr_proc), bgjob_table);
+    }
+    std::fflush(stdout);
+
+    for(auto iter = saved_fds.rbegin(); iter != saved_fds.rend(); ++iter){
+        if((*iter)[1] >= 0){
+            dup2((*iter)[1], (*iter)[0]);
+            close((*iter)[1]);
+        }
+        else{
+            close((*iter)[0]);
+        }
+    }
+    // A failed write leaves the error flag set on the shell's own stdout
+    std::clearerr(stdout);
+    return status;
+}
 
-    static std::vector<char*> argsptrs;
-    static std::vector<std::string> envstrs;
-    static std::vector<char*> envptrs;
+void Job_Control::run_foreground_job(const job_arena& arena, const job_info& job){
 
-    std::size_t chainlist_size {fg_joblist.size()};
     int newpgrpid {0};
-    std::size_t no_of_pipes {0};
+    int last_pid {0};
+    std::size_t no_of_pipes {job.command_count - 1u};
+    std::size_t launched_procs {0};
 
-    static std::vector<std::vector<int>> pipevec;
+    launch_request request;
 
-    bool all_builtins {true};
+    if(!open_redirections(arena, job)){
+        last_status = 1;
+        return;
+    }
+    launched_pids.clear();
+    launch_procsubs(arena, job, newpgrpid, launched_procs);
+    if(!open_pipes(no_of_pipes, job.pipe_size)){
+        discard_procsubs(newpgrpid);
+        close_redirections();
+        last_status = 1;
+        return;
+    }
 
-    Builtin_Table& builtin_table {Builtin_Table::get_instance()};
+    bool relay {setup_relay(arena, job)};
+    builtin_stages.clear();
+
+    // Only the last builtin stage runs in the shell. Two of them would run
+    // one after the other and the first blocks once the pipe between them
+    // is full, so the ones before it run as external commands, like in
+    // background jobs.
+    std::size_t shell_stage {job.command_count};
+    for(std::size_t j{job.command_count}; j-- > 0; ){
+        if(runs_in_shell(arena, arena.get_command(job, j))){
+            shell_stage = j;
+            break;
+        }
+    }
+
+    for(std::size_t j{0}; j<job.command_count; ++j){
 
-    for(std::size_t index{0}; index<chainlist_size; ++index){
-        std::list<command_info>& chain_key = *std::next(fg_joblist.begin(), index);
-        std::size_t chain_key_size = chain_key.size();
-        no_of_pipes = chain_key_size - 1;
+        const command_info& curr_proc {arena.get_command(job, j)};
 
-        if(no_of_pipes > pipevec.size()){
-            pipevec.resize(no_of_pipes, std::vector<int>(2));
+        if(j == shell_stage){
+            builtin_stages.push_back(j);
+            continue;
         }
-        for(auto& pipefds : pipevec){
-            if(pipe(pipefds.data())){
-                std::perror("Error");
-                continue;
+
+        request.pgid = newpgrpid;
+        connect_processes(no_of_pipes, pipevec, j, request);
+        request.actions = (relay && j == no_of_pipes) ? std::span<const fd_action>(relay_actions) : get_redirect_actions(curr_proc);
+
+        int pid = launch_process(arena, curr_proc, request);
+        if(pid > 0){
+            if(launched_procs == 0){
+                newpgrpid = pid;
             }
+            launched_procs++;
+            launched_pids.push_back(pid);
         }
+        last_pid = pid;
+        last_status = (pid > 0) ? 0 : 127;
 
-        all_builtins = true;
+        if(collect_usage){
+            stage_times.push_back({{}, j, pid, false, last_status, {}});
+            append_command_desc(arena, curr_proc, stage_times.back().command);
+        }
+    }
 
-        for(std::size_t j{0}; j<chain_key_size; ++j){
+    if(relay){
+        start_relay();
+    }
 
-            command_info& curr_proc {*std::next(chain_key.begin(), j)};
+    if(!builtin_stages.empty()){
 
-            if(builtin_table.is_builtin(curr_proc.execfile)){
-                std::list<std::string> arglist (curr_proc.cmdargs.begin(), curr_proc.cmdargs.end());
-                builtin_table.execute(curr_proc.execfile, arglist, bgjob_table);
-                continue;
+        // The builtin stage runs in the shell once the external stages are
+        // started, so whatever reads its output is already running. The
+        // shell drops its copies of the pipe ends only external stages use,
+        // a builtin writing to a reader that exited then gets EPIPE.
+        auto is_builtin_stage = [this](std::size_t stage){
+            return std::find(builtin_stages.begin(), builtin_stages.end(), stage) != builtin_stages.end();
+        };
+        for(std::size_t i{0}; i<no_of_pipes; ++i){
+            if(!is_builtin_stage(i)){
+                close_fd(pipevec[i][writeindex]);
             }
-            all_builtins = false;
+            if(!is_builtin_stage(i + 1)){
+                close_fd(pipevec[i][readindex]);
+            }
+        }
 
-            int pid = fork();
-            if(pid == 0){
+        struct sigaction ignore_action {};
+        struct sigaction saved_action {};
+        ignore_action.sa_handler = SIG_IGN;
+        sigaction(SIGPIPE, &ignore_action, &saved_action);
 
-                //connect_processes(no_of_pipes, pipefds, j, chain_key_size);
-                connect_processes(no_of_pipes, pipevec, j, chain_key_size);
+        for(std::size_t stage : builtin_stages){
+            const command_info& curr_proc {arena.get_command(job, stage)};
+            connect_processes(no_of_pipes, pipevec, stage, request);
+            request.actions = get_redirect_actions(curr_proc);
 
-                argsptrs.reserve(curr_proc.cmdargs.size() + 2);
-                if(!get_cmdline_opt_args(std::move(curr_proc.cmdargs), curr_proc.execfile, argsptrs)){
-                    break;
-                }
+            struct rusage before {};
+            if(collect_usage){
+                getrusage(RUSAGE_THREAD, &before);
+            }
 
-                envstrs.reserve(curr_proc.envs.size());
-                envptrs.reserve(curr_proc.envs.size() + 1);
-                if(!get_cmdline_env_args(std::move(curr_proc.envs), envstrs, envptrs)){
-                    break;
-                }
+            int status {run_builtin(arena, curr_proc, request)};
 
-                std::filesystem::path binary_file;
-                std::move_iterator<std::list<std::string>::iterator> first{path_dirs.begin()}, last {path_dirs.end()};
-                for(; first != last; first = std::next(first)){
-                    binary_file = *first;
-                    binary_file.append(std::move(curr_proc.execfile));
-                    execve(binary_file.string().c_str(), argsptrs.data(), envptrs.data());
-                }
-                std::perror("Error");
-                std::exit(EXIT_FAILURE);
+            if(collect_usage){
+                stage_time usage {{}, stage, 0, true, status, {}};
+                getrusage(RUSAGE_THREAD, &usage.usage);
+                subtract_usage(usage.usage, before);
+                append_command_desc(arena, curr_proc, usage.command);
+                stage_times.push_back(std::move(usage));
+            }
 
+            // The next stage sees end of file once the write end is closed
+            if(stage > 0){
+                close_fd(pipevec[stage - 1][readindex]);
             }
-            else{
-                if(j == 0){
-                    newpgrpid = pid;
-                    if(newpgrpid < 0){
-                        std::perror("Error");
-                        std::exit(EXIT_FAILURE);
-                    }
-                }
-                if(setpgid(pid, newpgrpid) < 0){
-                    std::perror("Error");
-                    std::exit(EXIT_FAILURE);
-                }
+            if(stage < no_of_pipes){
+                close_fd(pipevec[stage][writeindex]);
+            }
+            if(stage == no_of_pipes){
+                last_status = status;
+                last_pid = 0;
             }
         }
 
-        set_foreground_pgid(newpgrpid);
+        sigaction(SIGPIPE, &saved_action, nullptr);
+    }
 
-        for(std::size_t i{0}; i<no_of_pipes; ++i){
-            /*close(pipefds[i][readindex]);
-            close(pipefds[i][writeindex]);*/
-            close(pipevec[i][readindex]);
-            close(pipevec[i][writeindex]);
+    close_pipes(no_of_pipes);
+    close_redirections();
+    std::string cgroup {finish_job_cgroup()};
+
+    if(launched_procs == 0){
+        finish_relay(false);
+        if(!cgroup.empty()){
+            Job_Cgroups::remove_leaf(cgroup);
         }
+        return;
+    }
 
-        siginfo_t proc_exit_status_info;
-        proc_exit_status_info.si_pid = 0;
+    set_foreground_pgid(newpgrpid);
 
-        if(!all_builtins){
-            for(std::size_t m{0}; m<chain_key_size; ++m){
-                if(waitid(P_PGID, newpgrpid, &proc_exit_status_info, WEXITED | WSTOPPED) == -1){
-                    std::perror("Error");
-                }
+    phase_timer timer {shell_phase::wait};
+
+    int status {0};
+    struct rusage usage {};
+    bool stopped {false};
+    waited_status.clear();
+
+    for(std::size_t m{0}; m<launched_procs; ++m){
+        int pid = wait4(-newpgrpid, &status, WUNTRACED, &usage);
+        if(pid < 0){
+            std::perror("Error");
+            continue;
+        }
+        stopped = stopped || WIFSTOPPED(status);
+        waited_status.push_back({pid, status});
+        // The status of a pipeline is the one of its last stage
+        if(pid == last_pid){
+            last_status = get_exit_status(status);
+        }
+        if(collect_usage){
+            auto stage = std::find_if(stage_times.begin(), stage_times.end(), [pid](const stage_time& time){
+                return !time.builtin && time.pid == pid;
+            });
+            if(stage != stage_times.end()){
+                stage->status = get_exit_status(status);
+                stage->usage = usage;
             }
         }
-        set_foreground_pgid(shell_pgid);
     }
-}
+    finish_relay(stopped);
+    set_foreground_pgid(shell_pgid);
+
+    // A stopped job joins the background jobs, fg and bg resume it
+    if(!stopped && !cgroup.empty()){
+        Job_Cgroups::remove_leaf(cgroup);
+    }
+    if(stopped){
+        background_execution_unit& unit {bgjob_table.add(get_jobunit_desc(arena, job), newpgrpid, launched_pids)};
+        unit.cgroup = std::move(cgroup);
+        for(const std::array<int, 2>& waited : waited_status){
+            bgjob_table.update(waited[0], waited[1]);
+        }
+        // The terminal echoed ^Z without a newline
+        if(interactive){
+            job_reports += '\n';
+        }
+        report_job(unit);
+    }
 
-void Job_Control::submit_background_jobs(std::list<job_type> bg_jobs){
-    bg_joblist = std::move(bg_jobs);
+    // Background jobs that changed state while this one ran, the next
+    // command of a -c string or script sees them before any prompt does
+    process_child_events();
 }
 
 
-std::string Job_Control::get_jobunit_desc(const job_type& job){
+void Job_Control::append_command_desc(const job_arena& arena, const command_info& cmd, std::string& desc){
 
-    std::size_t job_size = job.size();
-    std::size_t index = 0;
+    char* const* argv {arena.get_argv(cmd)};
+    for(std::size_t arg{0}; argv[arg]; ++arg){
+        if(arg > 0){
+            desc += ' ';
+        }
+        desc += argv[arg];
+    }
+}
+
+std::string Job_Control::get_jobunit_desc(const job_arena& arena, const job_info& job){
 
     std::string jobunit_desc;
-    for(const command_info& info : job){
+    for(std::size_t index{0}; index<job.command_count; ++index){
 
-        std::string proc_args;
-        for(const std::string& args : info.cmdargs)
-            proc_args += args;
-        if(index == job_size - 1){
-            jobunit_desc += (info.execfile + " " + proc_args + " ");
+        if(index > 0){
+            jobunit_desc += " | ";
         }
-        else{
-            jobunit_desc += (info.execfile + " " + proc_args + " | ");
-        }
-        index++;
+        append_command_desc(arena, arena.get_command(job, index), jobunit_desc);
     }
     return jobunit_desc;
 }
 
-void Job_Control::run_background_jobs(){
-
+void Job_Control::connect_processes(std::size_t no_of_pipes, const std::vector<std::array<int, 2>>& pipefds, std::size_t proc_index, launch_request& request){
 
-    auto first {std::make_move_iterator(bg_joblist.begin())};
-    auto last {std::make_move_iterator(bg_joblist.end())};
-
-    for(; first != last; first = std::next(first)){
-        execute_bg_job(*first);
-    }
+    // Pipes are O_CLOEXEC, so the stage only has to dup2 its own ends
+    request.input_fd = (proc_index > 0) ? pipefds[proc_index-1][readindex] : -1;
+    request.output_fd = (proc_index < no_of_pipes) ? pipefds[proc_index][writeindex] : -1;
 }
 
-void Job_Control::connect_processes(int no_of_pipes, const std::vector<std::vector<int>>& pipefds, const int& proc_index, const int& total_proc){
+void Job_Control::launch_procsubs(const job_arena& arena, const job_info& job, int& pgid, std::size_t& launched_procs){
 
-    if(no_of_pipes > 0){
-        if(proc_index == 0){
-            dup2(pipefds[proc_index][writeindex], STDOUT_FILENO);
-            close(pipefds[proc_index][readindex]);
-            close(pipefds[proc_index][writeindex]);
+    // Process substitutions start first and join the job's process group,
+    // so they are signalled, waited for and reaped with the job. Builtins
+    // in them run as external commands, like in background jobs.
+    std::span<const procsub_info> procsubs {arena.get_procsubs(job)};
+    launch_request request;
 
-            for(int pfd = 1; pfd < no_of_pipes; ++pfd){
-                close(pipefds[pfd][readindex]);
-                close(pipefds[pfd][writeindex]);
-            }
-        }
-        else if(proc_index == (total_proc - 1)){
-            dup2(pipefds[proc_index-1][readindex], STDIN_FILENO);
-            close(pipefds[proc_index-1][writeindex]);
-            close(pipefds[proc_index-1][readindex]);
+    for(std::size_t index{0}; index<procsubs.size(); ++index){
 
-            int read_pipefd_index = proc_index - 2;
-            if(read_pipefd_index >= 0){
-                for(int pfd = read_pipefd_index; pfd >= 0; --pfd){
-                    close(pipefds[pfd][writeindex]);
-                    close(pipefds[pfd][readindex]);
-                }
-            }
+        const procsub_info& procsub {procsubs[index]};
+        std::size_t no_of_pipes {procsub.command_count - 1u};
+        if(!open_pipes(no_of_pipes, job.pipe_size)){
+            continue;
         }
-        else{
-            dup2(pipefds[proc_index-1][readindex], STDIN_FILENO);
-            dup2(pipefds[proc_index][writeindex], STDOUT_FILENO);
-
-            close(pipefds[proc_index-1][writeindex]);
-            close(pipefds[proc_index-1][readindex]);
-            close(pipefds[proc_index][readindex]);
-            close(pipefds[proc_index][writeindex]);
 
+        for(std::size_t proc_index{0}; proc_index<procsub.command_count; ++proc_index){
 
-            int write_pipefd_index = proc_index + 1;
-            int read_pipefd_index = proc_index - 2;
+            const command_info& curr_proc {arena.get_command(procsub, proc_index)};
 
-            if(read_pipefd_index >= 0){
-                for(int pfd = read_pipefd_index; pfd >= 0; --pfd){
-                    close(pipefds[pfd][readindex]);
-                    close(pipefds[pfd][writeindex]);
-                }
+            request.pgid = pgid;
+            connect_processes(no_of_pipes, pipevec, proc_index, request);
+            if(procsub.output && proc_index == 0){
+                request.input_fd = procsub_pipes[index][readindex];
             }
+            if(!procsub.output && proc_index == no_of_pipes){
+                request.output_fd = procsub_pipes[index][writeindex];
+            }
+            request.actions = get_redirect_actions(curr_proc);
 
-            for(int pfd = write_pipefd_index; pfd < no_of_pipes; ++pfd){
-                close(pipefds[pfd][readindex]);
-                close(pipefds[pfd][writeindex]);
+            int pid = launch_process(arena, curr_proc, request);
+            if(pid > 0){
+                if(launched_procs == 0){
+                    pgid = pid;
+                }
+                launched_procs++;
+                launched_pids.push_back(pid);
             }
         }
+        close_pipes(no_of_pipes);
     }
 }
 
-void Job_Control::wait_for_background_jobs(){
-
-    std::vector<std::size_t> to_be_removed;
+// The job's own pipes could not be opened after its process substitutions
+// started, nothing will wait for them
+void Job_Control::discard_procsubs(int pgid){
 
+    if(!launched_pids.empty() && killpg(pgid, SIGKILL) < 0){
+        std::perror("Error");
+    }
+    for(int pid : launched_pids){
+        while(waitpid(pid, nullptr, 0) < 0 && errno == EINTR){}
+    }
+    launched_pids.clear();
 
-    siginfo_t waitinfo;
-    int stopped_proc{0}, term_proc{0};
-    int status {0};
+    std::string cgroup {finish_job_cgroup()};
+    if(!cgroup.empty()){
+        Job_Cgroups::remove_leaf(cgroup);
+    }
+}
 
-    for(auto& [jobid, unit] : bgjob_table){
+void Job_Control::process_child_events(){
 
-        int no_of_procs = std::count(unit.job_cmd.cbegin(), unit.job_cmd.cend(), '|') + 1;
+    // Drain the signalfd first, a child changing state after the wait4 loop
+    // below then raises a new event
+    signalfd_siginfo siginfo[16];
+    bool signalled {false};
+    while(read(child_event_fd, siginfo, sizeof(siginfo)) > 0){
+        signalled = true;
+    }
+    if(!signalled){
+        return;
+    }
 
-        stopped_proc = 0;
-        term_proc = 0;
+    int status {0};
+    int pid {0};
+    while((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, nullptr)) > 0){
 
-        waitinfo.si_pid = 0;
-        while((status = waitid(P_PGID, unit.pgid, &waitinfo, WNOHANG | WEXITED)), status == 0){
-            if(waitinfo.si_pid != 0){
-                term_proc++;
-                waitinfo.si_pid = 0;
-            }
-            else{
-                break;
-            }
+        background_execution_unit* unit {bgjob_table.find_pid(pid)};
+        if(!unit){
+            continue;
         }
 
-        waitinfo.si_pid = 0;
-        while((status = waitid(P_PGID, unit.pgid, &waitinfo, WNOHANG | WSTOPPED)), status == 0){
-            if(waitinfo.si_pid != 0){
-                stopped_proc++;
-                waitinfo.si_pid = 0;
-            }
-            else{
-                break;
-            }
-        }
+        job_status previous {unit->status};
+        bgjob_table.update(pid, status);
 
-        if(term_proc == no_of_procs){
-            to_be_removed.push_back(jobid);
-            unit.status = job_status::done;
+        // Done is reported when the job leaves the table
+        if(unit->status != previous && unit->status == job_status::done){
+            finished_jobs.push_back(unit->job_id);
         }
-        else if(stopped_proc == no_of_procs){
-            unit.status = job_status::stopped;
-        }
-        else if(term_proc + stopped_proc == no_of_procs){
-            unit.status = job_status::stopped;
+        else if(unit->status != previous && unit->status == job_status::stopped){
+            report_job(*unit);
         }
     }
+}
 
-    for(const auto& id : to_be_removed){
-        bgjob_table.erase(id);
-    }
+void Job_Control::report_job(const background_execution_unit& unit){
 
-    if(bgjob_table.empty()){
-        jobunit_id = 0;
+    // Scripts run without job notifications
+    if(!interactive){
+        return;
     }
-    else{
-        jobunit_id = jobunit_id - to_be_removed.size();
+    job_reports += '[';
+    job_reports += std::to_string(unit.job_id);
+    job_reports += (unit.status == job_status::done ? "] Done" : "] Stopped ");
+    job_reports += "\t\t\t";
+    job_reports += unit.job_cmd;
+    job_reports += '\n';
+}
+
+void Job_Control::wait_for_background_jobs(){
+
+    phase_timer timer {shell_phase::reap};
+    process_child_events();
+
+    // Only jobs which finished since the last sweep are visited. fg, wait
+    // or jobs may have removed one already, it was reported then, and its id
+    // may belong to a new job by now.
+    for(std::size_t id : finished_jobs){
+        const background_execution_unit* unit {bgjob_table.find(id)};
+        if(unit && unit->status == job_status::done){
+            report_job(*unit);
+            bgjob_table.erase(id);
+        }
     }
+    finished_jobs.clear();
 }
 
 bool Job_Control::kill_foreground_job(){
@@ -0,0 +1,138 @@
+#include <sys/wait.h>
+
+#include "execution/job_table.hpp"
+#include "execution/job_cgroups.hpp"
+
+
+background_execution_unit& Job_Table::add(std::string job_cmd, int pgid, std::span<const int> pids){
+
+    std::size_t job_id {slots.size() + 1};
+    background_execution_unit& unit {slots.emplace_back(std::in_place, background_execution_unit{job_id, std::move(job_cmd), job_status::running, pgid, {}, 0, 0, {}}).value()};
+
+    unit.procs.reserve(pids.size());
+    for(int pid : pids){
+        pid_index.insert_or_assign(pid, process_ref{job_id, unit.procs.size()});
+        unit.procs.push_back({pid, job_status::running, 0});
+    }
+    // A done job still in the table may have left its pgid to a new process
+    pgid_index.insert_or_assign(pgid, job_id);
+    ++job_count;
+    return unit;
+}
+
+background_execution_unit* Job_Table::find(std::size_t job_id) noexcept{
+
+    if(job_id == 0 || job_id > slots.size() || !slots[job_id - 1]){
+        return nullptr;
+    }
+    return &*slots[job_id - 1];
+}
+
+const background_execution_unit* Job_Table::find(std::size_t job_id) const noexcept{
+
+    if(job_id == 0 || job_id > slots.size() || !slots[job_id - 1]){
+        return nullptr;
+    }
+    return &*slots[job_id - 1];
+}
+
+background_execution_unit* Job_Table::find_pgid(int pgid) noexcept{
+
+    auto iter = pgid_index.find(pgid);
+    return (iter == pgid_index.end()) ? nullptr : find(iter->second);
+}
+
+background_execution_unit* Job_Table::find_pid(int pid) noexcept{
+
+    auto iter = pid_index.find(pid);
+    return (iter == pid_index.end()) ? nullptr : find(iter->second.job_id);
+}
+
+background_execution_unit* Job_Table::current() noexcept{
+    return slots.empty() ? nullptr : &*slots.back();
+}
+
+background_execution_unit* Job_Table::update(int pid, int wait_status){
+
+    auto iter = pid_index.find(pid);
+    if(iter == pid_index.end()){
+        return nullptr;
+    }
+    background_execution_unit& unit {*slots[iter->second.job_id - 1]};
+    job_process& proc {unit.procs[iter->second.index]};
+    proc.wait_status = wait_status;
+
+    if(WIFEXITED(wait_status) || WIFSIGNALED(wait_status)){
+        if(proc.status == job_status::stopped){
+            unit.stopped_procs--;
+        }
+        proc.status = job_status::done;
+        unit.exited_procs++;
+        pid_index.erase(iter);
+    }
+    else if(WIFSTOPPED(wait_status)){
+        if(proc.status == job_status::running){
+            proc.status = job_status::stopped;
+            unit.stopped_procs++;
+        }
+    }
+    else if(WIFCONTINUED(wait_status)){
+        if(proc.status == job_status::stopped){
+            proc.status = job_status::running;
+            unit.stopped_procs--;
+        }
+    }
+
+    // A job is stopped once none of its processes runs any more
+    if(unit.exited_procs == unit.procs.size()){
+        unit.status = job_status::done;
+    }
+    else if(unit.stopped_procs > 0 && unit.exited_procs + unit.stopped_procs == unit.procs.size()){
+        unit.status = job_status::stopped;
+    }
+    else{
+        unit.status = job_status::running;
+    }
+    return &unit;
+}
+
+void Job_Table::set_running(background_execution_unit& unit) noexcept{
+
+    for(job_process& proc : unit.procs){
+        if(proc.status == job_status::stopped){
+            proc.status = job_status::running;
+        }
+    }
+    unit.stopped_procs = 0;
+    if(unit.status == job_status::stopped){
+        unit.status = job_status::running;
+    }
+}
+
+bool Job_Table::erase(std::size_t job_id){
+
+    background_execution_unit* unit {find(job_id)};
+    if(!unit){
+        return false;
+    }
+
+    for(const job_process& proc : unit->procs){
+        if(proc.status != job_status::done){
+            pid_index.erase(proc.pid);
+        }
+    }
+    auto pgid_iter = pgid_index.find(unit->pgid);
+    if(pgid_iter != pgid_index.end() && pgid_iter->second == job_id){
+        pgid_index.erase(pgid_iter);
+    }
+
+    if(!unit->cgroup.empty()){
+        Job_Cgroups::remove_leaf(unit->cgroup);
+    }
+    slots[job_id - 1].reset();
+    --job_count;
+    while(!slots.empty() && !slots.back()){
+        slots.pop_back();
+    }
+    return true;
+}
@@ -0,0 +1,734 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "execution/line_editor.hpp"
+#include "execution/history.hpp"
+
+
+namespace{
+
+constexpr char ctrl_key(char key) noexcept {
+    return static_cast<char>(key & 0x1f);
+}
+
+bool is_printable(unsigned char c) noexcept {
+    return c >= 0x20 && c != 0x7f;
+}
+
+}
+
+
+Line_Editor::Line_Editor(int _in_fd, int _out_fd) :
+    in_fd{_in_fd},
+    out_fd{_out_fd}
+    {
+        // A dumb terminal cannot move the cursor, it gets the line as typed
+        const char* term {getenv("TERM")};
+        has_terminal = isatty(in_fd) && isatty(out_fd) && !(term && std::strcmp(term, "dumb") == 0);
+    }
+
+Line_Editor::~Line_Editor(){
+    restore_mode();
+}
+
+
+std::size_t Line_Editor::count_columns(std::string_view text) noexcept{
+
+    // One column per character, UTF-8 continuation bytes take none
+    std::size_t columns {0};
+    for(unsigned char c : text){
+        columns += (c & 0xc0) != 0x80;
+    }
+    return columns;
+}
+
+std::size_t Line_Editor::previous_char(std::size_t pos) const noexcept{
+
+    while(pos > 0){
+        --pos;
+        if((static_cast<unsigned char>(buffer[pos]) & 0xc0) != 0x80){
+            break;
+        }
+    }
+    return pos;
+}
+
+std::size_t Line_Editor::next_char(std::size_t pos) const noexcept{
+
+    if(pos < buffer.size()){
+        ++pos;
+    }
+    while(pos < buffer.size() && (static_cast<unsigned char>(buffer[pos]) & 0xc0) == 0x80){
+        ++pos;
+    }
+    return pos;
+}
+
+std::size_t Line_Editor::previous_word(std::size_t pos) const noexcept{
+
+    while(pos > 0 && buffer[pos - 1] == ' '){
+        --pos;
+    }
+    while(pos > 0 && buffer[pos - 1] != ' '){
+        --pos;
+    }
+    return pos;
+}
+
+std::size_t Line_Editor::next_word(std::size_t pos) const noexcept{
+
+    while(pos < buffer.size() && buffer[pos] == ' '){
+        ++pos;
+    }
+    while(pos < buffer.size() && buffer[pos] != ' '){
+        ++pos;
+    }
+    return pos;
+}
+
+
+void Line_Editor::write_output(){
+
+    // Anything the shell printed through stdio goes first
+    std::fflush(stdout);
+    for(std::size_t done{0}; done < output.size(); ){
+        ssize_t count {write(out_fd, output.data() + done, output.size() - done)};
+        if(count < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            break;
+        }
+        done += static_cast<std::size_t>(count);
+    }
+    output.clear();
+}
+
+// Redraws prompt and line from the prompt's first row and puts the cursor
+// back, in one write
+void Line_Editor::refresh(){
+
+    if(!raw){
+        return;
+    }
+
+    auto append_move = [this](std::size_t count, char direction){
+        if(count > 0){
+            output += "\x1b[";
+            output += std::to_string(count);
+            output.push_back(direction);
+        }
+    };
+
+    append_move(cursor_row, 'A');
+    output += "\r\x1b[J";
+    output += prompt;
+    output += buffer;
+
+    std::size_t total {prompt_columns + count_columns(buffer)};
+    // At the right margin the terminal waits with the wrap, move on now so
+    // the row arithmetic below holds
+    if(total % width == 0){
+        output.push_back('\n');
+    }
+
+    std::size_t target {prompt_columns + count_columns(std::string_view(buffer).substr(0, cursor))};
+    append_move(total / width - target / width, 'A');
+    output.push_back('\r');
+    append_move(target % width, 'C');
+    cursor_row = target / width;
+
+    write_output();
+}
+
+void Line_Editor::insert(std::string_view text){
+
+    end_history();
+    bool at_end {cursor == buffer.size()};
+    std::size_t before {prompt_columns + count_columns(buffer)};
+    buffer.insert(cursor, text);
+    cursor += text.size();
+    std::size_t after {before + count_columns(text)};
+
+    // Typing at the end of the line without wrapping only needs the text
+    if(raw && at_end && before / width == after / width && after % width != 0){
+        output.append(text);
+        write_output();
+        return;
+    }
+    refresh();
+}
+
+void Line_Editor::erase(std::size_t from, std::size_t to){
+
+    if(from >= to){
+        return;
+    }
+    end_history();
+    buffer.erase(from, to - from);
+    cursor = from;
+    refresh();
+}
+
+void Line_Editor::move_to(std::size_t pos){
+
+    if(pos != cursor){
+        cursor = pos;
+        refresh();
+    }
+}
+
+
+void Line_Editor::history_previous(){
+
+    History& history {History::get_instance()};
+    if(history_trail.empty()){
+        saved_line = buffer;
+    }
+    // size() picks up the entries other sessions added meanwhile
+    std::size_t before {history_trail.empty() ? history.size() : history_trail.back()};
+
+    std::size_t index {history.search_prefix(saved_line, before)};
+    while(index != History::npos && history.get_entry(index) == buffer){
+        index = history.search_prefix(saved_line, index);
+    }
+    if(index == History::npos){
+        return;
+    }
+
+    history_trail.push_back(index);
+    buffer.assign(history.get_entry(index));
+    cursor = buffer.size();
+    refresh();
+}
+
+void Line_Editor::history_next(){
+
+    if(history_trail.empty()){
+        return;
+    }
+    history_trail.pop_back();
+    if(history_trail.empty()){
+        buffer = saved_line;
+    }
+    else{
+        buffer.assign(History::get_instance().get_entry(history_trail.back()));
+    }
+    cursor = buffer.size();
+    refresh();
+}
+
+// An edited history entry becomes the typed text
+void Line_Editor::end_history(){
+    history_trail.clear();
+}
+
+
+// Shows the search prompt and the newest match so far, the cursor on the
+// text found in it
+void Line_Editor::show_search(){
+
+    std::size_t match {History::npos};
+    for(auto step {search_trail.rbegin()}; step != search_trail.rend() && match == History::npos; ++step){
+        match = step->second;
+    }
+    bool failed {!search_trail.empty() && search_trail.back().second == History::npos};
+
+    prompt = failed ? "(failed reverse-i-search)`" : "(reverse-i-search)`";
+    prompt += search_text;
+    prompt += "': ";
+    prompt_columns = count_columns(prompt);
+
+    if(match == History::npos){
+        buffer = saved_line;
+        cursor = buffer.size();
+    }
+    else{
+        buffer.assign(History::get_instance().get_entry(match));
+        cursor = std::min(buffer.find(search_text), buffer.size());
+    }
+    refresh();
+}
+
+// Looks for the search text after it grew, or for an older match
+void Line_Editor::search_history(bool older){
+
+    History& history {History::get_instance()};
+    std::size_t index {History::npos};
+
+    if(search_trail.empty()){
+        index = history.search_reverse(search_text, history.size());
+    }
+    else if(std::size_t last {search_trail.back().second}; last != History::npos){
+        // An entry holding the longer text holds the shorter one too, so
+        // the search goes on from the match rather than from the end
+        index = history.search_reverse(search_text, older ? last : last + 1);
+        while(older && index != History::npos && history.get_entry(index) == history.get_entry(last)){
+            index = history.search_reverse(search_text, index);
+        }
+    }
+    search_trail.emplace_back(search_text.size(), index);
+    show_search();
+}
+
+// Puts the line prompt back, with the match or the line typed before
+void Line_Editor::end_search(bool accept){
+
+    searching = false;
+    search_text.clear();
+    search_trail.clear();
+    prompt = line_prompt;
+    prompt_columns = count_columns(prompt);
+    if(!accept){
+        buffer = saved_line;
+        cursor = buffer.size();
+    }
+    refresh();
+}
+
+// Handles the key at pos while searching, returns the position after it or
+// pos for a key that ends the search and is then handled as usual
+std::size_t Line_Editor::handle_search(std::size_t pos){
+
+    char c {pending[pos]};
+    if(is_printable(static_cast<unsigned char>(c))){
+        std::size_t end {pos + 1};
+        while(end < pending.size() && is_printable(static_cast<unsigned char>(pending[end]))){
+            ++end;
+        }
+        search_text.append(pending, pos, end - pos);
+        search_history(false);
+        return end;
+    }
+
+    switch(c){
+        case ctrl_key('R'):
+            search_history(true);
+            return pos + 1;
+        case ctrl_key('H'):
+        case '\x7f':
+            if(!search_text.empty()){
+                std::size_t size {search_text.size() - 1};
+                while(size > 0 && (static_cast<unsigned char>(search_text[size]) & 0xc0) == 0x80){
+                    --size;
+                }
+                search_text.resize(size);
+                while(!search_trail.empty() && search_trail.back().first > size){
+                    search_trail.pop_back();
+                }
+                // A pasted text was looked for at once, its shorter parts
+                // were not
+                if(size > 0 && (search_trail.empty() || search_trail.back().first != size)){
+                    search_history(false);
+                }
+                else{
+                    show_search();
+                }
+            }
+            return pos + 1;
+        case ctrl_key('G'):
+            end_search(false);
+            return pos + 1;
+        default:
+            end_search(true);
+            return pos;
+    }
+}
+
+
+// Handles the escape sequence at pos, returns the position after it or pos
+// while the sequence is incomplete
+std::size_t Line_Editor::handle_escape(std::size_t pos){
+
+    if(pos + 1 >= pending.size()){
+        return pos;
+    }
+
+    char kind {pending[pos + 1]};
+    if(kind != '[' && kind != 'O'){
+        // Alt with a key
+        if(kind == 'b'){
+            move_to(previous_word(cursor));
+        }
+        else if(kind == 'f'){
+            move_to(next_word(cursor));
+        }
+        return pos + 2;
+    }
+
+    std::size_t end {pos + 2};
+    while(end < pending.size() && static_cast<unsigned char>(pending[end]) >= 0x20 && static_cast<unsigned char>(pending[end]) < 0x40){
+        ++end;
+    }
+    if(end >= pending.size()){
+        return pos;
+    }
+
+    std::string_view params {pending.data() + pos + 2, end - pos - 2};
+    bool by_word {params.ends_with(";5") || params.ends_with(";3")};
+
+    switch(pending[end]){
+        case 'A':
+            history_previous();
+            break;
+        case 'B':
+            history_next();
+            break;
+        case 'C':
+            move_to(by_word ? next_word(cursor) : next_char(cursor));
+            break;
+        case 'D':
+            move_to(by_word ? previous_word(cursor) : previous_char(cursor));
+            break;
+        case 'H':
+            move_to(0);
+            break;
+        case 'F':
+            move_to(buffer.size());
+            break;
+        case '~':
+            if(params == "1" || params == "7"){
+                move_to(0);
+            }
+            else if(params == "4" || params == "8"){
+                move_to(buffer.size());
+            }
+            else if(params == "3"){
+                erase(cursor, next_char(cursor));
+            }
+            break;
+        default:
+            break;
+    }
+    return end + 1;
+}
+
+
+void Line_Editor::complete_word(){
+
+    if(!complete){
+        return;
+    }
+    complete(buffer, cursor, completion);
+    if(completion.match_count == 0){
+        output.append("\a");
+        write_output();
+        return;
+    }
+
+    std::size_t length {cursor - completion.word_start};
+    if(buffer.compare(completion.word_start, length, completion.replacement) != 0){
+        end_history();
+        buffer.replace(completion.word_start, length, completion.replacement);
+        cursor = completion.word_start + completion.replacement.size();
+        refresh();
+        return;
+    }
+
+    // Like other shells, the choices are listed on the second Tab
+    if(tab_presses < 2){
+        output.append("\a");
+        write_output();
+        return;
+    }
+    list_candidates();
+}
+
+// Lists the candidates in columns, top to bottom
+void Line_Editor::list_candidates(){
+
+    const std::vector<std::string>& candidates {completion.candidates};
+    std::size_t longest {0};
+    for(const std::string& candidate : candidates){
+        longest = std::max(longest, count_columns(candidate));
+    }
+    std::size_t column_width {longest + 2};
+    std::size_t columns {std::max<std::size_t>(1, width / column_width)};
+    std::size_t rows {(candidates.size() + columns - 1) / columns};
+
+    std::string text;
+    for(std::size_t row{0}; row < rows; ++row){
+        for(std::size_t column{0}; column < columns; ++column){
+            std::size_t index {column * rows + row};
+            if(index >= candidates.size()){
+                break;
+            }
+            text += candidates[index];
+            if(index + rows < candidates.size()){
+                text.append(column_width - count_columns(candidates[index]), ' ');
+            }
+        }
+        text.push_back('\n');
+    }
+    if(completion.match_count > candidates.size()){
+        text += "... " + std::to_string(completion.match_count - candidates.size()) + " more\n";
+    }
+    print_above(text);
+}
+
+
+void Line_Editor::start_line(std::string_view _prompt){
+
+    prompt.assign(_prompt);
+    prompt_columns = count_columns(prompt);
+    buffer.clear();
+    cursor = 0;
+    cursor_row = 0;
+    history_trail.clear();
+    searching = false;
+    search_text.clear();
+    search_trail.clear();
+    resize();
+
+    // The mode is read again every time, so stty settings made by commands
+    // are what they run with next
+    if(has_terminal && !raw && tcgetattr(in_fd, &saved_mode) == 0){
+        termios mode {saved_mode};
+        mode.c_iflag &= ~static_cast<tcflag_t>(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+        mode.c_cflag |= CS8;
+        mode.c_lflag &= ~static_cast<tcflag_t>(ECHO | ICANON | IEXTEN | ISIG);
+        mode.c_cc[VMIN] = 1;
+        mode.c_cc[VTIME] = 0;
+        raw = tcsetattr(in_fd, TCSADRAIN, &mode) == 0;
+    }
+
+    // The prompt a dropped line left behind is replaced
+    if(editing){
+        output += "\r\x1b[J";
+    }
+    editing = true;
+    output.append(prompt);
+    write_output();
+}
+
+void Line_Editor::restore_mode(){
+
+    if(raw){
+        tcsetattr(in_fd, TCSADRAIN, &saved_mode);
+        raw = false;
+    }
+}
+
+void Line_Editor::resize(){
+
+    winsize size {};
+    if(ioctl(out_fd, TIOCGWINSZ, &size) == 0 && size.ws_col > 0){
+        width = size.ws_col;
+    }
+}
+
+void Line_Editor::cancel_line(){
+
+    if(!editing){
+        return;
+    }
+    if(searching){
+        end_search(true);
+    }
+    // The line stays on screen with ^C after it, the prompt starts the next
+    // row whatever output processing the terminal does
+    move_to(buffer.size());
+    output.append("^C\r\n");
+    write_output();
+
+    buffer.clear();
+    cursor = 0;
+    cursor_row = 0;
+    end_history();
+    output.append(prompt);
+    write_output();
+}
+
+void Line_Editor::print_above(std::string_view text){
+
+    if(!editing){
+        output.append(text);
+        write_output();
+        return;
+    }
+    // The terminal keeps what was typed, the prompt is shown again below
+    if(!raw){
+        output.append("\n");
+        output.append(text);
+        output += prompt;
+        write_output();
+        return;
+    }
+
+    if(cursor_row > 0){
+        output += "\x1b[";
+        output += std::to_string(cursor_row);
+        output.push_back('A');
+    }
+    output += "\r\x1b[J";
+    output.append(text);
+    cursor_row = 0;
+    write_output();
+    refresh();
+}
+
+
+Line_Editor::read_status Line_Editor::process_pending(){
+
+    read_status status {read_status::editing};
+    std::size_t pos {0};
+
+    while(pos < pending.size() && status == read_status::editing){
+
+        // Without raw mode the terminal did the editing
+        if(!raw){
+            std::size_t newline {pending.find('\n', pos)};
+            if(newline == std::string::npos){
+                buffer.append(pending, pos);
+                pos = pending.size();
+                break;
+            }
+            buffer.append(pending, pos, newline - pos);
+            pos = newline + 1;
+            status = read_status::line;
+            break;
+        }
+
+        char c {pending[pos]};
+        if(c != '\t'){
+            tab_presses = 0;
+        }
+
+        if(searching){
+            std::size_t next {handle_search(pos)};
+            if(next != pos){
+                pos = next;
+                continue;
+            }
+        }
+
+        // Runs of text, as in a paste, are inserted with one redraw
+        if(is_printable(static_cast<unsigned char>(c))){
+            std::size_t end {pos + 1};
+            while(end < pending.size() && is_printable(static_cast<unsigned char>(pending[end]))){
+                ++end;
+            }
+            insert(std::string_view(pending).substr(pos, end - pos));
+            pos = end;
+            continue;
+        }
+
+        if(c == '\x1b'){
+            std::size_t next {handle_escape(pos)};
+            if(next == pos){
+                break;
+            }
+            pos = next;
+            continue;
+        }
+
+        ++pos;
+        switch(c){
+            case '\r':
+            case '\n':
+                move_to(buffer.size());
+                if((prompt_columns + count_columns(buffer)) % width != 0){
+                    output.append("\n");
+                    write_output();
+                }
+                // A pasted CR LF ends one line
+                if(c == '\r' && pos < pending.size() && pending[pos] == '\n'){
+                    ++pos;
+                }
+                status = read_status::line;
+                break;
+            case ctrl_key('C'):
+                cancel_line();
+                status = read_status::interrupted;
+                break;
+            case ctrl_key('D'):
+                if(buffer.empty()){
+                    status = read_status::eof;
+                }
+                else{
+                    erase(cursor, next_char(cursor));
+                }
+                break;
+            case ctrl_key('A'):
+                move_to(0);
+                break;
+            case ctrl_key('E'):
+                move_to(buffer.size());
+                break;
+            case ctrl_key('B'):
+                move_to(previous_char(cursor));
+                break;
+            case ctrl_key('F'):
+                move_to(next_char(cursor));
+                break;
+            case ctrl_key('H'):
+            case '\x7f':
+                erase(previous_char(cursor), cursor);
+                break;
+            case ctrl_key('K'):
+                erase(cursor, buffer.size());
+                break;
+            case ctrl_key('U'):
+                erase(0, cursor);
+                break;
+            case ctrl_key('W'):
+                erase(previous_word(cursor), cursor);
+                break;
+            case ctrl_key('L'):
+                output.append("\x1b[H\x1b[2J");
+                cursor_row = 0;
+                write_output();
+                refresh();
+                break;
+            case '\t':
+                ++tab_presses;
+                complete_word();
+                break;
+            case ctrl_key('P'):
+                history_previous();
+                break;
+            case ctrl_key('N'):
+                history_next();
+                break;
+            case ctrl_key('R'):
+                end_history();
+                saved_line = buffer;
+                line_prompt = prompt;
+                searching = true;
+                show_search();
+                break;
+            default:
+                break;
+        }
+    }
+    pending.erase(0, pos);
+
+    // A closed terminal ends the line like a newline, then the input
+    if(status == read_status::editing && input_closed && pending.empty()){
+        status = buffer.empty() ? read_status::eof : read_status::line;
+    }
+    if(status == read_status::line || status == read_status::eof){
+        editing = false;
+        cursor_row = 0;
+    }
+    return status;
+}
+
+Line_Editor::read_status Line_Editor::read_input(){
+
+    char chunk[4096];
+    ssize_t count {read(in_fd, chunk, sizeof(chunk))};
+    if(count > 0){
+        pending.append(chunk, static_cast<std::size_t>(count));
+    }
+    else if(count == 0 || (errno != EINTR && errno != EAGAIN)){
+        input_closed = true;
+    }
+    return process_pending();
+}
@@ -0,0 +1,293 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+#include "execution/parallel_runner.hpp"
+#include "execution/command_hash.hpp"
+#include "execution/process_launcher.hpp"
+#include "execution/phase_stats.hpp"
+#include "system_envs.hpp"
+
+
+// The next item from the argument list, or the next non-empty line of stdin
+// that has been read completely
+bool Parallel_Runner::next_item(std::span<char* const> items, std::size_t& item_index){
+
+    if(!from_stdin){
+        if(item_index >= items.size()){
+            return false;
+        }
+        item.assign(items[item_index++]);
+        return true;
+    }
+
+    while(true){
+        std::size_t newline {input.find('\n', input_pos)};
+        if(newline == std::string::npos){
+            if(input_done && input_pos < input.size()){
+                item.assign(input, input_pos);
+                input_pos = input.size();
+                return true;
+            }
+            input.erase(0, input_pos);
+            input_pos = 0;
+            return false;
+        }
+        item.assign(input, input_pos, newline - input_pos);
+        input_pos = newline + 1;
+        if(!item.empty()){
+            return true;
+        }
+    }
+}
+
+bool Parallel_Runner::start(const char* binary_file, std::span<char* const> command, char* const* envp, int null_fd){
+
+    arguments.clear();
+    bool placed {false};
+    for(std::string_view word : command){
+        std::string& argument {arguments.emplace_back()};
+        for(std::size_t pos{0}; pos < word.size(); ){
+            std::size_t brace {word.find("{}", pos)};
+            if(brace == std::string_view::npos){
+                argument.append(word.substr(pos));
+                break;
+            }
+            argument.append(word.substr(pos, brace - pos));
+            argument.append(item);
+            placed = true;
+            pos = brace + 2;
+        }
+    }
+    if(!placed){
+        arguments.push_back(item);
+    }
+    argv.clear();
+    for(std::string& argument : arguments){
+        argv.push_back(argument.data());
+    }
+    argv.push_back(nullptr);
+
+    int out_pipe[2];
+    int err_pipe[2];
+    if(pipe2(out_pipe, O_CLOEXEC) < 0){
+        std::perror("nsh: parallel");
+        return false;
+    }
+    if(pipe2(err_pipe, O_CLOEXEC) < 0){
+        std::perror("nsh: parallel");
+        close(out_pipe[0]);
+        close(out_pipe[1]);
+        return false;
+    }
+
+    const fd_action actions[] {{out_pipe[1], STDOUT_FILENO}, {err_pipe[1], STDERR_FILENO}};
+    launch_request request;
+    request.binary_file = binary_file;
+    request.argv = argv.data();
+    request.envp = envp;
+    request.pgid = getpgrp();
+    request.input_fd = null_fd;
+    request.actions = actions;
+
+    int pid {Process_Launcher::get_instance().launch(request)};
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+    if(pid < 0){
+        close(out_pipe[0]);
+        close(err_pipe[0]);
+        return false;
+    }
+    Phase_Stats::get_instance().count_command();
+
+    // A pidfd tells when the child exited without taking SIGCHLD away from
+    // the shell's signalfd
+    item_run& run {window.emplace_back()};
+    run.pid = pid;
+    run.pidfd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+    run.out_fd = out_pipe[0];
+    run.err_fd = err_pipe[0];
+    ++running;
+    return true;
+}
+
+void Parallel_Runner::write_out(int fd, std::string_view text){
+
+    for(std::size_t done{0}; done < text.size() && !output_closed; ){
+        ssize_t count {write(fd, text.data() + done, text.size() - done)};
+        if(count < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            // Nobody reads the output any more, the items still running finish
+            output_closed = true;
+            break;
+        }
+        done += static_cast<std::size_t>(count);
+    }
+}
+
+void Parallel_Runner::read_pipe(item_run& run, int& fd, bool errors){
+
+    char chunk[16384];
+    ssize_t count {read(fd, chunk, sizeof(chunk))};
+    if(count > 0){
+        std::string_view text {chunk, static_cast<std::size_t>(count)};
+        if(&run == &window.front()){
+            write_out(errors ? STDERR_FILENO : STDOUT_FILENO, text);
+        }
+        else{
+            (errors ? run.errors : run.output).append(text);
+        }
+    }
+    else if(count == 0 || (errno != EINTR && errno != EAGAIN)){
+        close(fd);
+        fd = -1;
+    }
+}
+
+bool Parallel_Runner::is_finished(const item_run& run) noexcept{
+    return run.exited && run.out_fd < 0 && run.err_fd < 0;
+}
+
+
+int Parallel_Runner::run(std::size_t jobs, std::span<char* const> command, std::span<char* const> items, bool items_from_stdin){
+
+    // Resolved once, like the environment, for every item
+    const char* binary_file {Command_Hash::get_instance().lookup(command.front())};
+    if(!binary_file){
+        std::fprintf(stderr, "nsh: %s: command not found\n", command.front());
+        return 127;
+    }
+    char* const* envp {environment::get_envp()};
+    int null_fd {open("/dev/null", O_RDONLY | O_CLOEXEC)};
+
+    window.clear();
+    running = 0;
+    input.clear();
+    input_pos = 0;
+    from_stdin = items_from_stdin;
+    input_done = !items_from_stdin;
+    output_closed = false;
+
+    std::size_t item_index {0};
+    std::size_t failed {0};
+    bool interrupted {false};
+
+    while(true){
+
+        bool more_items {true};
+        while(!interrupted && !output_closed && running < jobs){
+            if(!next_item(items, item_index)){
+                more_items = from_stdin && !input_done;
+                break;
+            }
+            if(!start(binary_file, command, envp, null_fd)){
+                ++failed;
+            }
+        }
+
+        bool wants_input {more_items && from_stdin && !input_done && running < jobs && !interrupted && !output_closed};
+        if(window.empty() && !wants_input){
+            break;
+        }
+
+        // Without a pidfd the child is waited for once it closed its output
+        for(item_run& run : window){
+            if(!run.exited && run.pidfd < 0 && run.out_fd < 0 && run.err_fd < 0){
+                while(waitpid(run.pid, &run.status, 0) < 0 && errno == EINTR){}
+                run.exited = true;
+                --running;
+            }
+        }
+
+        pollfds.clear();
+        if(wants_input){
+            pollfds.push_back({STDIN_FILENO, POLLIN, 0});
+        }
+        for(const item_run& run : window){
+            if(run.out_fd >= 0){
+                pollfds.push_back({run.out_fd, POLLIN, 0});
+            }
+            if(run.err_fd >= 0){
+                pollfds.push_back({run.err_fd, POLLIN, 0});
+            }
+            if(!run.exited && run.pidfd >= 0){
+                pollfds.push_back({run.pidfd, POLLIN, 0});
+            }
+        }
+
+        if(!pollfds.empty() && poll(pollfds.data(), pollfds.size(), -1) < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            std::perror("nsh: parallel");
+            break;
+        }
+
+        // Same order as above
+        std::size_t index {0};
+        if(wants_input){
+            if(pollfds[index++].revents){
+                char chunk[16384];
+                ssize_t count {read(STDIN_FILENO, chunk, sizeof(chunk))};
+                if(count > 0){
+                    input.append(chunk, static_cast<std::size_t>(count));
+                }
+                else if(count == 0 || (errno != EINTR && errno != EAGAIN)){
+                    input_done = true;
+                }
+            }
+        }
+        for(item_run& run : window){
+            if(run.out_fd >= 0 && pollfds[index++].revents){
+                read_pipe(run, run.out_fd, false);
+            }
+            if(run.err_fd >= 0 && pollfds[index++].revents){
+                read_pipe(run, run.err_fd, true);
+            }
+            if(!run.exited && run.pidfd >= 0 && pollfds[index++].revents){
+                while(waitpid(run.pid, &run.status, 0) < 0 && errno == EINTR){}
+                run.exited = true;
+                close(run.pidfd);
+                run.pidfd = -1;
+                --running;
+                if(WIFSIGNALED(run.status) && WTERMSIG(run.status) == SIGINT){
+                    interrupted = true;
+                }
+            }
+        }
+
+        // Finished items leave in order, the next one catches up with what
+        // it has written meanwhile and then writes straight through
+        while(!window.empty() && is_finished(window.front())){
+            const item_run& done {window.front()};
+            if(!WIFEXITED(done.status) || WEXITSTATUS(done.status) != 0){
+                ++failed;
+            }
+            window.pop_front();
+            if(!window.empty()){
+                item_run& next {window.front()};
+                write_out(STDOUT_FILENO, next.output);
+                write_out(STDERR_FILENO, next.errors);
+                next.output.clear();
+                next.errors.clear();
+            }
+        }
+    }
+
+    if(null_fd >= 0){
+        close(null_fd);
+    }
+    if(interrupted){
+        return 130;
+    }
+    return static_cast<int>(std::min<std::size_t>(failed, 101));
+}
@@ -0,0 +1,306 @@
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <utility>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "execution/path_glob.hpp"
+
+
+void Path_Glob::read_dir(const std::string& path, dir_listing& listing){
+
+    listing.entries.clear();
+    int fd {open(path.empty() ? "." : path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+    listing.readable = (fd >= 0);
+    if(fd < 0){
+        return;
+    }
+
+    alignas(struct dirent64) char buffer[32 * 1024];
+    while(true){
+        long count {syscall(SYS_getdents64, fd, buffer, sizeof(buffer))};
+        if(count <= 0){
+            break;
+        }
+        for(long offset{0}; offset < count; ){
+            const struct dirent64* entry {reinterpret_cast<const struct dirent64*>(buffer + offset)};
+            offset += entry->d_reclen;
+
+            std::string_view name {entry->d_name};
+            if(name == "." || name == ".."){
+                continue;
+            }
+            unsigned char type {entry->d_type};
+            // Some filesystems leave the type to stat
+            if(type == DT_UNKNOWN){
+                struct stat info;
+                if(fstatat(fd, entry->d_name, &info, AT_SYMLINK_NOFOLLOW) == 0){
+                    type = S_ISDIR(info.st_mode) ? DT_DIR : (S_ISLNK(info.st_mode) ? DT_LNK : DT_REG);
+                }
+            }
+            listing.entries.push_back({std::string(name), type});
+        }
+    }
+    close(fd);
+}
+
+std::string Path_Glob::join(std::string_view dir, std::string_view name){
+
+    std::string path;
+    path.reserve(dir.size() + name.size() + 1);
+    path.append(dir);
+    if(!dir.empty() && dir.back() != '/'){
+        path.push_back('/');
+    }
+    path.append(name);
+    return path;
+}
+
+const Path_Glob::dir_listing& Path_Glob::get_listing(const std::string& path){
+
+    auto [iter, inserted] = cache.try_emplace(path);
+    if(inserted){
+        read_dir(path, iter->second);
+    }
+    return iter->second;
+}
+
+bool Path_Glob::is_dir(const std::string& path, const dir_entry& entry) const{
+
+    if(entry.type == DT_DIR){
+        return true;
+    }
+    struct stat info;
+    return entry.type == DT_LNK && stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+bool Path_Glob::is_pattern(std::string_view pattern) noexcept{
+
+    for(std::size_t i{0}; i < pattern.size(); ++i){
+        switch(pattern[i]){
+            case '\\':
+                ++i;
+                break;
+            case '*':
+            case '?':
+                return true;
+            case '[':
+                if(pattern.find(']', i + 1) != std::string_view::npos){
+                    return true;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return false;
+}
+
+void Path_Glob::remove_escapes(std::string& pattern){
+
+    std::size_t out {0};
+    for(std::size_t pos{0}; pos < pattern.size(); ++pos){
+        if(pattern[pos] == '\\' && pos + 1 < pattern.size()){
+            ++pos;
+        }
+        pattern[out++] = pattern[pos];
+    }
+    pattern.resize(out);
+}
+
+
+// Collects the directories below root, without root itself, and leaves the
+// listing of each of them in the cache
+void Path_Glob::walk_tree(const std::string& root, std::vector<std::string>& dirs){
+
+    dirs.clear();
+    std::vector<std::string> pending {root};
+    std::size_t visited {0};
+
+    // Most trees are small enough that threads would cost more than they save
+    while(!pending.empty() && visited < serial_walk_limit){
+        std::string dir {std::move(pending.back())};
+        pending.pop_back();
+        ++visited;
+
+        for(const dir_entry& entry : get_listing(dir).entries){
+            if(entry.type == DT_DIR && entry.name.front() != '.'){
+                dirs.push_back(join(dir, entry.name));
+                pending.push_back(dirs.back());
+            }
+        }
+    }
+
+    if(!pending.empty()){
+        walk_parallel(pending, dirs);
+    }
+}
+
+void Path_Glob::walk_parallel(std::vector<std::string>& pending, std::vector<std::string>& dirs){
+
+    struct walk_state{
+        std::mutex lock;
+        std::condition_variable wake;
+        std::vector<std::string> queue;
+        std::size_t busy {0};
+        std::vector<std::pair<std::string, dir_listing>> listings;
+    };
+
+    walk_state state;
+    state.queue = std::move(pending);
+
+    // The cache is only read while the workers run and filled in afterwards
+    auto worker = [this, &state, &dirs](){
+        std::vector<std::string> found;
+        std::unique_lock<std::mutex> guard {state.lock};
+        while(true){
+            state.wake.wait(guard, [&state](){
+                return !state.queue.empty() || state.busy == 0;
+            });
+            if(state.queue.empty()){
+                return;
+            }
+            std::string dir {std::move(state.queue.back())};
+            state.queue.pop_back();
+            ++state.busy;
+            guard.unlock();
+
+            dir_listing listing {};
+            auto cached = cache.find(dir);
+            bool read {cached == cache.end()};
+            if(read){
+                read_dir(dir, listing);
+            }
+            found.clear();
+            for(const dir_entry& entry : (read ? listing : cached->second).entries){
+                if(entry.type == DT_DIR && entry.name.front() != '.'){
+                    found.push_back(join(dir, entry.name));
+                }
+            }
+
+            guard.lock();
+            for(std::string& path : found){
+                dirs.push_back(path);
+                state.queue.push_back(std::move(path));
+            }
+            if(read){
+                state.listings.emplace_back(std::move(dir), std::move(listing));
+            }
+            --state.busy;
+            state.wake.notify_all();
+        }
+    };
+
+    unsigned int count {std::clamp(std::thread::hardware_concurrency(), 2u, 8u)};
+    std::vector<std::thread> workers;
+    for(unsigned int i{0}; i < count; ++i){
+        workers.emplace_back(worker);
+    }
+    for(std::thread& thread : workers){
+        thread.join();
+    }
+
+    for(auto& [path, listing] : state.listings){
+        cache.try_emplace(std::move(path), std::move(listing));
+    }
+}
+
+
+std::size_t Path_Glob::expand(std::string_view pattern, std::vector<std::string>& matches){
+
+    std::size_t first {matches.size()};
+    bool absolute {pattern.starts_with('/')};
+    bool dirs_only {pattern.ends_with('/')};
+
+    components.clear();
+    for(std::size_t pos{0}; pos < pattern.size(); ){
+        std::size_t slash {std::min(pattern.find('/', pos), pattern.size())};
+        if(slash > pos){
+            components.push_back(pattern.substr(pos, slash - pos));
+        }
+        pos = slash + 1;
+    }
+
+    paths.assign(1, absolute ? "/" : "");
+
+    for(std::size_t i{0}; i < components.size() && !paths.empty(); ++i){
+
+        std::string_view current {components[i]};
+        bool last {i + 1 == components.size()};
+        next_paths.clear();
+
+        if(current == "**"){
+            for(const std::string& path : paths){
+                walk_tree(path, tree_dirs);
+                if(!last){
+                    // ** also matches no directory at all
+                    next_paths.push_back(path);
+                    next_paths.insert(next_paths.end(), tree_dirs.begin(), tree_dirs.end());
+                    continue;
+                }
+                if(dirs_only){
+                    next_paths.insert(next_paths.end(), tree_dirs.begin(), tree_dirs.end());
+                    continue;
+                }
+                // A final ** is every file and directory below the path
+                tree_dirs.push_back(path);
+                for(const std::string& dir : tree_dirs){
+                    for(const dir_entry& entry : get_listing(dir).entries){
+                        if(entry.name.front() != '.'){
+                            next_paths.push_back(join(dir, entry.name));
+                        }
+                    }
+                }
+            }
+        }
+        else if(!is_pattern(current)){
+            component.assign(current);
+            remove_escapes(component);
+            for(const std::string& path : paths){
+                std::string candidate {join(path, component)};
+                struct stat info;
+                if(!last || (dirs_only ? stat(candidate.c_str(), &info) == 0 && S_ISDIR(info.st_mode)
+                                       : lstat(candidate.c_str(), &info) == 0)){
+                    next_paths.push_back(std::move(candidate));
+                }
+            }
+        }
+        else{
+            component.assign(current);
+            for(const std::string& path : paths){
+                for(const dir_entry& entry : get_listing(path).entries){
+                    if(fnmatch(component.c_str(), entry.name.c_str(), FNM_PERIOD) != 0){
+                        continue;
+                    }
+                    std::string candidate {join(path, entry.name)};
+                    if((last && !dirs_only) || is_dir(candidate, entry)){
+                        next_paths.push_back(std::move(candidate));
+                    }
+                }
+            }
+        }
+        std::swap(paths, next_paths);
+    }
+
+    // A pattern of only slashes matches nothing
+    if(components.empty()){
+        return 0;
+    }
+
+    for(std::string& path : paths){
+        if(dirs_only){
+            path.push_back('/');
+        }
+        matches.push_back(std::move(path));
+    }
+    std::sort(matches.begin() + static_cast<std::ptrdiff_t>(first), matches.end());
+    matches.erase(std::unique(matches.begin() + static_cast<std::ptrdiff_t>(first), matches.end()), matches.end());
+    return matches.size() - first;
+}
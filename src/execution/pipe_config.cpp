@@ -0,0 +1,125 @@
+#include <charconv>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "execution/pipe_config.hpp"
+
+
+Pipe_Config::Pipe_Config(){
+
+    const char* size_env {getenv("NSH_PIPE_SIZE")};
+    if(size_env && !parse_size(size_env, session_size)){
+        std::fprintf(stderr, "nsh: NSH_PIPE_SIZE: invalid size %s, using the default\n", size_env);
+        session_size = 0;
+    }
+}
+
+bool Pipe_Config::parse_size(std::string_view text, std::size_t& size) noexcept{
+
+    std::size_t scale {1};
+    if(!text.empty()){
+        switch(text.back()){
+            case 'k':
+            case 'K':
+                scale = 1024;
+                break;
+            case 'm':
+            case 'M':
+                scale = 1024 * 1024;
+                break;
+            default:
+                break;
+        }
+    }
+    if(scale > 1){
+        text.remove_suffix(1);
+    }
+
+    std::size_t value {0};
+    auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if(text.empty() || ec != std::errc{} || ptr != text.data() + text.size()){
+        return false;
+    }
+    size = value * scale;
+    return true;
+}
+
+std::size_t Pipe_Config::get_max_size(){
+
+    if(max_size > 0){
+        return max_size;
+    }
+
+    // 1 MiB is the kernel's default limit
+    max_size = 1024 * 1024;
+    if(std::FILE* limit {std::fopen("/proc/sys/fs/pipe-max-size", "r")}){
+        std::size_t value {0};
+        if(std::fscanf(limit, "%zu", &value) == 1 && value > 0){
+            max_size = value;
+        }
+        std::fclose(limit);
+    }
+    return max_size;
+}
+
+void Pipe_Config::apply(int pipe_fd, std::size_t size){
+
+    if(size == 0){
+        size = session_size;
+    }
+    if(size == 0){
+        return;
+    }
+
+    // Beyond the per-user pipe page limit the kernel refuses, the pipe then
+    // keeps its default size
+    fcntl(pipe_fd, F_SETPIPE_SZ, static_cast<int>(std::min(size, get_max_size())));
+}
+
+void Pipe_Config::relay_pipe(int in_fd, int out_fd){
+
+    constexpr std::size_t chunk {1 << 20};
+
+    while(true){
+        ssize_t count = splice(in_fd, nullptr, out_fd, nullptr, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if(count > 0){
+            continue;
+        }
+        if(count == 0){
+            return;
+        }
+        if(errno == EINTR){
+            continue;
+        }
+        break;
+    }
+
+    // Some files, such as ones opened with O_APPEND on older kernels, take
+    // no splice
+    char buffer[64 * 1024];
+    while(true){
+        ssize_t count = read(in_fd, buffer, sizeof(buffer));
+        if(count < 0 && errno == EINTR){
+            continue;
+        }
+        if(count <= 0){
+            return;
+        }
+        for(ssize_t written {0}; written < count; ){
+            ssize_t result = write(out_fd, buffer + written, static_cast<std::size_t>(count - written));
+            if(result < 0){
+                if(errno == EINTR){
+                    continue;
+                }
+                std::perror("nsh: relay");
+                return;
+            }
+            written += result;
+        }
+    }
+}
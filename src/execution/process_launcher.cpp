@@ -0,0 +1,146 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+
+#include "execution/process_launcher.hpp"
+#include "execution/job_cgroups.hpp"
+#include "execution/startup_trace.hpp"
+
+
+Process_Launcher::Process_Launcher() :
+    mode{launcher_mode::spawn}
+    {
+        startup_step step {"launcher"};
+        const char* mode_env {getenv("NSH_LAUNCHER")};
+        if(mode_env && !parse_mode(mode_env, mode)){
+            std::fprintf(stderr, "nsh: NSH_LAUNCHER: unknown launcher %s, using %s\n", mode_env, get_mode_name(mode));
+        }
+    }
+
+bool Process_Launcher::parse_mode(std::string_view name, launcher_mode& _mode) noexcept{
+
+    if(name == "fork"){
+        _mode = launcher_mode::fork;
+        return true;
+    }
+    if(name == "spawn"){
+        _mode = launcher_mode::spawn;
+        return true;
+    }
+    return false;
+}
+
+const char* Process_Launcher::get_mode_name(launcher_mode _mode) noexcept{
+    return (_mode == launcher_mode::fork) ? "fork" : "spawn";
+}
+
+int Process_Launcher::launch(const launch_request& request){
+
+    // posix_spawn has no way to start the child in a cgroup and moving it
+    // afterwards lets whatever it did first escape, so jobs placed in a
+    // cgroup are forked and join it before exec
+    if(mode == launcher_mode::spawn && request.cgroup_fd < 0){
+        return spawn_process(request);
+    }
+    return fork_process(request);
+}
+
+int Process_Launcher::fork_process(const launch_request& request){
+
+    int pid = fork();
+    if(pid == 0){
+        // Join the job's process group before exec, the shell may lose the race
+        setpgid(0, request.pgid);
+        if(request.cgroup_fd >= 0){
+            Job_Cgroups::move_process(request.cgroup_fd);
+        }
+
+        // The shell blocks SIGCHLD to read it from a signalfd
+        sigset_t empty_set;
+        sigemptyset(&empty_set);
+        sigprocmask(SIG_SETMASK, &empty_set, nullptr);
+
+        if(request.input_fd >= 0){
+            dup2(request.input_fd, STDIN_FILENO);
+        }
+        if(request.output_fd >= 0){
+            dup2(request.output_fd, STDOUT_FILENO);
+        }
+        for(const fd_action& action : request.actions){
+            if(dup2(action.source_fd, action.target_fd) < 0){
+                std::perror("Error");
+                std::exit(1);
+            }
+            // dup2 onto the same fd keeps O_CLOEXEC
+            if(action.source_fd == action.target_fd){
+                fcntl(action.target_fd, F_SETFD, 0);
+            }
+        }
+
+        execve(request.binary_file, request.argv, request.envp);
+        std::perror("Error");
+        std::exit(126);
+    }
+    else if(pid < 0){
+        std::perror("Error");
+        return -1;
+    }
+
+    if(setpgid(pid, request.pgid) < 0 && errno != EACCES){
+        std::perror("Error");
+    }
+    return pid;
+}
+
+int Process_Launcher::spawn_process(const launch_request& request){
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attrs;
+
+    if(posix_spawn_file_actions_init(&actions) != 0){
+        std::perror("Error");
+        return -1;
+    }
+    if(posix_spawnattr_init(&attrs) != 0){
+        posix_spawn_file_actions_destroy(&actions);
+        std::perror("Error");
+        return -1;
+    }
+
+    // dup2 clears O_CLOEXEC on the target, every other pipe fd is closed by exec
+    if(request.input_fd >= 0){
+        posix_spawn_file_actions_adddup2(&actions, request.input_fd, STDIN_FILENO);
+    }
+    if(request.output_fd >= 0){
+        posix_spawn_file_actions_adddup2(&actions, request.output_fd, STDOUT_FILENO);
+    }
+    for(const fd_action& action : request.actions){
+        posix_spawn_file_actions_adddup2(&actions, action.source_fd, action.target_fd);
+    }
+
+    // The shell blocks SIGCHLD to read it from a signalfd
+    sigset_t empty_set;
+    sigemptyset(&empty_set);
+
+    posix_spawnattr_setflags(&attrs, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attrs, request.pgid);
+    posix_spawnattr_setsigmask(&attrs, &empty_set);
+
+    pid_t pid {0};
+    int status = posix_spawn(&pid, request.binary_file, &actions, &attrs, request.argv, request.envp);
+
+    posix_spawnattr_destroy(&attrs);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if(status != 0){
+        std::fprintf(stderr, "Error: %s: %s\n", request.binary_file, std::strerror(status));
+        return -1;
+    }
+    return pid;
+}
@@ -0,0 +1,105 @@
+#include <cstdio>
+
+#include "execution/time_report.hpp"
+
+
+namespace{
+
+double to_seconds(const struct timeval& tv) noexcept{
+    return static_cast<double>(tv.tv_sec) + static_cast<double>(tv.tv_usec) / 1e6;
+}
+
+void print_json_string(std::FILE* out, std::string_view text){
+
+    std::fputc('"', out);
+    for(char ch : text){
+        switch(ch){
+            case '"':
+                std::fputs("\\\"", out);
+                break;
+            case '\\':
+                std::fputs("\\\\", out);
+                break;
+            case '\n':
+                std::fputs("\\n", out);
+                break;
+            case '\t':
+                std::fputs("\\t", out);
+                break;
+            default:
+                if(static_cast<unsigned char>(ch) < 0x20){
+                    std::fprintf(out, "\\u%04x", static_cast<unsigned>(ch));
+                }
+                else{
+                    std::fputc(ch, out);
+                }
+                break;
+        }
+    }
+    std::fputc('"', out);
+}
+
+}
+
+
+namespace time_report{
+
+void print_pipeline(std::FILE* out, time_format format, std::string_view command, double real_s,
+                    int status, std::span<const stage_time> stages){
+
+    if(format == time_format::json){
+        std::fprintf(out, "{\"type\":\"pipeline\",\"command\":");
+        print_json_string(out, command);
+        std::fprintf(out, ",\"real_s\":%.6f,\"status\":%d,\"stages\":[", real_s, status);
+        for(std::size_t i{0}; i < stages.size(); ++i){
+            const stage_time& stage {stages[i]};
+            std::fprintf(out, "%s{\"command\":", (i > 0) ? "," : "");
+            print_json_string(out, stage.command);
+            char maxrss[24] {"null"};
+            if(!stage.builtin){
+                std::snprintf(maxrss, sizeof(maxrss), "%ld", stage.usage.ru_maxrss);
+            }
+            std::fprintf(out, ",\"pid\":%d,\"builtin\":%s,\"status\":%d,\"user_s\":%.6f,\"sys_s\":%.6f,"
+                              "\"maxrss_kb\":%s,\"nvcsw\":%ld,\"nivcsw\":%ld,\"minflt\":%ld,\"majflt\":%ld}",
+                         stage.pid, stage.builtin ? "true" : "false", stage.status,
+                         to_seconds(stage.usage.ru_utime), to_seconds(stage.usage.ru_stime),
+                         maxrss, stage.usage.ru_nvcsw, stage.usage.ru_nivcsw,
+                         stage.usage.ru_minflt, stage.usage.ru_majflt);
+        }
+        std::fprintf(out, "]}\n");
+        std::fflush(out);
+        return;
+    }
+
+    std::fprintf(out, "\nreal %.6fs  status %d  %.*s\n", real_s, status, static_cast<int>(command.size()), command.data());
+    std::fprintf(out, "  %-8s %10s %10s %10s %8s %8s %9s %8s %6s  %s\n",
+                 "pid", "user", "sys", "maxrss", "vcsw", "ivcsw", "minflt", "majflt", "status", "stage");
+    for(const stage_time& stage : stages){
+        char pid[16];
+        char maxrss[24];
+        if(stage.builtin){
+            std::snprintf(pid, sizeof(pid), "builtin");
+            std::snprintf(maxrss, sizeof(maxrss), "-");
+        }
+        else{
+            std::snprintf(pid, sizeof(pid), "%d", stage.pid);
+            std::snprintf(maxrss, sizeof(maxrss), "%ldk", stage.usage.ru_maxrss);
+        }
+        std::fprintf(out, "  %-8s %9.6fs %9.6fs %10s %8ld %8ld %9ld %8ld %6d  %s\n", pid,
+                     to_seconds(stage.usage.ru_utime), to_seconds(stage.usage.ru_stime), maxrss,
+                     stage.usage.ru_nvcsw, stage.usage.ru_nivcsw, stage.usage.ru_minflt, stage.usage.ru_majflt,
+                     stage.status, stage.command.c_str());
+    }
+}
+
+void print_total(std::FILE* out, time_format format, double real_s, std::size_t pipelines){
+
+    if(format == time_format::json){
+        std::fprintf(out, "{\"type\":\"total\",\"real_s\":%.6f,\"pipelines\":%zu}\n", real_s, pipelines);
+        std::fflush(out);
+        return;
+    }
+    std::fprintf(out, "\ntotal %.6fs  %zu pipelines\n", real_s, pipelines);
+}
+
+}
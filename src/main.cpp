@@ -1,8 +1,66 @@
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+
+#include <unistd.h>
+#include <fcntl.h>
+
 #include "execution/command_execution.hpp"
+#include "execution/startup_trace.hpp"
+
+
+static void print_usage(){
+    std::fprintf(stderr, "usage: nsh [--startup-trace] [-c command | script]\n");
+}
+
+
+int main(int argc, char* argv[]){
+
+    // nsh --startup-trace ... reports each setup step on stderr
+    if(argc > 1 && std::strcmp(argv[1], "--startup-trace") == 0){
+        Startup_Trace::get_instance().enable();
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
 
+    // nsh -c 'command'
+    if(argc > 1 && std::strcmp(argv[1], "-c") == 0){
+        if(argc < 3){
+            print_usage();
+            return 2;
+        }
+        Command_Execution cmdexec {false};
+        Startup_Trace::get_instance().mark("first command");
+        int status = cmdexec.execute_line(argv[2]);
+        Startup_Trace::get_instance().mark("done");
+        return status;
+    }
 
-int main([[maybe_unused]] int argc, [[maybe_unused]] char* argv[]){
+    // nsh script
+    if(argc > 1){
+        if(argv[1][0] == '-'){
+            print_usage();
+            return 2;
+        }
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if(fd < 0){
+            std::perror(argv[1]);
+            return 127;
+        }
+        Command_Execution cmdexec {false};
+        Startup_Trace::get_instance().mark("first command");
+        int status = cmdexec.run_script(fd);
+        close(fd);
+        return status;
+    }
 
+    // nsh < commands, without a terminal there is no prompt and no job control
+    if(!isatty(STDIN_FILENO)){
+        Command_Execution cmdexec {false};
+        Startup_Trace::get_instance().mark("first command");
+        return cmdexec.run_script(STDIN_FILENO);
+    }
 
     Command_Execution cmdexec;
 